@@ -0,0 +1,572 @@
+/*
+ * Copyright (c) 2019 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file cache.c
+ * @author Tim Konick <konickt@ainfosec.com>
+ * @date March 4, 2019
+ * @brief Request caches.
+ *
+ * Caches that short-cut the policy checks for requests that have already
+ * been seen under the current policy.
+ */
+
+#include "rpc-broker.h"
+
+
+/*
+ * Each raw-dbus worker thread keeps its own caches so lookups never contend,
+ * only the counters and the domain cache generation are shared.
+ */
+static __thread struct verdict_entry verdict_cache[VERDICT_CACHE_SIZE];
+static struct verdict_cache_stats verdict_stats;
+
+static __thread struct domain_entry *domain_cache[DOMAIN_CACHE_BUCKETS];
+static __thread uint32_t domain_cache_seen;
+static uint32_t domain_cache_generation;
+
+/* only the websockets loop introspects, so this one isn't per thread */
+static struct signature_entry *signature_cache[SIGNATURE_CACHE_BUCKETS];
+static size_t signature_count;
+
+#ifdef HAVE_XENSTORE
+static struct xs_handle *xsh;
+#endif
+
+/*
+ * Drops the calling thread's domain cache once xenstore changed, and
+ * returns the generation of xenstore state the cache now holds.
+ */
+static uint32_t sync_domain_cache(void)
+{
+    uint32_t generation;
+
+    generation = __atomic_load_n(&domain_cache_generation, __ATOMIC_ACQUIRE);
+    if (generation != domain_cache_seen) {
+        free_domain_cache();
+        domain_cache_seen = generation;
+    }
+
+    return generation;
+}
+
+/*
+ * Lays out the destination, path, interface and member of a request as a
+ * cache key and hashes it.
+ *
+ * @return the length of the key or 0 if the request is too large to cache.
+ */
+static size_t build_request_key(const char *destination, const char *path,
+                                const char *interface, const char *member,
+                                char *key, uint32_t *hash)
+{
+    const char *fields[4];
+    size_t len, field_len;
+    uint32_t h;
+    int i;
+
+    fields[0] = destination;
+    fields[1] = path;
+    fields[2] = interface;
+    fields[3] = member;
+
+    len = 0;
+
+    for (i=0; i < 4; i++) {
+        field_len = fields[i] ? strlen(fields[i]) : 0;
+
+        if (len + field_len + 1 > VERDICT_KEY_MAX)
+            return 0;
+
+        if (field_len)
+            memcpy(key + len, fields[i], field_len);
+
+        len += field_len;
+        key[len++] = '\0';
+    }
+
+    h = 2166136261u;
+    for (i=0; i < len; i++) {
+        h ^= (unsigned char) key[i];
+        h *= 16777619u;
+    }
+
+    *hash = h;
+
+    return len;
+}
+
+static inline size_t build_verdict_key(struct dbus_message *dmsg, char *key,
+                                       uint32_t *hash)
+{
+    return build_request_key(dmsg->destination, dmsg->path, dmsg->interface,
+                             dmsg->member, key, hash);
+}
+
+static inline struct verdict_entry *verdict_slot(uint32_t hash, uint16_t domid,
+                                                 bool is_client)
+{
+    hash ^= (domid * 2654435761u) ^ is_client;
+
+    return &(verdict_cache[hash & (VERDICT_CACHE_SIZE - 1)]);
+}
+
+/**
+ * Looks up the verdict of a request made under the given policy generation.
+ * Rules can depend on xenstore (stubdom, dom-type), so a verdict made before
+ * a domain was introduced or released is stale too.
+ *
+ * @param dmsg the dbus request message fields.
+ * @param is_client whether the request is from the client end.
+ * @param domid the domain id of where the request is being made.
+ * @param generation the generation of the policy in place.
+ * @param allowed set to the cached verdict on a hit.
+ *
+ * @return true on a cache hit.
+ */
+bool verdict_cache_lookup(struct dbus_message *dmsg, bool is_client,
+                          uint16_t domid, uint32_t generation, bool *allowed)
+{
+    char key[VERDICT_KEY_MAX];
+    size_t len;
+    uint32_t hash;
+    struct verdict_entry *entry;
+
+    len = build_verdict_key(dmsg, key, &hash);
+    if (len == 0) {
+        STAT_INC(verdict_stats.uncacheable);
+        return false;
+    }
+
+    entry = verdict_slot(hash, domid, is_client);
+
+    if (!entry->key || entry->generation != generation ||
+        entry->domain_generation != sync_domain_cache() ||
+        entry->hash != hash || entry->domid != domid    ||
+        entry->is_client != is_client || entry->key_len != len ||
+        memcmp(entry->key, key, len)) {
+        STAT_INC(verdict_stats.misses);
+        return false;
+    }
+
+    STAT_INC(verdict_stats.hits);
+    *allowed = entry->allowed;
+
+    return true;
+}
+
+/**
+ * Stores the verdict of a request made under the given policy generation.
+ * Whatever was held in the slot is replaced.
+ *
+ * @param dmsg the dbus request message fields.
+ * @param is_client whether the request is from the client end.
+ * @param domid the domain id of where the request is being made.
+ * @param generation the generation of the policy in place.
+ * @param allowed the verdict the policy gave the request.
+ */
+void verdict_cache_insert(struct dbus_message *dmsg, bool is_client,
+                          uint16_t domid, uint32_t generation, bool allowed)
+{
+    char key[VERDICT_KEY_MAX];
+    size_t len;
+    uint32_t hash;
+    struct verdict_entry *entry;
+
+    len = build_verdict_key(dmsg, key, &hash);
+    if (len == 0)
+        return;
+
+    entry = verdict_slot(hash, domid, is_client);
+
+    if (entry->key && entry->generation == generation)
+        STAT_INC(verdict_stats.evictions);
+
+    if (entry->key_len < len || !entry->key) {
+        entry->key = realloc(entry->key, len);
+        if (!entry->key)
+            DBUS_BROKER_ERROR("Realloc Failed!");
+    }
+
+    memcpy(entry->key, key, len);
+    entry->key_len = len;
+    entry->hash = hash;
+    entry->generation = generation;
+    /* the xenstore state the verdict was made from, see `sync_domain_cache` */
+    entry->domain_generation = domain_cache_seen;
+    entry->domid = domid;
+    entry->is_client = is_client;
+    entry->allowed = allowed;
+}
+
+/**
+ * Counts a request whose verdict can't be cached.
+ */
+void verdict_cache_uncacheable(void)
+{
+    STAT_INC(verdict_stats.uncacheable);
+}
+
+/**
+ * Returns a copy of the verdict cache counters, summed over every worker.
+ */
+struct verdict_cache_stats verdict_cache_get_stats(void)
+{
+    struct verdict_cache_stats stats;
+
+    stats.hits = __atomic_load_n(&verdict_stats.hits, __ATOMIC_RELAXED);
+    stats.misses = __atomic_load_n(&verdict_stats.misses, __ATOMIC_RELAXED);
+    stats.uncacheable = __atomic_load_n(&verdict_stats.uncacheable,
+                                        __ATOMIC_RELAXED);
+    stats.evictions = __atomic_load_n(&verdict_stats.evictions,
+                                      __ATOMIC_RELAXED);
+
+    return stats;
+}
+
+/**
+ * Free's the keys held by the calling thread's verdict cache.
+ */
+void free_verdict_cache(void)
+{
+    int i;
+
+    for (i=0; i < VERDICT_CACHE_SIZE; i++) {
+        if (verdict_cache[i].key)
+            free(verdict_cache[i].key);
+
+        verdict_cache[i].key = NULL;
+        verdict_cache[i].key_len = 0;
+    }
+}
+
+/**
+ * Free's the calling thread's domain cache.
+ */
+void free_domain_cache(void)
+{
+    int i;
+    struct domain_entry *entry, *next;
+
+    for (i=0; i < DOMAIN_CACHE_BUCKETS; i++) {
+        for (entry = domain_cache[i]; entry; entry = next) {
+            next = entry->next;
+            if (entry->vm_path)
+                free(entry->vm_path);
+            free(entry);
+        }
+
+        domain_cache[i] = NULL;
+    }
+}
+
+/**
+ * Opens the xenstore connection kept for the lifetime of the broker and
+ * watches for domains being introduced or released.
+ *
+ * @return the file descriptor to poll for watch events, -1 otherwise.
+ */
+int init_xenstore_cache(void)
+{
+    int fd;
+
+    fd = -1;
+
+#ifdef HAVE_XENSTORE
+    xsh = xs_open(XS_OPEN_READONLY);
+
+    if (!xsh) {
+        DBUS_BROKER_WARNING("xenstore open failed <%s>", strerror(errno));
+        return -1;
+    }
+
+    if (!xs_watch(xsh, XENSTORE_RELEASE_WATCH, XENSTORE_RELEASE_WATCH) ||
+        !xs_watch(xsh, XENSTORE_INTRODUCE_WATCH, XENSTORE_INTRODUCE_WATCH))
+        DBUS_BROKER_WARNING("xenstore watch failed <%s>", strerror(errno));
+
+    fd = xs_fileno(xsh);
+#endif
+
+    return fd;
+}
+
+/**
+ * Drains any pending xenstore watch events without blocking.  Any domain
+ * being introduced or released invalidates the domain cache, a domid may be
+ * reused by a different VM.  Every worker's cache is flushed on its next
+ * lookup.
+ */
+void service_xenstore_watches(void)
+{
+#ifdef HAVE_XENSTORE
+    char **event;
+    bool flush;
+
+    if (!xsh)
+        return;
+
+    flush = false;
+
+    while ((event = xs_check_watch(xsh)) != NULL) {
+        flush = true;
+        free(event);
+    }
+
+    if (flush)
+        __atomic_fetch_add(&domain_cache_generation, 1, __ATOMIC_RELEASE);
+#endif
+}
+
+static void fill_domain_entry(struct domain_entry *entry)
+{
+#ifdef HAVE_XENSTORE
+    unsigned int len;
+    char path[256] = { 0 };
+    void *target;
+
+    if (!xsh)
+        return;
+
+    snprintf(path, 255, "/local/domain/%d/vm", entry->domid);
+    entry->vm_path = (char *) xs_read(xsh, XBT_NULL, path, &len);
+
+    snprintf(path, 255, "/local/domain/%d%s", entry->domid, XENSTORE_TARGET);
+    target = xs_read(xsh, XBT_NULL, path, &len);
+
+    if (target) {
+        entry->stubdom = len > 0;
+        free(target);
+    }
+
+    if (verbose_logging)
+        DBUS_BROKER_EVENT("Domain cache: <%d> vm-path: %s stubdom: %d",
+                          entry->domid, entry->vm_path ? entry->vm_path : "",
+                          entry->stubdom);
+#endif
+}
+
+/**
+ * Returns the cached xenstore information for a domain, reading it from
+ * xenstore on the first lookup since the cache was last invalidated.
+ *
+ * @param domid the domain id to look up.
+ *
+ * @return the cache entry for the domain.
+ */
+struct domain_entry *domain_cache_lookup(uint16_t domid)
+{
+    struct domain_entry *entry;
+    int bucket;
+
+    sync_domain_cache();
+
+    bucket = domid & (DOMAIN_CACHE_BUCKETS - 1);
+
+    for (entry = domain_cache[bucket]; entry; entry = entry->next) {
+        if (entry->domid == domid)
+            return entry;
+    }
+
+    entry = calloc(1, sizeof *entry);
+    if (!entry)
+        DBUS_BROKER_ERROR("Calloc Failed!");
+
+    entry->domid = domid;
+    fill_domain_entry(entry);
+
+    entry->next = domain_cache[bucket];
+    domain_cache[bucket] = entry;
+
+    return entry;
+}
+
+/**
+ * Free's the domain cache and closes the xenstore connection.
+ */
+void free_xenstore_cache(void)
+{
+    free_domain_cache();
+
+#ifdef HAVE_XENSTORE
+    if (xsh)
+        xs_close(xsh);
+
+    xsh = NULL;
+#endif
+}
+
+static struct signature_entry *find_signature(const char *key, size_t len,
+                                              uint32_t hash)
+{
+    struct signature_entry *entry;
+
+    entry = signature_cache[hash & (SIGNATURE_CACHE_BUCKETS - 1)];
+
+    for (; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->key_len == len &&
+            !memcmp(entry->key, key, len))
+            return entry;
+    }
+
+    return NULL;
+}
+
+/**
+ * Looks up the input signature of a method.  Once an object has been
+ * introspected every member it lists is cached, a member it doesn't list has
+ * an empty signature.
+ *
+ * @param destination the destination of the request.
+ * @param path the object path of the request.
+ * @param interface the interface of the request.
+ * @param member the method being called.
+ * @param signature set to the cached signature on a hit.
+ *
+ * @return true on a cache hit, false if the object needs introspecting.
+ */
+bool signature_cache_lookup(const char *destination, const char *path,
+                            const char *interface, const char *member,
+                            const char **signature)
+{
+    char key[VERDICT_KEY_MAX];
+    struct signature_entry *entry;
+    uint32_t hash;
+    size_t len;
+
+    len = build_request_key(destination, path, interface, member, key, &hash);
+    if (len == 0)
+        return false;
+
+    if ((entry = find_signature(key, len, hash)) != NULL) {
+        *signature = entry->signature;
+        return true;
+    }
+
+    len = build_request_key(destination, path, NULL, NULL, key, &hash);
+    if (find_signature(key, len, hash) != NULL) {
+        *signature = "";
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Caches the input signature of a method, the first signature cached for a
+ * member is kept.  A NULL interface and member marks the whole object as
+ * introspected.
+ *
+ * @param destination the destination the object belongs to.
+ * @param path the object path.
+ * @param interface the interface of the member.
+ * @param member the name of the member.
+ * @param signature the null-terminated signature.
+ */
+void signature_cache_insert(const char *destination, const char *path,
+                            const char *interface, const char *member,
+                            const char *signature)
+{
+    char key[VERDICT_KEY_MAX];
+    struct signature_entry *entry, **bucket;
+    uint32_t hash;
+    size_t len;
+
+    len = build_request_key(destination, path, interface, member, key, &hash);
+    if (len == 0 || find_signature(key, len, hash))
+        return;
+
+    entry = malloc(sizeof *entry);
+    if (!entry)
+        DBUS_BROKER_ERROR("Malloc Failed!");
+
+    entry->key = malloc(len);
+    if (!entry->key)
+        DBUS_BROKER_ERROR("Malloc Failed!");
+
+    memcpy(entry->key, key, len);
+    entry->key_len = len;
+    entry->hash = hash;
+    snprintf(entry->signature, DBUS_MAX_ARG_LEN, "%s", signature);
+
+    bucket = &(signature_cache[hash & (SIGNATURE_CACHE_BUCKETS - 1)]);
+    entry->next = *bucket;
+    *bucket = entry;
+    signature_count++;
+}
+
+/**
+ * Flushes the signature cache once it holds SIGNATURE_CACHE_MAX entries, a
+ * client can have any number of objects introspected.  Called before an
+ * object's signatures are cached, so an object is never left marked as
+ * introspected with some of its members dropped.
+ */
+void trim_signature_cache(void)
+{
+    if (signature_count >= SIGNATURE_CACHE_MAX)
+        free_signature_cache();
+}
+
+/**
+ * Drops every signature cached for a destination, its owner has changed and
+ * may export different objects.
+ *
+ * @param destination the bus name whose owner changed.
+ */
+void invalidate_signature_cache(const char *destination)
+{
+    struct signature_entry **curr, *entry;
+    size_t len;
+    int i;
+
+    len = strlen(destination) + 1;
+
+    for (i=0; i < SIGNATURE_CACHE_BUCKETS; i++) {
+        curr = &(signature_cache[i]);
+
+        while ((entry = *curr) != NULL) {
+            if (entry->key_len >= len && !memcmp(entry->key, destination, len)) {
+                *curr = entry->next;
+                free(entry->key);
+                free(entry);
+                signature_count--;
+            } else
+                curr = &(entry->next);
+        }
+    }
+}
+
+/**
+ * Free's every cached signature.
+ */
+void free_signature_cache(void)
+{
+    struct signature_entry *entry, *next;
+    int i;
+
+    for (i=0; i < SIGNATURE_CACHE_BUCKETS; i++) {
+        for (entry = signature_cache[i]; entry; entry = next) {
+            next = entry->next;
+            free(entry->key);
+            free(entry);
+        }
+
+        signature_cache[i] = NULL;
+    }
+
+    signature_count = 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2019 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file cache.h
+ * @author Tim Konick <konickt@ainfosec.com>
+ * @date March 4, 2019
+ * @brief Cache declarations.
+ *
+ * Data structures and functions for the caches kept in front of the policy
+ * checks made on every request.
+ */
+
+#define VERDICT_CACHE_SIZE 1024  /* must be a power of two */
+#define VERDICT_KEY_MAX     512
+
+/**
+ * @brief a cached policy verdict for a request.
+ *
+ * The key holds the destination, path, interface and member of the request
+ * separated by null bytes.  Entries made under an older policy generation, or
+ * before xenstore last changed (`domain_generation`), are stale and treated
+ * as empty.
+ */
+struct verdict_entry {
+    uint32_t hash;
+    uint32_t generation;
+    uint32_t domain_generation;
+    uint16_t domid;
+    bool is_client;
+    bool allowed;
+    size_t key_len;
+    char *key;
+};
+
+/* counters are shared between raw-dbus workers */
+#define STAT_INC(counter) __atomic_fetch_add(&(counter), 1, __ATOMIC_RELAXED)
+
+/**
+ * @brief hit and miss counters for the verdict cache.
+ */
+struct verdict_cache_stats {
+    size_t hits;
+    size_t misses;
+    size_t uncacheable;
+    size_t evictions;
+};
+
+#define DOMAIN_CACHE_BUCKETS 64  /* must be a power of two */
+
+#define XENSTORE_RELEASE_WATCH   "@releaseDomain"
+#define XENSTORE_INTRODUCE_WATCH "@introduceDomain"
+
+/**
+ * @brief xenstore information cached for a domain.
+ *
+ * Entries are kept for domains that don't exist as well (`vm_path` is NULL),
+ * the whole cache is dropped whenever a domain is introduced or released.
+ */
+struct domain_entry {
+    uint16_t domid;
+    bool stubdom;
+    char *vm_path;
+    struct domain_entry *next;
+};
+
+#define SIGNATURE_CACHE_BUCKETS 256  /* must be a power of two */
+#define SIGNATURE_CACHE_MAX     8192 /* entries, flushed once reached */
+
+/**
+ * @brief the input signature of a method, cached from the introspection of
+ * the object it belongs to.
+ *
+ * The key holds the destination, path, interface and member separated by null
+ * bytes.  An entry with no interface and member marks an object as
+ * introspected, members missing from it have an empty signature.
+ */
+struct signature_entry {
+    uint32_t hash;
+    size_t key_len;
+    char *key;
+    char signature[DBUS_MAX_ARG_LEN];
+    struct signature_entry *next;
+};
+
+/* src/cache.c */
+bool verdict_cache_lookup(struct dbus_message *dmsg, bool is_client,
+                          uint16_t domid, uint32_t generation, bool *allowed);
+
+void verdict_cache_insert(struct dbus_message *dmsg, bool is_client,
+                          uint16_t domid, uint32_t generation, bool allowed);
+
+void verdict_cache_uncacheable(void);
+
+struct verdict_cache_stats verdict_cache_get_stats(void);
+
+void free_verdict_cache(void);
+
+int init_xenstore_cache(void);
+
+void service_xenstore_watches(void);
+
+struct domain_entry *domain_cache_lookup(uint16_t domid);
+
+void free_domain_cache(void);
+
+void free_xenstore_cache(void);
+
+bool signature_cache_lookup(const char *destination, const char *path,
+                            const char *interface, const char *member,
+                            const char **signature);
+
+void signature_cache_insert(const char *destination, const char *path,
+                            const char *interface, const char *member,
+                            const char *signature);
+
+void trim_signature_cache(void);
+
+void invalidate_signature_cache(const char *destination);
+
+void free_signature_cache(void);
@@ -28,56 +28,52 @@
 #include "rpc-broker.h"
 
 
-static inline char *get_db_vm_path(uint16_t domid)
+static inline const char *get_db_vm_path(uint16_t domid)
 {
-#ifdef HAVE_XENSTORE
-    size_t len;
-    char path[256] = { 0 };
-    char *uuid;
-    struct xs_handle *xsh;
-
-    xsh = xs_open(XS_OPEN_READONLY);
-
-    if (!xsh)
-       return NULL;
-
-    snprintf(path, 255, "/local/domain/%d/vm", domid);
-
-    uuid = (char *) xs_read(xsh, XBT_NULL, path, &len);
-    if (uuid != NULL)
-        DBUS_BROKER_EVENT("Find Domid Failed: %d", domid); 
-    else
-        DBUS_BROKER_EVENT("Found DOMID: %d", domid); 
-
-    xs_close(xsh);
+    return domain_cache_lookup(domid)->vm_path;
+}
 
-    return uuid;
-#endif
-    return NULL;
+/* an unset field matches anything, otherwise the symbols have to agree */
+static inline bool field_matches(uint32_t id, uint32_t field)
+{
+    return id == SYMBOL_NONE || id == field;
 }
 
-static int filter_if_bool(DBusConnection *conn, char *uuid,
-                          char *bool_cond, bool bool_flag)
+/* the attributes are cached with the domain's policy, none without one */
+static int filter_if_bool(struct domain_policy *domain,
+                          struct rule *policy_rule)
 {
-    char *arg, *attr_cond;
+    uint16_t attribute_id;
+    uint8_t state;
     int rc;
 
     rc = 0;
-    arg = NULL;
-    attr_cond = NULL;
+    attribute_id = RULE_ATTRIBUTE(policy_rule);
 
-    DBUS_REQ_ARG(arg, "%s/%s", uuid, bool_cond);
-    attr_cond = db_query(conn, arg);
-    free(arg);
+    if (domain && attribute_id < domain->attribute_count)
+        state = domain->attributes[attribute_id];
+    else
+        state = VM_ATTR_MISSING;
 
-    if (!attr_cond)
-        return -1;
+    switch (state) {
 
-    if ((!strcmp("true", attr_cond) && bool_flag == false) ||
-        (!strcmp("false", attr_cond) && bool_flag == true))
-        rc = -1;
+        case (VM_ATTR_MISSING):
+            rc = -1;
+            break;
 
-    free(attr_cond);
+        case (VM_ATTR_TRUE):
+            if (!(policy_rule->flags & RULE_IF_BOOL_TRUE))
+                rc = -1;
+            break;
+
+        case (VM_ATTR_FALSE):
+            if (policy_rule->flags & RULE_IF_BOOL_TRUE)
+                rc = -1;
+            break;
+
+        default:
+            break;
+    }
 
     return rc;
 }
@@ -110,23 +106,26 @@ static int filter_domtype(DBusConnection *conn, char *uuid,
  * Checks a rule for any given request, compares the policy-rule against
  * the dbus request being made.
  *
+ * @param dbus_policy The policy snapshot the rule belongs to.
  * @param policy_rule One of the policy rules being compared against.
  * @param dmsg Structure object of the request being made.
  * @param domid Domain id from where the request came.
+ * @param domain The domain's policy, NULL if it has none (yet).
  *
  * @return 0 policy is to deny, 1 policy is to allow, -1 the rule did not match
  */
-static int rule_matches_request(struct rule *policy_rule,
+static int rule_matches_request(struct policy *dbus_policy,
+                                struct rule *policy_rule,
                                 bool is_client,
                                 struct dbus_message *dmsg,
-                                uint16_t domid)
+                                uint16_t domid,
+                                struct domain_policy *domain)
 {
     //
     if (domid == 0)
         return 1;
     //
-    DBusConnection *conn;
-    char *uuid;
+    const char *uuid;
     int filter_policy;
 
     if (!policy_rule || !dmsg) {
@@ -134,83 +133,131 @@ static int rule_matches_request(struct rule *policy_rule,
         return -1;
     }
 
-    filter_policy = policy_rule->policy;
-    conn = NULL;
+    filter_policy = (policy_rule->flags & RULE_ALLOW) ? 1 : 0;
     uuid = NULL;
 
-    if (policy_rule->all)
+    if (policy_rule->flags & RULE_ALL)
         return filter_policy;
 
-    if (!is_client && policy_rule->out)
+    if (!is_client && (policy_rule->flags & RULE_OUT))
         return filter_policy;
-    else if (is_client && policy_rule->out)
+    else if (is_client && (policy_rule->flags & RULE_OUT))
         return -1;
 
-    if ((policy_rule->stubdom && !is_stubdom(domid))                     ||
-        (policy_rule->destination && strcmp(policy_rule->destination,
-                                                 dmsg->destination))     ||
-        (policy_rule->path && strcmp(policy_rule->path, dmsg->path))     ||
-        (policy_rule->interface && strcmp(policy_rule->interface,
-                                                 dmsg->interface))       ||
-        (policy_rule->member && strcmp(policy_rule->member, dmsg->member))) {
+    if (((policy_rule->flags & RULE_STUBDOM) && !is_stubdom(domid))      ||
+        !field_matches(policy_rule->destination, dmsg->destination_id)   ||
+        !field_matches(policy_rule->path, dmsg->path_id)                 ||
+        !field_matches(policy_rule->interface, dmsg->interface_id)       ||
+        !field_matches(policy_rule->member, dmsg->member_id)) {
         filter_policy = -1;
         goto policy_set;
     }
 
-    if (!dbus_broker_policy->database)
+    if (!dbus_policy->database)
         goto policy_set;
 
-    if (policy_rule->if_bool || policy_rule->domtype) {
-        conn = create_dbus_connection();
+    if (policy_rule->if_bool != SYMBOL_NONE &&
+        filter_if_bool(domain, policy_rule) < 0) {
+        filter_policy = -1;
+        goto policy_set;
+    }
+
+    if (policy_rule->domtype != SYMBOL_NONE) {
         uuid = get_db_vm_path(domid);
         if (uuid == NULL) {
             filter_policy = -1;
             goto policy_set;
         }
-
-        if (policy_rule->if_bool &&
-            filter_if_bool(conn, uuid, (char *) policy_rule->if_bool,
-                                       policy_rule->if_bool_flag) < 0) {
-            filter_policy = -1;
-            goto policy_set;
-        }
     }
 
 policy_set:
 
-    if (uuid)
-        free(uuid);
-
     return filter_policy;
 }
 
-static struct domain_policy *get_domain_policy(char *uuid)
+/*
+ * Runs a request against a list of rules using its compiled index.  Only the
+ * rules in buckets that are able to match the request are checked.  As the
+ * policy is last match, the candidate rules are walked from the last position
+ * to the first and the first rule that matches decides the request.
+ * `cacheable` is cleared if any rule checked depends on database state.
+ *
+ * @return 0 policy is to deny, 1 policy is to allow, -1 no rule matched
+ */
+static int evaluate_rules(struct policy *dbus_policy,
+                          struct rule_set *set, bool is_client,
+                          struct dbus_message *dmsg, uint16_t domid,
+                          struct domain_policy *domain, bool *cacheable)
 {
-    int domains;
-    int i;
+    struct rule_bucket *buckets[RULE_INDEX_PROBES];
+    size_t cursors[RULE_INDEX_PROBES];
+    size_t found, i, next;
+    int64_t position;
+    int current_rule_policy;
+    struct rule *policy_rule;
+
+    /* rule_matches_request() passes every rule for dom0 */
+    if (domid == 0)
+        return set->count > 0 ? 1 : -1;
+
+    found = lookup_rule_index(&(set->index), dmsg, buckets);
 
-    domains = dbus_broker_policy->domain_count;
+    for (i=0; i < found; i++)
+        cursors[i] = buckets[i]->count;
 
-    for (i=0; i < domains; i++) {
-        if (!strcmp(dbus_broker_policy->domains[i].uuid_db_fmt, uuid))
-            return &(dbus_broker_policy->domains[i]);
+    while (true) {
+        position = -1;
+        next = 0;
+
+        /* merge the buckets, taking the highest position left each pass */
+        for (i=0; i < found; i++) {
+            if (cursors[i] == 0)
+                continue;
+
+            if ((int64_t) buckets[i]->positions[cursors[i] - 1] > position) {
+                position = buckets[i]->positions[cursors[i] - 1];
+                next = i;
+            }
+        }
+
+        if (position < 0)
+            break;
+
+        cursors[next]--;
+
+        policy_rule = &(set->rules[position]);
+        if (policy_rule->if_bool != SYMBOL_NONE)
+            *cacheable = false;
+
+        current_rule_policy = rule_matches_request(dbus_policy, policy_rule,
+                                                   is_client, dmsg, domid,
+                                                   domain);
+        if (current_rule_policy != -1)
+            return current_rule_policy;
     }
 
-    return NULL;
+    return -1;
 }
 
 bool filter_property_request(struct dbus_message *dmsg, int domid)
 {
     struct dbus_message property_req;
+    const char *interface, *member;
 
-    property_req.destination = dmsg->destination;
-    property_req.interface = ((char **) dmsg->args)[0];
-    property_req.path = "/";
+    memset(&property_req, 0, sizeof(property_req));
+
+    /* only the arguments naming the property are decoded */
+    interface = get_string_arg(dmsg, 0);
 
-    if (strcmp(dmsg->member, "GetAll")) 
-        property_req.member = ((char **) dmsg->args)[1];
+    if (strcmp(dmsg->member, "GetAll"))
+        member = get_string_arg(dmsg, 1);
     else
-        property_req.member = "None";
+        member = "None";
+
+    property_req.destination = dmsg->destination;
+    property_req.interface = interface ? interface : "NULL";
+    property_req.member = member ? member : "NULL";
+    property_req.path = "/";
 
     if (verbose_logging)
         DBUS_BROKER_EVENT("Filter Property: <%s> %s", property_req.destination, 
@@ -232,21 +279,24 @@ bool filter_property_request(struct dbus_message *dmsg, int domid)
  */
 bool is_request_allowed(struct dbus_message *dmsg, bool is_client, int domid)
 {
-    bool allowed;
+    bool allowed, cacheable, loaded;
     int current_rule_policy;
-    struct etc_policy domain_etc_policy;
+    struct policy *dbus_policy;
+    struct etc_policy *domain_etc_policy;
+    struct domain_policy *domain;
 
-    int i;
     char req_msg[1024] = { '\0' };
-    char *uuid;
 
     if (!dmsg) {
         DBUS_BROKER_WARNING("Invalid args to broker-request %s", "");
         return false;
     }
 
-    if (!dbus_broker_policy) {
+    /* the whole request is filtered against the same policy snapshot */
+    dbus_policy = acquire_policy();
+    if (!dbus_policy) {
         DBUS_BROKER_WARNING("No policy in place %s", "");
+        release_policy();
         return false;
     }
 
@@ -254,60 +304,84 @@ bool is_request_allowed(struct dbus_message *dmsg, bool is_client, int domid)
     allowed = false;
     /* sets the current-rule-policy to default */
     current_rule_policy = 0;
+    cacheable = true;
+
+    if (verdict_cache_lookup(dmsg, is_client, domid,
+                             dbus_policy->generation, &allowed))
+        goto verdict_done;
+
+    /*
+     * Only the rules need symbol ids, a message is resolved the first time it
+     * misses the cache and again if the policy interned symbols since.
+     */
+    if (dmsg->symbol_version < dbus_policy->symbol_version)
+        resolve_message_symbols(dmsg);
+
+    domain_etc_policy = dbus_policy->domain_etc_policy;
+
+    /* the /etc rules check the domain's attributes too */
+    domain = NULL;
+    loaded = dbus_policy->database && domid >= 0 && domid <= UINT16_MAX;
+
+    /* the /etc policy alone stands in while the vm's policy is loaded */
+    if (loaded && !lookup_domid_policy(dbus_policy, domid, &domain)) {
+        request_domid_load(domid);
+        cacheable = false;
+        loaded = false;
+    }
 
-    domain_etc_policy = dbus_broker_policy->domain_etc_policy;
-
-    for (i=0; i < domain_etc_policy.count; i++) {
-        current_rule_policy = rule_matches_request(&(domain_etc_policy.rules[i]),
-                                                   is_client, dmsg, domid);
-        /*
-         *  1 = the rule matched the request and rule's policy is allow
-         *  0 = the rule matched the request and rule's policy is deny
-         * -1 = the rule did *not* match the request
-         *
-         *  The filter is set up as last match, with the default being "deny".
-         *  Iterating through all the rules, if a rule matches a request, then
-         *  update "allowed" to fit with the "current-rule-policy" (whether
-         *  thats allow or deny).  If there is no match (-1) then "allowed"
-         *  remains unchanged, remaining set as it was before the rule being
-         *  checked.
-         */
-        if (current_rule_policy == -1)
-            continue;
-
+    current_rule_policy = evaluate_rules(dbus_policy,
+                                         &(domain_etc_policy->rules),
+                                         is_client, dmsg, domid, domain,
+                                         &cacheable);
+    /*
+     *  1 = a rule matched the request and rule's policy is allow
+     *  0 = a rule matched the request and rule's policy is deny
+     * -1 = no rule matched the request
+     *
+     *  The filter is set up as last match, with the default being "deny".
+     *  `evaluate_rules` returns the policy of the last rule that matches the
+     *  request.  If there is no match (-1) then "allowed" remains unchanged,
+     *  remaining set as it was before the rules being checked.
+     */
+    if (current_rule_policy != -1)
         allowed = current_rule_policy == 0 ? false : true;
-    }
 
-    if (!dbus_broker_policy->database || domid >= UUID_CACHE_LIMIT)
+    if (!loaded || !domain)
         goto filtering_done;
 
-    if (domain_uuids[domid])
-        uuid = domain_uuids[domid];
-    else {
-        uuid = get_uuid_from_domid(domid);
-        domain_uuids[domid] = uuid;
-    }
+    current_rule_policy = evaluate_rules(dbus_policy, &(domain->rules),
+                                         is_client, dmsg, domid, domain,
+                                         &cacheable);
+    if (current_rule_policy != -1)
+        allowed = current_rule_policy == 0 ? false : true;
 
-    if (!uuid)
-        goto filtering_done;
+    /* the verdict for properties depends on the arguments of the request */
+    if (!strcmp("org.freedesktop.DBus.Properties", dmsg->interface)) {
+        allowed = filter_property_request(dmsg, domid);
+        cacheable = false;
+    }
 
-    struct domain_policy *domain = get_domain_policy(uuid);
+filtering_done:
 
-    if (!domain)
-        goto filtering_done;
+    if (cacheable)
+        verdict_cache_insert(dmsg, is_client, domid,
+                             dbus_policy->generation, allowed);
+    else
+        verdict_cache_uncacheable();
 
-    for (i=0; i < domain->count; i++) {
-        current_rule_policy = rule_matches_request(&(domain->rules[i]),
-                                                   is_client, dmsg, domid);
-        if (current_rule_policy == -1)
-            continue;
-        allowed = current_rule_policy == 0 ? false : true;
-    }
+verdict_done:
 
-    if (!strcmp("org.freedesktop.DBus.Properties", dmsg->interface)) 
-        allowed = filter_property_request(dmsg, domid);
+    /* the policy is shared by every raw-dbus worker */
+    __atomic_fetch_add(&dbus_policy->total_requests, 1, __ATOMIC_RELAXED);
+    if (allowed)
+        __atomic_fetch_add(&dbus_policy->allowed_requests, 1,
+                           __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_add(&dbus_policy->denied_requests, 1,
+                           __ATOMIC_RELAXED);
 
-filtering_done:
+    release_policy();
 
     if (verbose_logging) {
         snprintf(req_msg, 1023, "Dom: %d [Dest: %s Path: %s Iface: %s Meth: %s]",
@@ -328,7 +402,7 @@ void debug_raw_buffer(char *buf, int rbytes)
     char tmp[DBUS_MSG_LEN] = { '\0' };
 
     int i;
-    for (i=0; i < rbytes; i++) {
+    for (i=0; i < rbytes && i < DBUS_MSG_LEN - 1; i++) {
         if (isalnum(buf[i]))
             tmp[i] = buf[i];
         else
@@ -339,49 +413,545 @@ void debug_raw_buffer(char *buf, int rbytes)
 }
 
 /*
- * This is an opaque exchange reading off from the receiving end of a raw-dbus
- * connection.  For rpc-broker sessions running "raw" mode, whenever a client
- * connects, another connection is opened on the bus.  Each of these sockets
- * are added to the event-loop.  Whenever a connection triggers the callback,
- * this function is invocated to receive the data being sent and then determine
- * (from the filter) if this message should be allowed or denied.
+ * Appends bytes to an output queue, reclaiming the space of bytes already
+ * written before growing the buffer.
+ */
+static void queue_output(struct dbus_output *output, const char *buf,
+                         size_t len)
+{
+    size_t size;
+
+    if (output->size - output->len < len && output->sent > 0) {
+        output->len -= output->sent;
+        memmove(output->buf, output->buf + output->sent, output->len);
+        output->sent = 0;
+    }
+
+    if (output->size - output->len < len) {
+        size = output->len + len;
+        if (size < output->size * 2)
+            size = output->size * 2;
+
+        output->buf = realloc(output->buf, size);
+        if (!output->buf)
+            DBUS_BROKER_ERROR("Realloc Failed!");
+
+        output->size = size;
+    }
+
+    memcpy(output->buf + output->len, buf, len);
+    output->len += len;
+}
+
+/*
+ * Forwards frames to the other end of the session.  Bytes are written
+ * straight to the socket while nothing is queued ahead of them, whatever the
+ * socket won't take right now is queued on the peer's output.
+ *
+ * @return 0 on success, -1 if the send failed.
+ */
+static int forward_frames(struct raw_dbus_conn *conn, const char *buf,
+                          size_t len)
+{
+    struct dbus_output *output;
+    ssize_t sbytes;
+
+    output = &(conn->peer->output);
+
+    while (len > 0 && OUTPUT_PENDING(output) == 0) {
+        sbytes = send(conn->sender, buf, len, MSG_NOSIGNAL);
+        if (sbytes < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+
+        buf += sbytes;
+        len -= sbytes;
+    }
+
+    if (len > 0)
+        queue_output(output, buf, len);
+
+    return 0;
+}
+
+static void reserve_framer(struct dbus_framer *framer, size_t size)
+{
+    if (framer->size >= size)
+        return;
+
+    framer->buf = realloc(framer->buf, size);
+    if (!framer->buf)
+        DBUS_BROKER_ERROR("Realloc Failed!");
+
+    framer->size = size;
+}
+
+/*
+ * Returns the length of the next authentication line (including the "\r\n")
+ * or 0 if the line is still incomplete.
+ */
+static size_t auth_line_length(const char *buf, size_t len)
+{
+    const char *end;
+
+    end = memmem(buf, len, "\r\n", 2);
+    if (!end)
+        return 0;
+
+    return end - buf + 2;
+}
+
+/* the commands a client may send before BEGIN (dbus specification, SASL) */
+static const char *client_auth_commands[] = {
+    "AUTH", "CANCEL", DBUS_AUTH_BEGIN, "DATA", "ERROR", "NEGOTIATE_UNIX_FD",
+    NULL
+};
+
+/*
+ * Finds the command of a client's authentication line.  Like dbus-daemon the
+ * command ends at the first blank, whatever follows is its argument.
+ *
+ * @return the command, NULL if the bus doesn't know it.
+ */
+static const char *client_auth_command(const char *line, size_t len)
+{
+    size_t i, cmd_len;
+
+    /* the "\r\n" ending the line is never part of the command */
+    for (cmd_len=0; cmd_len < len - 2; cmd_len++) {
+        if (line[cmd_len] == ' ' || line[cmd_len] == '\t')
+            break;
+    }
+
+    for (i=0; client_auth_commands[i]; i++) {
+        if (strlen(client_auth_commands[i]) == cmd_len &&
+            !memcmp(line, client_auth_commands[i], cmd_len))
+            return client_auth_commands[i];
+    }
+
+    return NULL;
+}
+
+static inline size_t serial_slot(uint32_t serial)
+{
+    return (serial * 2654435761u) & (RAW_DBUS_PENDING_SLOTS - 1);
+}
+
+static bool find_serial(struct dbus_serials *serials, uint32_t serial,
+                        size_t *slot)
+{
+    size_t i;
+
+    i = serial_slot(serial);
+    while (serials->slots[i] != 0) {
+        if (serials->slots[i] == serial) {
+            *slot = i;
+            return true;
+        }
+
+        i = (i + 1) & (RAW_DBUS_PENDING_SLOTS - 1);
+    }
+
+    *slot = i;
+    return false;
+}
+
+/* empties a slot, shifting back the serials that probed past it */
+static void remove_serial_slot(struct dbus_serials *serials, size_t i)
+{
+    size_t j, k;
+
+    j = i;
+
+    while (true) {
+        serials->slots[i] = 0;
+
+        while (true) {
+            j = (j + 1) & (RAW_DBUS_PENDING_SLOTS - 1);
+            if (serials->slots[j] == 0)
+                return;
+
+            /* a serial may only move back if that's not before its home */
+            k = serial_slot(serials->slots[j]);
+            if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                continue;
+
+            break;
+        }
+
+        serials->slots[i] = serials->slots[j];
+        i = j;
+    }
+}
+
+/*
+ * Takes a reply's serial out of the calls pending on the client.
  *
- * @param rsock The socket ready to be read.
- * @param ssock The other end of the connection that possible gets sent to.
- * @param domid The domain id from where the data is being sent.
- * @param is_client A flag to show if this is client end being recv'd from.
+ * @return false if the client never made (or already had an answer to) the
+ * call being replied to.
+ */
+static bool take_pending_serial(struct dbus_serials *serials, uint32_t serial)
+{
+    size_t slot;
+
+    if (!serials || serial == 0 || !find_serial(serials, serial, &slot))
+        return false;
+
+    remove_serial_slot(serials, slot);
+
+    return true;
+}
+
+/* drops the serials of calls already answered from the order they were sent */
+static void compact_pending_serials(struct dbus_serials *serials)
+{
+    size_t i, count, slot;
+    uint32_t serial;
+
+    count = 0;
+
+    for (i=0; i < serials->count; i++) {
+        serial = serials->order[(serials->head + i) % RAW_DBUS_PENDING_MAX];
+        if (find_serial(serials, serial, &slot))
+            serials->order[(serials->head + count++) % RAW_DBUS_PENDING_MAX] =
+                                                                        serial;
+    }
+
+    serials->count = count;
+}
+
+/* records a call a client made that the bus is going to reply to */
+static void add_pending_serial(struct raw_dbus_conn *conn, uint32_t serial)
+{
+    struct dbus_serials *serials;
+    uint32_t oldest;
+    size_t slot;
+
+    if (serial == 0)
+        return;
+
+    if (!conn->pending) {
+        conn->pending = calloc(1, sizeof(struct dbus_serials));
+        if (!conn->pending)
+            DBUS_BROKER_ERROR("Calloc failed");
+    }
+
+    serials = conn->pending;
+
+    if (find_serial(serials, serial, &slot))
+        return;
+
+    if (serials->count == RAW_DBUS_PENDING_MAX)
+        compact_pending_serials(serials);
+
+    if (serials->count == RAW_DBUS_PENDING_MAX) {
+        oldest = serials->order[serials->head];
+        serials->head = (serials->head + 1) % RAW_DBUS_PENDING_MAX;
+        serials->count--;
+        take_pending_serial(serials, oldest);
+        find_serial(serials, serial, &slot);
+    }
+
+    serials->slots[slot] = serial;
+    serials->order[(serials->head + serials->count++) % RAW_DBUS_PENDING_MAX] =
+                                                                        serial;
+}
+
+/*
+ * Filters a raw-dbus message.  A method return or error from the bus only
+ * ever answers a call the client made, so it's let through if the call was
+ * and rejected otherwise, without running the rules.  Every other message is
+ * checked against the policy.
+ *
+ * @return true to forward the message, false to drop it.
+ */
+static bool filter_raw_message(struct raw_dbus_conn *conn,
+                               struct dbus_message *dmsg)
+{
+    if (!conn->is_client &&
+        (dmsg->msg_type == DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+         dmsg->msg_type == DBUS_MESSAGE_TYPE_ERROR)) {
+
+        if (take_pending_serial(conn->peer->pending, dmsg->reply_serial))
+            return true;
+
+        if (verbose_logging)
+            DBUS_BROKER_WARNING("Unsolicited reply to serial %u [Domain: %d]",
+                                dmsg->reply_serial, conn->client_domain);
+        return false;
+    }
+
+    if (!is_request_allowed(dmsg, conn->is_client, conn->client_domain))
+        return false;
+
+    if (conn->is_client && dmsg->msg_type == DBUS_MESSAGE_TYPE_METHOD_CALL &&
+        !(dmsg->flags & DBUS_HEADER_FLAG_NO_REPLY_EXPECTED))
+        add_pending_serial(conn, dmsg->serial);
+
+    return true;
+}
+
+/*
+ * Handles every complete frame held by the framer.  Authentication lines are
+ * passed through untouched, each dbus message is run against the policy and
+ * only forwarded if allowed.  Consecutive frames being forwarded are sent
+ * together.
  *
- * @return The total number of bytes exchanged, -1 for failure (block)
+ * @return 0 on success, -1 if the stream is invalid or the send failed.
  */
-int exchange(int rsock, int ssock, uint16_t domid, bool is_client)
+static int process_frames(struct raw_dbus_conn *conn)
 {
+    struct dbus_framer *framer;
     struct dbus_message dmsg;
-    int total, rbytes, len;
-    char buf[DBUS_MSG_LEN] = { 0 };
+    size_t offset, forward, frame, remaining;
+    const char *command;
+    int needed;
 
-    total = 0;
-    rbytes = 0;
+    framer = &(conn->framer);
+    offset = 0;
+    forward = 0;
+
+    while (offset < framer->len) {
 
-    while ((rbytes = recv(rsock, buf, DBUS_MSG_LEN, 0)) > 0) {
-        if (rbytes > DBUS_COMM_MIN) {
+        remaining = framer->len - offset;
+
+        if (framer->state == DBUS_FRAMER_AUTH) {
+            /* the client opens with a single nul credentials byte */
+            if (conn->is_client && !framer->nul_seen) {
+                framer->nul_seen = true;
+                offset++;
+                continue;
+            }
 
-            len = dbus_message_demarshal_bytes_needed(buf, rbytes);
+            /*
+             * The server only answers with text lines starting in capitals
+             * ("OK", "DATA", ...) a message starts with its endianness.
+             */
+            if (!conn->is_client && (framer->buf[offset] == 'l' ||
+                                     framer->buf[offset] == 'B')) {
+                framer->state = DBUS_FRAMER_MESSAGES;
+                continue;
+            }
 
-            if (len == rbytes) {
-                if (convert_raw_dbus(&dmsg, buf, len) < 1)
+            frame = auth_line_length(framer->buf + offset, remaining);
+            if (frame == 0) {
+                if (remaining > DBUS_AUTH_LINE_MAX)
                     return -1;
-                if (is_request_allowed(&dmsg, is_client, domid) == false)
+                break;
+            }
+
+            /*
+             * Anything the broker can't tell apart from an authentication
+             * line closes the connection, the bus may already be reading
+             * messages where the broker would still be passing lines on.
+             */
+            if (conn->is_client) {
+                command = client_auth_command(framer->buf + offset, frame);
+                if (!command) {
+                    DBUS_BROKER_WARNING("Invalid authentication line "
+                                        "[Domain: %d]", conn->client_domain);
                     return -1;
+                }
+
+                if (!strcmp(command, DBUS_AUTH_BEGIN))
+                    framer->state = DBUS_FRAMER_MESSAGES;
             }
+
+            offset += frame;
+            continue;
+        }
+
+        if (remaining < DBUS_MINIMUM_HEADER_SIZE)
+            break;
+
+        needed = dbus_message_demarshal_bytes_needed(framer->buf + offset,
+                                                     remaining);
+        if (needed < DBUS_MINIMUM_HEADER_SIZE) {
+            DBUS_BROKER_WARNING("Invalid dbus message header [Domain: %d]",
+                                conn->client_domain);
+            return -1;
+        }
+
+        if (remaining < needed) {
+            /* make room for the rest of a message larger than the buffer */
+            if (needed > framer->size - offset)
+                reserve_framer(framer, needed + offset);
+            break;
+        }
+
 #ifdef DEBUG
-        debug_raw_buffer(buf, rbytes);
+        debug_raw_buffer(framer->buf + offset, needed);
 #endif
+
+        if (convert_raw_dbus(&dmsg, framer->buf + offset, needed) < 1 ||
+            !filter_raw_message(conn, &dmsg)) {
+            /* drop the message, sending whatever preceded it */
+            if (offset > forward &&
+                forward_frames(conn, framer->buf + forward,
+                               offset - forward) < 0)
+                return -1;
+
+            forward = offset + needed;
         }
 
+        offset += needed;
+    }
+
+    if (offset > forward &&
+        forward_frames(conn, framer->buf + forward, offset - forward) < 0)
+        return -1;
+
+    /* keep any partial frame at the front of the buffer */
+    framer->len -= offset;
+    if (framer->len > 0 && offset > 0)
+        memmove(framer->buf, framer->buf + offset, framer->len);
+
+    return 0;
+}
+
+/*
+ * This is an opaque exchange reading off from the receiving end of a raw-dbus
+ * connection.  For rpc-broker sessions running "raw" mode, whenever a client
+ * connects, another connection is opened on the bus.  Each of these sockets
+ * are added to the event-loop.  Whenever a connection triggers the callback,
+ * this function is invocated to receive the data being sent.  The data is
+ * framed into authentication lines and dbus messages, where every message
+ * is checked exactly once against the filter to determine if this message
+ * should be allowed or denied.  Messages may span several reads and a single
+ * read may hold several messages.
+ *
+ * Sockets are non-blocking, reading stops once the socket is drained, after
+ * RAW_DBUS_READ_BUDGET bytes so other connections get their turn, or when the
+ * peer's output is above the high watermark.  Whatever is left is picked up
+ * on the next pass of the event-loop.
+ *
+ * @param conn The raw-dbus connection whose receiving socket is ready.
+ *
+ * @return The number of bytes received, or -1 for failure.  Once the peer
+ * closes its end `conn->eof` is set.
+ */
+int exchange(struct raw_dbus_conn *conn)
+{
+    struct dbus_framer *framer;
+    ssize_t rbytes;
+    int total, rc;
+
+    framer = &(conn->framer);
+    total = 0;
+
+    while (total < RAW_DBUS_READ_BUDGET &&
+           OUTPUT_PENDING(&conn->peer->output) < RAW_DBUS_HIGH_WATERMARK) {
+
+        if (framer->size - framer->len < DBUS_MSG_LEN)
+            reserve_framer(framer, framer->len + DBUS_MSG_LEN);
+
+        rbytes = recv(conn->receiver, framer->buf + framer->len,
+                      framer->size - framer->len, 0);
+
+        if (rbytes < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+
+        if (rbytes == 0) {
+            conn->eof = true;
+            break;
+        }
+
+        framer->len += rbytes;
         total += rbytes;
-        send(ssock, buf, rbytes, 0);
+
+        acquire_policy();
+        rc = process_frames(conn);
+        release_policy();
+
+        if (rc < 0)
+            return -1;
+    }
+
+    /* give back the memory of an oversized message once it's through */
+    if (framer->len == 0 && framer->size > DBUS_MSG_LEN * 4) {
+        free(framer->buf);
+        framer->buf = NULL;
+        framer->size = 0;
     }
 
     return total;
 }
 
+/**
+ * Writes as much of a connection's queued output as its socket will take.
+ *
+ * @param conn The raw-dbus connection whose receiving socket is writable.
+ *
+ * @return 0 on success, -1 if the send failed.
+ */
+int flush_output(struct raw_dbus_conn *conn)
+{
+    struct dbus_output *output;
+    ssize_t sbytes;
+
+    output = &(conn->output);
+
+    while (OUTPUT_PENDING(output) > 0) {
+        sbytes = send(conn->receiver, output->buf + output->sent,
+                      OUTPUT_PENDING(output), MSG_NOSIGNAL);
+        if (sbytes < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+
+        output->sent += sbytes;
+    }
+
+    if (OUTPUT_PENDING(output) == 0) {
+        output->sent = 0;
+        output->len = 0;
+
+        if (output->size > DBUS_MSG_LEN * 4)
+            free_output(output);
+    }
+
+    return 0;
+}
+
+/**
+ * Free's the buffer held by a framer.
+ *
+ * @param framer the framer to free.
+ */
+void free_framer(struct dbus_framer *framer)
+{
+    if (framer->buf)
+        free(framer->buf);
+
+    framer->buf = NULL;
+    framer->len = 0;
+    framer->size = 0;
+}
+
+/**
+ * Free's the buffer held by an output queue, dropping anything unsent.
+ *
+ * @param output the output queue to free.
+ */
+void free_output(struct dbus_output *output)
+{
+    if (output->buf)
+        free(output->buf);
+
+    output->buf = NULL;
+    output->sent = 0;
+    output->len = 0;
+    output->size = 0;
+}
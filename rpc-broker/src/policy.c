@@ -28,16 +28,50 @@
 #include "rpc-broker.h"
 
 
-static int create_rule(struct rule *current, char *rule)
+/* a new generation leaves every cached verdict stale */
+static uint32_t policy_generation;
+
+/* bumped whenever a policy is retired, see `publish_policy` */
+static uint64_t policy_epoch = 1;
+
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct policy_reader *policy_readers;
+static __thread struct policy_reader *current_reader;
+
+static struct policy_builder builder = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wakeup = PTHREAD_COND_INITIALIZER,
+};
+
+
+/* gives a rule set an empty list of rules */
+static void init_rule_set(struct rule_set *set)
+{
+    memset(set, 0, sizeof(*set));
+}
+
+static void append_rule(struct rule_set *set, struct rule *policy_rule)
+{
+    if (set->count == set->size) {
+        set->size = set->size ? set->size * 2 : RULE_SET_SIZE;
+        set->rules = realloc(set->rules, set->size * sizeof(struct rule));
+        if (!set->rules)
+            DBUS_BROKER_ERROR("Realloc failed");
+    }
+
+    set->rules[set->count++] = *policy_rule;
+}
+
+/* parses a rule, appending it to the set unless it's malformed */
+static int create_rule(struct rule_set *set, char *rule)
 {
     char *token;
     const char *delimiter;
+    struct rule current = { 0 };
 
     if (!rule || rule[0] == '\0')
         return -1;
 
-    current->rule_string = strdup(rule);
-
     delimiter = " ";
     token = strtok(rule, delimiter);
 
@@ -46,16 +80,18 @@ static int create_rule(struct rule *current, char *rule)
 
     /* The first field predicates the policy "allow" or "deny" */
     if (strcmp(token, "allow") == 0)
-        current->policy = true;
-    else
-        current->policy = false;
+        current.flags |= RULE_ALLOW;
 
     token = strtok(NULL, delimiter);
-    if (!strcmp(token, "all")) {
-        current->all = true;
+    if (!token) {
+        return -1;
+    } else if (!strcmp(token, "all")) {
+        current.flags |= RULE_ALL;
+        append_rule(set, &current);
         return 0;
     } else if (!strcmp(token, "out-any")) {
-        current->out = true;
+        current.flags |= RULE_OUT;
+        append_rule(set, &current);
         return 0;
     }
 
@@ -66,45 +102,386 @@ static int create_rule(struct rule *current, char *rule)
         if (!field && token[0] != 's') {
             return -1;
         } else if (strcmp("destination", token) == 0) {
-            current->destination = strdup(field);
+            current.destination = intern_symbol(field);
         } else if (strcmp("dom-type", token) == 0) {
-            current->domtype = strdup(field);
+            current.domtype = intern_symbol(field);
         } else if (strcmp("interface", token) == 0) {
-            current->interface = strdup(field);
+            current.interface = intern_symbol(field);
         } else if (strcmp("if-boolean", token) == 0) {
-            current->if_bool = strdup(field);
+            current.if_bool = intern_symbol(field);
             token = strtok(NULL, delimiter);
+            if (!token)
+                return -1;
             if (strcmp("true", token) == 0)
-                current->if_bool_flag = true;
-            else
-                current->if_bool_flag = false;
+                current.flags |= RULE_IF_BOOL_TRUE;
         } else if (strcmp("stubdom", token) == 0) {
-            current->stubdom = true;
+            current.flags |= RULE_STUBDOM;
         } else if (strcmp("path", token) == 0) {
-            current->path = strdup(field);
+            current.path = intern_symbol(field);
         } else if (strcmp("member", token) == 0) {
-            current->member = strdup(field);
+            current.member = intern_symbol(field);
         } else {
             DBUS_BROKER_WARNING("Unrecognized Rule-Token: %s", token);
-            free_rule(*current);
-            current = NULL;
             return -1;
         }
 
         token = strtok(NULL, delimiter);
     }
 
+    append_rule(set, &current);
+
     return 0;
 }
 
-static inline void get_rules(DBusConnection *conn, struct domain_policy *dom)
+static size_t format_rule_field(char *buf, size_t size, size_t len,
+                                const char *keyword, uint32_t field)
+{
+    if (field == SYMBOL_NONE || len >= size)
+        return len;
+
+    return len + snprintf(buf + len, size - len, " %s %s", keyword,
+                          symbol_name(field));
+}
+
+/*
+ * Writes a rule back out in the syntax `create_rule` parses, `stubdom` goes
+ * last as the parser takes the token after it for a field.
+ *
+ * @return 0 on success, -1 if the rule doesn't fit in `size`.
+ */
+static int format_rule(struct rule *policy_rule, char *buf, size_t size)
+{
+    size_t len;
+
+    len = snprintf(buf, size, "%s",
+                   policy_rule->flags & RULE_ALLOW ? "allow" : "deny");
+
+    if (policy_rule->flags & RULE_ALL)
+        len += snprintf(buf + len, size - len, " all");
+    else if (policy_rule->flags & RULE_OUT)
+        len += snprintf(buf + len, size - len, " out-any");
+    else {
+        len = format_rule_field(buf, size, len, "destination",
+                                policy_rule->destination);
+        len = format_rule_field(buf, size, len, "path", policy_rule->path);
+        len = format_rule_field(buf, size, len, "interface",
+                                policy_rule->interface);
+        len = format_rule_field(buf, size, len, "member",
+                                policy_rule->member);
+        len = format_rule_field(buf, size, len, "dom-type",
+                                policy_rule->domtype);
+        len = format_rule_field(buf, size, len, "if-boolean",
+                                policy_rule->if_bool);
+
+        if (policy_rule->if_bool != SYMBOL_NONE && len < size)
+            len += snprintf(buf + len, size - len, " %s",
+                            policy_rule->flags & RULE_IF_BOOL_TRUE ?
+                            "true" : "false");
+
+        if (policy_rule->flags & RULE_STUBDOM && len < size)
+            len += snprintf(buf + len, size - len, " stubdom");
+    }
+
+    return len < size ? 0 : -1;
+}
+
+static inline uint32_t hash_bucket_key(uint32_t destination,
+                                       uint32_t interface, uint32_t member)
+{
+    uint32_t hash;
+
+    hash = (destination * 2654435761u) ^ (interface * 40503u) ^ (member * 31);
+
+    return (hash ^ (hash >> 16)) & (RULE_INDEX_BUCKETS - 1);
+}
+
+static struct rule_bucket *find_bucket(struct rule_index *index, uint32_t key,
+                                       uint32_t destination,
+                                       uint32_t interface, uint32_t member)
+{
+    struct rule_bucket *bucket;
+
+    for (bucket = index->buckets[key]; bucket; bucket = bucket->next) {
+        if (bucket->destination == destination &&
+            bucket->interface == interface     &&
+            bucket->member == member)
+            return bucket;
+    }
+
+    return NULL;
+}
+
+static void index_rule(struct rule_index *index, struct rule *policy_rule,
+                       uint32_t position)
+{
+    uint32_t key;
+    struct rule_bucket *bucket;
+
+    key = hash_bucket_key(policy_rule->destination, policy_rule->interface,
+                          policy_rule->member);
+
+    bucket = find_bucket(index, key, policy_rule->destination,
+                         policy_rule->interface, policy_rule->member);
+
+    if (!bucket) {
+        bucket = calloc(1, sizeof *bucket);
+        if (!bucket)
+            DBUS_BROKER_ERROR("Calloc failed");
+
+        bucket->destination = policy_rule->destination;
+        bucket->interface = policy_rule->interface;
+        bucket->member = policy_rule->member;
+        bucket->next = index->buckets[key];
+        index->buckets[key] = bucket;
+    }
+
+    if (bucket->count == bucket->size) {
+        bucket->size = bucket->size ? bucket->size * 2 : 4;
+        bucket->positions = realloc(bucket->positions,
+                                    bucket->size * sizeof(uint32_t));
+        if (!bucket->positions)
+            DBUS_BROKER_ERROR("Realloc failed");
+    }
+
+    bucket->positions[bucket->count++] = position;
+}
+
+/*
+ * Compiles the rules of a set into an index keyed on the destination,
+ * interface and member of each rule.  Rules are added in order, so every
+ * bucket holds its positions in ascending order.  The set is trimmed to size
+ * and left read-only.
+ */
+static void build_rule_index(struct rule_set *set)
+{
+    uint32_t i;
+
+    memset(&(set->index), 0, sizeof(set->index));
+
+    for (i=0; i < set->count; i++)
+        index_rule(&(set->index), &(set->rules[i]), i);
+
+    if (set->count > 0 && set->count < set->size) {
+        set->rules = realloc(set->rules, set->count * sizeof(struct rule));
+        if (!set->rules)
+            DBUS_BROKER_ERROR("Realloc failed");
+        set->size = set->count;
+    }
+}
+
+static void free_rule_set(struct rule_set *set)
+{
+    int i;
+    struct rule_bucket *bucket, *next;
+
+    for (i=0; i < RULE_INDEX_BUCKETS; i++) {
+        for (bucket = set->index.buckets[i]; bucket; bucket = next) {
+            next = bucket->next;
+            free(bucket->positions);
+            free(bucket);
+        }
+
+        set->index.buckets[i] = NULL;
+    }
+
+    free(set->rules);
+    memset(set, 0, sizeof(*set));
+}
+
+/* a field of `later` left unset matches whatever the earlier rule's does */
+static inline bool field_covers(uint32_t later, uint32_t earlier)
+{
+    return later == SYMBOL_NONE || later == earlier;
+}
+
+/*
+ * Tells whether every request `earlier` matches is matched by `later` as
+ * well, whichever vm it comes from and whatever the state of its attributes.
+ * Errs on the side of false.
+ */
+static bool rule_covers(struct rule *later, struct rule *earlier)
+{
+    uint32_t flags;
+
+    if (later->flags & RULE_ALL)
+        return true;
+
+    if (later->flags & RULE_OUT)
+        return !!(earlier->flags & RULE_OUT);
+
+    if (earlier->flags & (RULE_ALL | RULE_OUT))
+        return false;
+
+    /* either needs the domain, see `rule_matches_request` */
+    if ((later->if_bool != SYMBOL_NONE || later->domtype != SYMBOL_NONE) &&
+        earlier->if_bool == SYMBOL_NONE && earlier->domtype == SYMBOL_NONE)
+        return false;
+
+    flags = later->flags ^ earlier->flags;
+
+    /* the same attribute has to be checked for the same state */
+    if ((later->flags & RULE_STUBDOM && !(earlier->flags & RULE_STUBDOM)) ||
+        (later->if_bool != SYMBOL_NONE && flags & RULE_IF_BOOL_TRUE))
+        return false;
+
+    return field_covers(later->destination, earlier->destination) &&
+           field_covers(later->path, earlier->path)               &&
+           field_covers(later->interface, earlier->interface)     &&
+           field_covers(later->member, earlier->member)           &&
+           field_covers(later->if_bool, earlier->if_bool)         &&
+           field_covers(later->domtype, earlier->domtype);
+}
+
+static void report_shadowed_rule(FILE *report, const char *origin,
+                                 struct rule_set *set, size_t position,
+                                 size_t shadow)
+{
+    char rule[RULE_MAX_LENGTH * 2], later[RULE_MAX_LENGTH * 2];
+
+    format_rule(&(set->rules[position]), rule, sizeof(rule));
+    format_rule(&(set->rules[shadow]), later, sizeof(later));
+
+    if (report)
+        fprintf(report, "%s: rule %zu <%s> is shadowed by rule %zu <%s>\n",
+                origin, position + 1, rule, shadow + 1, later);
+    else
+        DBUS_BROKER_EVENT("%s: rule %zu <%s> is shadowed by rule %zu <%s>",
+                          origin, position + 1, rule, shadow + 1, later);
+}
+
+/*
+ * Drops every rule of a set that can never decide a request.  Rules are last
+ * match, a rule is dead once a later rule matches every request it does
+ * (a duplicate being the narrowest case) whatever either rule's policy is.
+ * Only the rules kept are checked against, a rule shadowing one that's
+ * dropped shadows everything the dropped one did.  The rules left are
+ * evaluated to the same verdicts in the same order.
+ *
+ * @param set the rule set, before it's indexed.
+ * @param origin what the rules were read from, for the report.
+ * @param report where each rule dropped is reported, the log if NULL.
+ *
+ * @return the number of rules dropped.
+ */
+static size_t eliminate_shadowed_rules(struct rule_set *set,
+                                       const char *origin, FILE *report)
+{
+    size_t *shadows;
+    size_t i, j, kept;
+
+    if (set->count < 2)
+        return 0;
+
+    /* the position (+1) of the rule shadowing each rule, 0 if it's kept */
+    shadows = calloc(set->count, sizeof(size_t));
+    if (!shadows)
+        DBUS_BROKER_ERROR("Calloc failed");
+
+    for (i=set->count - 1; i-- > 0; ) {
+        for (j=i + 1; j < set->count; j++) {
+            if (!shadows[j] && rule_covers(&(set->rules[j]),
+                                           &(set->rules[i]))) {
+                shadows[i] = j + 1;
+                break;
+            }
+        }
+    }
+
+    for (i=0; i < set->count; i++) {
+        if (shadows[i])
+            report_shadowed_rule(report, origin, set, i, shadows[i] - 1);
+    }
+
+    for (i=0, kept=0; i < set->count; i++) {
+        if (!shadows[i])
+            set->rules[kept++] = set->rules[i];
+    }
+
+    free(shadows);
+
+    i = set->count - kept;
+    set->count = kept;
+
+    if (i > 0 && !report)
+        DBUS_BROKER_EVENT("%s: %zu of %zu rule(s) shadowed", origin, i,
+                          kept + i);
+
+    return i;
+}
+
+/**
+ * Finds every bucket of a rule index holding rules that are able to match a
+ * request.  That is the bucket for each combination of the request's
+ * destination, interface and member with the wildcard.  A field the symbol
+ * table doesn't know only has its wildcard bucket.
+ *
+ * @param index the rule index to search.
+ * @param dmsg the dbus request message fields, resolved to symbols.
+ * @param matches an array of at least RULE_INDEX_PROBES buckets to fill.
+ *
+ * @return the number of buckets found.
+ */
+size_t lookup_rule_index(struct rule_index *index, struct dbus_message *dmsg,
+                         struct rule_bucket **matches)
+{
+    int probe;
+    size_t found;
+    uint32_t fields[3];
+    struct rule_bucket *bucket;
+
+    fields[0] = dmsg->destination_id;
+    fields[1] = dmsg->interface_id;
+    fields[2] = dmsg->member_id;
+
+    found = 0;
+
+    /* each bit of the probe selects the request's field over the wildcard */
+    for (probe=0; probe < RULE_INDEX_PROBES; probe++) {
+
+        if (((probe & 1) && fields[0] == SYMBOL_NONE) ||
+            ((probe & 2) && fields[1] == SYMBOL_NONE) ||
+            ((probe & 4) && fields[2] == SYMBOL_NONE))
+            continue;
+
+        bucket = find_bucket(index,
+                             hash_bucket_key(probe & 1 ? fields[0] : 0,
+                                             probe & 2 ? fields[1] : 0,
+                                             probe & 4 ? fields[2] : 0),
+                             probe & 1 ? fields[0] : SYMBOL_NONE,
+                             probe & 2 ? fields[1] : SYMBOL_NONE,
+                             probe & 4 ? fields[2] : SYMBOL_NONE);
+        if (bucket)
+            matches[found++] = bucket;
+    }
+
+    return found;
+}
+
+/* parses a rule string from the database into the next rule of a domain */
+static void add_domain_rule(struct domain_policy *dom, const char *rulestring)
+{
+    char *rule;
+
+    rule = strdup(rulestring);
+    if (!rule)
+        DBUS_BROKER_ERROR("Malloc Failed!");
+
+    create_rule(&(dom->rules), rule);
+
+    free(rule);
+}
+
+/*
+ * Reads a domain's rules one index at a time until a read fails, for
+ * databases that don't dump.
+ */
+static void read_rules(DBusConnection *conn, struct domain_policy *dom)
 {
     int rule_idx;
     char *rulestring;
     char *arg;
-    struct rule *policy_rule;
 
-    for (rule_idx=0; rule_idx < MAX_RULES; rule_idx++) {
+    for (rule_idx=0; ; rule_idx++) {
         DBUS_REQ_ARG(arg, "/vm/%s/rpc-firewall-rules/%d",
                      dom->uuid, rule_idx);
 
@@ -114,52 +491,163 @@ static inline void get_rules(DBusConnection *conn, struct domain_policy *dom)
         if (!rulestring)
             break;
 
-        policy_rule = &(dom->rules[rule_idx]);
+        add_domain_rule(dom, rulestring);
+        free(rulestring);
+    }
+}
 
-        if (create_rule(policy_rule, rulestring) < 0)
-            free_rule(*policy_rule);
-        else
-            dom->count++;
+/*
+ * Loads a domain's rules with a single dump of its rule list.  The list is
+ * keyed by rule index, as with reading them one at a time the rules stop at
+ * the first index missing.
+ */
+static void get_rules(DBusConnection *conn, struct domain_policy *dom)
+{
+    int rule_idx;
+    char *arg, *dump;
+    char key[16];
+    const char *rulestring;
+    struct json_object *jrules, *jrule;
 
-        free(rulestring);
+    DBUS_REQ_ARG(arg, "/vm/%s/rpc-firewall-rules", dom->uuid);
+    dump = db_dump(conn, arg);
+    free(arg);
+
+    if (!dump) {
+        read_rules(conn, dom);
+        goto index_rules;
+    }
+
+    jrules = json_tokener_parse(dump);
+    free(dump);
+
+    for (rule_idx=0; jrules; rule_idx++) {
+        if (json_object_is_type(jrules, json_type_array)) {
+            jrule = json_object_array_get_idx(jrules, rule_idx);
+        } else {
+            snprintf(key, sizeof(key), "%d", rule_idx);
+            jrule = NULL;
+            json_object_object_get_ex(jrules, key, &jrule);
+        }
+
+        rulestring = jrule ? json_object_get_string(jrule) : NULL;
+        if (!rulestring || rulestring[0] == '\0')
+            break;
+
+        add_domain_rule(dom, rulestring);
     }
 
+    if (jrules)
+        json_object_put(jrules);
+
+index_rules:
+
+    eliminate_shadowed_rules(&(dom->rules), dom->uuid, NULL);
+    build_rule_index(&(dom->rules));
 }
 
-static void build_etc_policy(struct etc_policy *domain_etc_policy,
-                             const char *rule_filepath)
+/* creates an empty domain policy for a vm, holding one reference */
+static struct domain_policy *new_domain_policy(const char *uuid)
+{
+    struct domain_policy *domain;
+
+    domain = calloc(1, sizeof *domain);
+    if (!domain)
+        DBUS_BROKER_ERROR("Calloc failed");
+
+    domain->refs = 1;
+    domain->domid = DOMID_NONE;
+    init_rule_set(&(domain->rules));
+    snprintf(domain->uuid, MAX_UUID, "%s", uuid);
+    /* 
+     * alter the uuid from underscores to dashes
+     * dbus returns underscores while the vm db uses dashes
+     * if not the vm db policy check on strcmp on the uuid is off
+     */
+    TRANSFORM_UUID(domain->uuid, domain->uuid_db_fmt);
+
+    return domain;
+}
+
+/* loads the rules of a vm along with the domain id it's running as */
+static struct domain_policy *load_domain_policy(DBusConnection *conn,
+                                                const char *uuid)
+{
+    struct domain_policy *domain;
+
+    domain = new_domain_policy(uuid);
+    get_rules(conn, domain);
+    domain->domid = get_domid_from_uuid(conn, domain->uuid_db_fmt);
+
+    return domain;
+}
+
+static void release_domain_policy(struct domain_policy *domain)
+{
+    if (--domain->refs > 0)
+        return;
+
+    free_rule_set(&(domain->rules));
+
+    if (domain->attributes)
+        free(domain->attributes);
+
+    free(domain);
+}
+
+static void release_etc_policy(struct etc_policy *domain_etc_policy)
+{
+    if (--domain_etc_policy->refs > 0)
+        return;
+
+    free_rule_set(&(domain_etc_policy->rules));
+    free(domain_etc_policy);
+}
+
+/*
+ * Parses the rules of a policy file into a set, invalid rules are reported
+ * by line when `report` is given.
+ *
+ * @return the number of invalid rules, -1 if the file couldn't be opened.
+ */
+static int read_rule_file(const char *rule_filepath, struct rule_set *set,
+                          FILE *report)
 {
-    int rule_idx;
     FILE *policy_fh;
-    size_t rbytes, line_length;
+    size_t rbytes, line_length, line_number;
+    int invalid;
     char *line;
     char current_rule[RULE_MAX_LENGTH] = { 0 };
-    struct rule *current;
-
-    rule_idx = 0;
-    domain_etc_policy->count = 0;
 
     policy_fh = fopen(rule_filepath, "r");
-    if (!policy_fh) {
-        DBUS_BROKER_WARNING("/etc policy stat of file <%s> failed %s",
-                             rule_filepath, strerror(errno));
-        return;
-    }
+    if (!policy_fh)
+        return -1;
 
     line = NULL;
+    line_number = 0;
+    invalid = 0;
+
+    while (getline(&line, &rbytes, policy_fh) > 0) {
 
-    while (rule_idx < MAX_RULES && (getline(&line, &rbytes, policy_fh) > 0)) {
+        line_number++;
 
         if (rbytes > RULE_MAX_LENGTH - 1) {
             DBUS_BROKER_WARNING("Invalid policy rule %zu exceeds max-rule",
                                                                   rbytes);
+            invalid++;
+            if (report)
+                fprintf(report, "%s:%zu: rule exceeds max-rule\n",
+                        rule_filepath, line_number);
         } else if (line && isalpha(line[0])) {
             line_length = strlen(line);
             line[line_length - 1] = '\0';
             memcpy(current_rule, line, rbytes);
-            current = &(domain_etc_policy->rules[rule_idx]);
-            create_rule(current, current_rule) < 0 ? free_rule(*current) :
-                                                               rule_idx++;
+            if (create_rule(set, current_rule) < 0) {
+                invalid++;
+                if (report)
+                    fprintf(report, "%s:%zu: invalid rule <%s>\n",
+                            rule_filepath, line_number, line);
+            }
         }
 
         if (line)
@@ -171,133 +659,1207 @@ static void build_etc_policy(struct etc_policy *domain_etc_policy,
     if (line)
         free(line);
 
-    domain_etc_policy->count = rule_idx;
     fclose(policy_fh);
+
+    return invalid;
 }
 
-/**
- * Constructs a policy-object based off the currently enforced policy of the
- * given system.  The policy file that resides in /etc/rpc-broker.file is 
- * parsed first.  Then the per-vm policies that reside in the system database
- * are parsed.
- *
- * @param rule_filename Overrides the location of the /etc policy.
- *
- * @return struct policy pointer of current policy.
- */
-struct policy *build_policy(const char *rule_filename)
+static struct etc_policy *build_etc_policy(const char *rule_filepath)
 {
-    struct policy *dbus_policy;
     struct etc_policy *domain_etc_policy;
-    int dom_idx;
-    DBusMessage *vms;
-    DBusConnection *conn;
-    DBusMessageIter iter, sub;
-    void *arg;
-    struct domain_policy *current;
-    char uuid[64];
 
-    dbus_policy = calloc(1, sizeof *dbus_policy);
-    if (!dbus_policy)
+    domain_etc_policy = calloc(1, sizeof *domain_etc_policy);
+    if (!domain_etc_policy)
         DBUS_BROKER_ERROR("Calloc failed");
-    domain_etc_policy = &(dbus_policy->domain_etc_policy);
-    build_etc_policy(domain_etc_policy, rule_filename);
-    dbus_policy->domain_count = 0;
-
-    dom_idx = 0;
-    vms = db_list();
-    if (!vms) { 
-        DBUS_BROKER_EVENT("No database vms in policy!%s", "");
-        dbus_policy->database = false;
-        return dbus_policy;
-    }
-
-    dbus_policy->database = true;
-    conn = create_dbus_connection();
-
-    dbus_message_iter_init(vms, &iter);
-    dbus_message_iter_recurse(&iter, &sub);
-
-    while (dbus_message_iter_get_arg_type(&sub) != DBUS_TYPE_INVALID) {
 
-        dbus_message_iter_get_basic(&sub, &arg);
-        current = &(dbus_policy->domains[dom_idx]);
-        strcpy(current->uuid, arg);
-        /* 
-         * alter the uuid from underscores to dashes
-         * dbus returns underscores while the vm db uses dashes
-         * if not the vm db policy check on strcmp on the uuid is off
-         */
-        TRANSFORM_UUID(arg, uuid);
-        strcpy(current->uuid_db_fmt, uuid);
-
-        errno = 0;
-        if (errno != 0) {
-            DBUS_BROKER_WARNING("Domain ID error <%s>", strerror(errno));
-            continue;
-        }
+    domain_etc_policy->refs = 1;
+    init_rule_set(&(domain_etc_policy->rules));
 
-        get_rules(conn, current);
+    if (read_rule_file(rule_filepath, &(domain_etc_policy->rules), NULL) < 0)
+        DBUS_BROKER_WARNING("/etc policy stat of file <%s> failed %s",
+                             rule_filepath, strerror(errno));
 
-        dbus_message_iter_next(&sub);
-        dom_idx++;
-    }
+    eliminate_shadowed_rules(&(domain_etc_policy->rules), rule_filepath,
+                             NULL);
+    build_rule_index(&(domain_etc_policy->rules));
 
-    dbus_policy->domain_count = dom_idx;
-    dbus_message_unref(vms);
-    dbus_connection_unref(conn);
-    return dbus_policy;
+    return domain_etc_policy;
 }
 
-void free_rule(struct rule r)
+/**
+ * Checks a policy file offline, without starting the broker.  Every invalid
+ * rule and every rule shadowed by a later one is reported on stdout, followed
+ * by how many rules are left to evaluate.
+ *
+ * @param rule_filepath the policy file to check.
+ *
+ * @return the number of rules found invalid or shadowed, -1 if the file
+ * couldn't be opened.
+ */
+int lint_policy_file(const char *rule_filepath)
 {
-    if (r.destination)
-        free((char *) (r.destination));
+    struct rule_set set;
+    size_t count, shadowed;
+    int invalid;
 
-    if (r.path)
-        free((char *) (r.path));
+    init_rule_set(&set);
 
-    if (r.interface)
-        free((char *) (r.interface));
+    invalid = read_rule_file(rule_filepath, &set, stdout);
+    if (invalid < 0) {
+        fprintf(stderr, "Failed to open policy <%s> %s\n", rule_filepath,
+                strerror(errno));
+        return -1;
+    }
 
-    if (r.member)
-        free((char *) (r.member));
+    count = set.count;
+    shadowed = eliminate_shadowed_rules(&set, rule_filepath, stdout);
 
-    if (r.if_bool)
-        free((char *) (r.if_bool));
+    printf("%s: %zu rule(s), %d invalid, %zu shadowed, "
+           "%zu left to evaluate\n", rule_filepath, count, invalid, shadowed,
+           set.count);
 
-    if (r.domtype)
-        free((char *) (r.domtype));
+    free_rule_set(&set);
 
-    if (r.rule_string)
-        free((char *) (r.rule_string));
+    return invalid + shadowed;
 }
 
-/**
- * Free's the policy structure object.  Iterating over all domain-specific
- * database policies and also free'ing the policy structure created from the
- * etc file.
- */
-void free_policy(void)
+static void register_attribute(struct policy *dbus_policy,
+                               struct rule *policy_rule)
 {
-    int count;
-    struct domain_policy domain;
-    struct etc_policy domain_etc_policy;
-    int i, j;
+    size_t i;
+    const char *if_bool;
 
-    count = dbus_broker_policy->domain_count;
-    for (i=0; i < count; i++) {
+    if (policy_rule->if_bool == SYMBOL_NONE)
+        return;
+
+    if_bool = symbol_name(policy_rule->if_bool);
+
+    for (i=0; i < dbus_policy->attribute_count; i++) {
+        if (!strcmp(dbus_policy->attributes[i], if_bool))
+            break;
+    }
 
-        domain = dbus_broker_policy->domains[i];
-        for (j=0; j < domain.count; j++)
-            free_rule(domain.rules[j]);
+    if (i > UINT16_MAX) {
+        DBUS_BROKER_WARNING("Too many if-boolean attributes <%s>", if_bool);
+        return;
     }
 
-    domain_etc_policy = dbus_broker_policy->domain_etc_policy;
+    if (i == dbus_policy->attribute_count) {
+        dbus_policy->attributes = realloc(dbus_policy->attributes,
+                                          (i + 1) * sizeof(char *));
+        if (!dbus_policy->attributes)
+            DBUS_BROKER_ERROR("Realloc failed");
 
-    for (i=0; i < domain_etc_policy.count; i++)
-        free_rule(domain_etc_policy.rules[i]);
+        dbus_policy->attributes[i] = strdup(if_bool);
+        dbus_policy->attribute_count++;
+    }
 
-    free(dbus_broker_policy);
+    policy_rule->flags &= (1u << RULE_ATTRIBUTE_SHIFT) - 1;
+    policy_rule->flags |= (uint32_t) i << RULE_ATTRIBUTE_SHIFT;
 }
 
+static void register_set_attributes(struct policy *dbus_policy,
+                                    struct rule_set *set)
+{
+    size_t i;
+
+    for (i=0; i < set->count; i++)
+        register_attribute(dbus_policy, &(set->rules[i]));
+}
+
+/*
+ * Collects the names of every `if-boolean` attribute used by a domain's
+ * rules, giving each rule the id of its attribute.  Ids are only ever
+ * appended, the ids of rules shared with an older policy stay valid.
+ */
+static void register_domain_attributes(struct policy *dbus_policy,
+                                       struct domain_policy *domain)
+{
+    register_set_attributes(dbus_policy, &(domain->rules));
+}
+
+/*
+ * Collects the names of every `if-boolean` attribute used in the policy,
+ * giving each rule the id of its attribute.
+ */
+static void register_attributes(struct policy *dbus_policy)
+{
+    size_t i;
+
+    register_set_attributes(dbus_policy,
+                            &(dbus_policy->domain_etc_policy->rules));
+
+    for (i=0; i < dbus_policy->domain_count; i++)
+        register_domain_attributes(dbus_policy, dbus_policy->domains[i]);
+}
+
+/*
+ * Reads every `if-boolean` attribute used by the policy for a domain's vm
+ * from the database, caching the state of each.  Only ever called on a
+ * domain that isn't published yet, a change to a vm's configuration reloads
+ * the vm into a fresh domain.  A domain shared with an older policy only
+ * knows the attributes registered when it was loaded, none of the newer ones
+ * are used by rules that apply to its vm.
+ */
+static void fill_vm_attributes(DBusConnection *conn,
+                               struct policy *dbus_policy,
+                               struct domain_policy *domain)
+{
+    size_t i;
+    char *arg, *value;
+
+    if (dbus_policy->attribute_count == 0)
+        return;
+
+    domain->attributes = calloc(dbus_policy->attribute_count, sizeof(uint8_t));
+    if (!domain->attributes)
+        DBUS_BROKER_ERROR("Calloc failed");
+    domain->attribute_count = dbus_policy->attribute_count;
+
+    for (i=0; i < domain->attribute_count; i++) {
+        DBUS_REQ_ARG(arg, "%s/%s/%s", DBUS_VM_PATH, domain->uuid,
+                     dbus_policy->attributes[i]);
+        value = db_query(conn, arg);
+        free(arg);
+
+        if (!value)
+            domain->attributes[i] = VM_ATTR_MISSING;
+        else if (!strcmp("true", value))
+            domain->attributes[i] = VM_ATTR_TRUE;
+        else if (!strcmp("false", value))
+            domain->attributes[i] = VM_ATTR_FALSE;
+        else
+            domain->attributes[i] = VM_ATTR_OTHER;
+
+        if (value)
+            free(value);
+    }
+}
+
+static inline uint32_t domid_bucket(uint16_t domid)
+{
+    return domid & (DOMID_MAP_BUCKETS - 1);
+}
+
+/*
+ * Maps a domid onto a domain policy, NULL for a domid without one.  The first
+ * mapping of a domid stands.
+ *
+ * @return false if the domid was already mapped.
+ */
+static bool map_domid(struct policy *dbus_policy, uint16_t domid,
+                      struct domain_policy *domain)
+{
+    struct domid_entry *entry;
+
+    if (lookup_domid_policy(dbus_policy, domid, NULL))
+        return false;
+
+    entry = calloc(1, sizeof *entry);
+    if (!entry)
+        DBUS_BROKER_ERROR("Calloc failed");
+
+    entry->domid = domid;
+    entry->domain = domain;
+    entry->next = dbus_policy->domids[domid_bucket(domid)];
+    dbus_policy->domids[domid_bucket(domid)] = entry;
+
+    return true;
+}
+
+/*
+ * Maps the domain id of every running vm in the policy onto its domain
+ * policy.  Should two vms claim the same domid the first keeps it.
+ */
+static void map_domids(struct policy *dbus_policy)
+{
+    struct domain_policy *domain;
+    size_t i;
+
+    for (i=0; i < dbus_policy->domain_count; i++) {
+        domain = dbus_policy->domains[i];
+        if (domain->domid == DOMID_NONE)
+            continue;
+
+        if (!map_domid(dbus_policy, domain->domid, domain))
+            DBUS_BROKER_WARNING("Domid %d claimed by more than one vm <%s>",
+                                domain->domid, domain->uuid);
+    }
+}
+
+static void free_domid_map(struct policy *dbus_policy)
+{
+    struct domid_entry *entry, *next;
+    int i;
+
+    for (i=0; i < DOMID_MAP_BUCKETS; i++) {
+        for (entry = dbus_policy->domids[i]; entry; entry = next) {
+            next = entry->next;
+            free(entry);
+        }
+
+        dbus_policy->domids[i] = NULL;
+    }
+}
+
+/**
+ * Finds the domain policy of the vm a request came from.  The map is built
+ * along with the policy, the lookup never makes a request on the bus.
+ *
+ * @param dbus_policy the policy snapshot.
+ * @param domid the domain id of where the request is being made.
+ * @param domain set to the domain policy, NULL if no vm policy applies to
+ * `domid`.  May be NULL.
+ *
+ * @return false if the policy doesn't know `domid` yet, see
+ * `request_domid_load`.
+ */
+bool lookup_domid_policy(struct policy *dbus_policy, uint16_t domid,
+                         struct domain_policy **domain)
+{
+    struct domid_entry *entry;
+
+    for (entry = dbus_policy->domids[domid_bucket(domid)]; entry;
+         entry = entry->next) {
+        if (entry->domid == domid) {
+            if (domain)
+                *domain = entry->domain;
+            return true;
+        }
+    }
+
+    if (domain)
+        *domain = NULL;
+
+    return false;
+}
+
+/* finds the domain policy of a vm by the uuid the database knows it by */
+static struct domain_policy *find_domain_policy(struct policy *dbus_policy,
+                                                const char *uuid)
+{
+    size_t i;
+
+    for (i=0; i < dbus_policy->domain_count; i++) {
+        if (!strcmp(dbus_policy->domains[i]->uuid, uuid))
+            return dbus_policy->domains[i];
+    }
+
+    return NULL;
+}
+
+/* appends a domain to a policy, taking over the reference held on it */
+static void add_domain_policy(struct policy *dbus_policy,
+                              struct domain_policy *domain)
+{
+    if (dbus_policy->domain_count == dbus_policy->domain_size) {
+        dbus_policy->domain_size = dbus_policy->domain_size ?
+                                   dbus_policy->domain_size * 2 : 16;
+        dbus_policy->domains = realloc(dbus_policy->domains,
+                                       dbus_policy->domain_size *
+                                       sizeof(struct domain_policy *));
+        if (!dbus_policy->domains)
+            DBUS_BROKER_ERROR("Realloc failed");
+    }
+
+    dbus_policy->domains[dbus_policy->domain_count++] = domain;
+}
+
+/**
+ * Constructs a policy-object based off the currently enforced policy of the
+ * given system.  The policy file that resides in /etc/rpc-broker.file is 
+ * parsed first.  Then the per-vm policies that reside in the system database
+ * are parsed.  Safe to run on any thread, every database query is made on a
+ * private connection.
+ *
+ * @param rule_filename Overrides the location of the /etc policy.
+ *
+ * @return struct policy pointer of current policy.
+ */
+struct policy *build_policy(const char *rule_filename)
+{
+    struct policy *dbus_policy;
+    int dom_idx;
+    DBusMessage *vms;
+    DBusConnection *conn;
+    DBusMessageIter iter, sub;
+    void *arg;
+    struct domain_policy *current;
+
+    dbus_policy = calloc(1, sizeof *dbus_policy);
+    if (!dbus_policy)
+        DBUS_BROKER_ERROR("Calloc failed");
+    dbus_policy->generation = ++policy_generation;
+    dbus_policy->policy_load_time = time(NULL);
+    dbus_policy->domain_etc_policy = build_etc_policy(rule_filename);
+    dbus_policy->domain_count = 0;
+
+    /* a connection of its own, the loops' shared one may be busy elsewhere */
+    conn = create_private_dbus_connection();
+    vms = conn ? db_list(conn) : NULL;
+    if (!vms) { 
+        DBUS_BROKER_EVENT("No database vms in policy!%s", "");
+        dbus_policy->database = false;
+        if (conn)
+            close_private_dbus_connection(conn);
+        dbus_policy->symbol_version = symbol_table_version();
+        return dbus_policy;
+    }
+
+    dbus_policy->database = true;
+
+    dbus_message_iter_init(vms, &iter);
+    dbus_message_iter_recurse(&iter, &sub);
+
+    while (dbus_message_iter_get_arg_type(&sub) != DBUS_TYPE_INVALID) {
+
+        dbus_message_iter_get_basic(&sub, &arg);
+        current = load_domain_policy(conn, arg);
+        add_domain_policy(dbus_policy, current);
+
+        dbus_message_iter_next(&sub);
+    }
+
+    /* cache every if-boolean attribute up front, rules never query the db */
+    register_attributes(dbus_policy);
+    for (dom_idx=0; dom_idx < dbus_policy->domain_count; dom_idx++)
+        fill_vm_attributes(conn, dbus_policy, dbus_policy->domains[dom_idx]);
+
+    map_domids(dbus_policy);
+
+    dbus_message_unref(vms);
+    close_private_dbus_connection(conn);
+    dbus_policy->symbol_version = symbol_table_version();
+    return dbus_policy;
+}
+
+static uint8_t parse_attribute_state(const char *state)
+{
+    if (!strcmp("true", state))
+        return VM_ATTR_TRUE;
+    else if (!strcmp("false", state))
+        return VM_ATTR_FALSE;
+    else if (!strcmp("other", state))
+        return VM_ATTR_OTHER;
+
+    return VM_ATTR_MISSING;
+}
+
+static const char *attribute_state_name(uint8_t state)
+{
+    switch (state) {
+        case (VM_ATTR_TRUE):
+            return "true";
+        case (VM_ATTR_FALSE):
+            return "false";
+        case (VM_ATTR_OTHER):
+            return "other";
+    }
+
+    return NULL;
+}
+
+/* rebuilds a domain policy from its entry in a policy snapshot */
+static struct domain_policy *restore_domain_policy(struct json_object *jdomain)
+{
+    struct domain_policy *domain;
+    struct json_object *juuid, *jrules, *jrule;
+    const char *uuid;
+    size_t i;
+
+    if (!json_object_object_get_ex(jdomain, "uuid", &juuid) ||
+        !json_object_object_get_ex(jdomain, "rules", &jrules) ||
+        !json_object_is_type(jrules, json_type_array))
+        return NULL;
+
+    uuid = json_object_get_string(juuid);
+    if (!uuid || uuid[0] == '\0' || strlen(uuid) >= MAX_UUID)
+        return NULL;
+
+    domain = new_domain_policy(uuid);
+
+    for (i=0; i < json_object_array_length(jrules); i++) {
+        jrule = json_object_array_get_idx(jrules, i);
+        if (jrule && json_object_is_type(jrule, json_type_string))
+            add_domain_rule(domain, json_object_get_string(jrule));
+    }
+
+    eliminate_shadowed_rules(&(domain->rules), domain->uuid, NULL);
+    build_rule_index(&(domain->rules));
+
+    return domain;
+}
+
+/* fills in the cached `if-boolean` attributes of a restored domain */
+static void restore_vm_attributes(struct policy *dbus_policy,
+                                  struct domain_policy *domain,
+                                  struct json_object *jdomain)
+{
+    struct json_object *jattributes, *jstate;
+    size_t i;
+
+    domain->attribute_count = dbus_policy->attribute_count;
+    if (domain->attribute_count == 0)
+        return;
+
+    domain->attributes = calloc(domain->attribute_count, sizeof(uint8_t));
+    if (!domain->attributes)
+        DBUS_BROKER_ERROR("Calloc failed");
+
+    if (!json_object_object_get_ex(jdomain, "attributes", &jattributes))
+        return;
+
+    for (i=0; i < domain->attribute_count; i++) {
+        if (json_object_object_get_ex(jattributes, dbus_policy->attributes[i],
+                                      &jstate))
+            domain->attributes[i] =
+                parse_attribute_state(json_object_get_string(jstate));
+    }
+}
+
+/*
+ * Adds the domain policies saved in a snapshot by `save_policy_snapshot` to a
+ * policy.  None of them are mapped to a domid, the first request from each
+ * vm still asks xenmgr which vm it is but its rules aren't read again.
+ */
+static void load_policy_snapshot(struct policy *dbus_policy,
+                                 const char *snapshot_filename)
+{
+    struct json_object *jsnapshot, *jdomains, *jdomain, *juuid;
+    struct domain_policy *domain;
+    size_t i;
+
+    jsnapshot = json_object_from_file(snapshot_filename);
+    if (!jsnapshot) {
+        DBUS_BROKER_EVENT("No policy snapshot at <%s>", snapshot_filename);
+        register_attributes(dbus_policy);
+        return;
+    }
+
+    if (!json_object_object_get_ex(jsnapshot, "domains", &jdomains) ||
+        !json_object_is_type(jdomains, json_type_array))
+        jdomains = NULL;
+
+    for (i=0; jdomains && i < json_object_array_length(jdomains); i++) {
+        jdomain = json_object_array_get_idx(jdomains, i);
+        domain = jdomain ? restore_domain_policy(jdomain) : NULL;
+
+        if (!domain)
+            DBUS_BROKER_WARNING("Invalid vm %zu in policy snapshot", i);
+        else if (find_domain_policy(dbus_policy, domain->uuid))
+            release_domain_policy(domain);
+        else
+            add_domain_policy(dbus_policy, domain);
+    }
+
+    register_attributes(dbus_policy);
+
+    for (i=0; jdomains && i < json_object_array_length(jdomains); i++) {
+        jdomain = json_object_array_get_idx(jdomains, i);
+        if (!jdomain || !json_object_object_get_ex(jdomain, "uuid", &juuid))
+            continue;
+
+        domain = find_domain_policy(dbus_policy,
+                                    json_object_get_string(juuid));
+        if (domain && !domain->attributes)
+            restore_vm_attributes(dbus_policy, domain, jdomain);
+    }
+
+    json_object_put(jsnapshot);
+
+    dbus_policy->restored = dbus_policy->domain_count > 0;
+
+    DBUS_BROKER_EVENT("Restored the policy of %zu vm(s) from <%s>",
+                      dbus_policy->domain_count, snapshot_filename);
+}
+
+/**
+ * Constructs the policy the broker starts out with, without making a single
+ * request on the bus.  Only the /etc policy is parsed, the policy of a vm is
+ * loaded by the policy builder once a request comes from it (see
+ * `request_domid_load`) and until then its requests are filtered by the /etc
+ * policy alone.  A snapshot saved by an earlier run gives a warm start.  The
+ * database is taken to be reachable until `start_policy_builder` finds out.
+ *
+ * @param rule_filename Overrides the location of the /etc policy.
+ * @param snapshot_filename a policy snapshot to restore, may be NULL.
+ *
+ * @return struct policy pointer of the startup policy.
+ */
+struct policy *build_startup_policy(const char *rule_filename,
+                                    const char *snapshot_filename)
+{
+    struct policy *dbus_policy;
+
+    dbus_policy = calloc(1, sizeof *dbus_policy);
+    if (!dbus_policy)
+        DBUS_BROKER_ERROR("Calloc failed");
+    dbus_policy->generation = ++policy_generation;
+    dbus_policy->policy_load_time = time(NULL);
+    dbus_policy->domain_etc_policy = build_etc_policy(rule_filename);
+
+    /* unknown until the policy builder's first pass probes it */
+    dbus_policy->database = true;
+
+    if (snapshot_filename)
+        load_policy_snapshot(dbus_policy, snapshot_filename);
+    else
+        register_attributes(dbus_policy);
+
+    dbus_policy->symbol_version = symbol_table_version();
+
+    return dbus_policy;
+}
+
+/*
+ * Writes the domain policies of a policy out to a snapshot for the next
+ * start.  Rules are written in the policy syntax along with the cached
+ * `if-boolean` attributes of each vm, the snapshot is swapped in with a
+ * rename so a crash never leaves half of one behind.
+ */
+static void save_policy_snapshot(struct policy *dbus_policy,
+                                 const char *snapshot_filename)
+{
+    struct json_object *jsnapshot, *jdomains, *jdomain, *jrules, *jattributes;
+    struct domain_policy *domain;
+    char rule[RULE_MAX_LENGTH * 2];
+    const char *state;
+    char *tmp_filename;
+    size_t i, j;
+
+    jsnapshot = json_object_new_object();
+    jdomains = json_object_new_array();
+    json_object_object_add(jsnapshot, "domains", jdomains);
+
+    for (i=0; i < dbus_policy->domain_count; i++) {
+        domain = dbus_policy->domains[i];
+
+        jdomain = json_object_new_object();
+        jrules = json_object_new_array();
+        jattributes = json_object_new_object();
+        json_object_object_add(jdomain, "uuid",
+                               json_object_new_string(domain->uuid));
+        json_object_object_add(jdomain, "rules", jrules);
+        json_object_object_add(jdomain, "attributes", jattributes);
+        json_object_array_add(jdomains, jdomain);
+
+        /* a snapshot missing a rule would enforce a different policy */
+        for (j=0; j < domain->rules.count; j++) {
+            if (format_rule(&(domain->rules.rules[j]), rule, sizeof(rule))) {
+                DBUS_BROKER_WARNING("Rule %zu of vm <%s> too long to snapshot",
+                                    j, domain->uuid);
+                goto snapshot_done;
+            }
+
+            json_object_array_add(jrules, json_object_new_string(rule));
+        }
+
+        for (j=0; j < domain->attribute_count; j++) {
+            state = attribute_state_name(domain->attributes[j]);
+            if (state)
+                json_object_object_add(jattributes,
+                                       dbus_policy->attributes[j],
+                                       json_object_new_string(state));
+        }
+    }
+
+    DBUS_REQ_ARG(tmp_filename, "%s.tmp", snapshot_filename);
+
+    if (json_object_to_file_ext(tmp_filename, jsnapshot,
+                                JSON_C_TO_STRING_PLAIN) < 0 ||
+        rename(tmp_filename, snapshot_filename) < 0) {
+        DBUS_BROKER_WARNING("Failed to save policy snapshot <%s>",
+                            snapshot_filename);
+        unlink(tmp_filename);
+    }
+
+    free(tmp_filename);
+
+snapshot_done:
+    json_object_put(jsnapshot);
+}
+
+/* puts a freshly loaded domain in a policy, replacing its older version */
+static void replace_domain_policy(struct policy *dbus_policy,
+                                  struct domain_policy *domain)
+{
+    size_t i;
+
+    for (i=0; i < dbus_policy->domain_count; i++) {
+        if (strcmp(dbus_policy->domains[i]->uuid, domain->uuid))
+            continue;
+
+        release_domain_policy(dbus_policy->domains[i]);
+        dbus_policy->domains[i] = domain;
+        return;
+    }
+
+    /* kept even without rules, the /etc rules read its attributes */
+    add_domain_policy(dbus_policy, domain);
+}
+
+static bool is_reloaded(const char *uuid, char uuids[][MAX_UUID],
+                        size_t count)
+{
+    size_t i;
+
+    for (i=0; i < count; i++) {
+        if (!strcmp(uuids[i], uuid))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Carries the domid map of the policy in place over to its successor, but
+ * for the domids of vms that were just reloaded.  Those are mapped on the
+ * domid xenmgr reported as they were loaded.
+ */
+static void carry_domids(struct policy *dbus_policy, struct policy *current,
+                         char uuids[][MAX_UUID], size_t count)
+{
+    struct domid_entry *entry;
+    int i;
+
+    for (i=0; i < DOMID_MAP_BUCKETS; i++) {
+        for (entry = current->domids[i]; entry; entry = entry->next) {
+            if (entry->domain && is_reloaded(entry->domain->uuid, uuids, count))
+                continue;
+
+            map_domid(dbus_policy, entry->domid, entry->domain);
+        }
+    }
+}
+
+/*
+ * Maps a domid requests came from onto the policy of the vm running as it,
+ * loading the vm's rules unless the policy already has them.
+ */
+static void load_domid_policy(DBusConnection *conn,
+                              struct policy *dbus_policy, uint16_t domid)
+{
+    struct domain_policy *domain;
+    char *uuid;
+
+    if (lookup_domid_policy(dbus_policy, domid, NULL))
+        return;
+
+    uuid = get_uuid_from_domid(conn, domid);
+    if (!uuid) {
+        map_domid(dbus_policy, domid, NULL);
+        return;
+    }
+
+    domain = find_domain_policy(dbus_policy, uuid);
+
+    if (!domain) {
+        domain = new_domain_policy(uuid);
+        domain->domid = domid;
+        get_rules(conn, domain);
+        register_domain_attributes(dbus_policy, domain);
+        fill_vm_attributes(conn, dbus_policy, domain);
+        add_domain_policy(dbus_policy, domain);
+    }
+
+    map_domid(dbus_policy, domid, domain);
+    free(uuid);
+}
+
+/**
+ * Constructs a policy-object from the policy in place where only the given
+ * vms are re-read from the database.  The /etc policy and the policy of every
+ * other domain are shared with the current policy.
+ *
+ * @param current the policy in place.
+ * @param uuids the uuids of the vms whose policy changed.
+ * @param count the number of uuids.
+ * @param domids domids requests came from that `current` doesn't map.
+ * @param domid_count the number of domids.
+ *
+ * @return the new policy, or NULL if the database couldn't be reached.
+ */
+struct policy *update_policy(struct policy *current, char uuids[][MAX_UUID],
+                             size_t count, uint16_t *domids,
+                             size_t domid_count)
+{
+    struct policy *dbus_policy;
+    struct domain_policy *domain;
+    DBusConnection *conn;
+    size_t i;
+
+    conn = create_private_dbus_connection();
+    if (!conn)
+        return NULL;
+
+    dbus_policy = calloc(1, sizeof *dbus_policy);
+    if (!dbus_policy)
+        DBUS_BROKER_ERROR("Calloc failed");
+    dbus_policy->generation = ++policy_generation;
+    dbus_policy->policy_load_time = time(NULL);
+    dbus_policy->database = current->database;
+
+    dbus_policy->domain_etc_policy = current->domain_etc_policy;
+    dbus_policy->domain_etc_policy->refs++;
+
+    for (i=0; i < current->domain_count; i++) {
+        current->domains[i]->refs++;
+        add_domain_policy(dbus_policy, current->domains[i]);
+    }
+
+    /* keeps every attribute id of the shared rules */
+    if (current->attribute_count > 0) {
+        dbus_policy->attributes = calloc(current->attribute_count,
+                                         sizeof(char *));
+        if (!dbus_policy->attributes)
+            DBUS_BROKER_ERROR("Calloc failed");
+    }
+
+    for (i=0; i < current->attribute_count; i++) {
+        dbus_policy->attributes[i] = strdup(current->attributes[i]);
+        if (!dbus_policy->attributes[i])
+            DBUS_BROKER_ERROR("Malloc Failed!");
+    }
+    dbus_policy->attribute_count = current->attribute_count;
+
+    for (i=0; i < count; i++) {
+        domain = load_domain_policy(conn, uuids[i]);
+        register_domain_attributes(dbus_policy, domain);
+        fill_vm_attributes(conn, dbus_policy, domain);
+        replace_domain_policy(dbus_policy, domain);
+    }
+
+    map_domids(dbus_policy);
+    carry_domids(dbus_policy, current, uuids, count);
+
+    for (i=0; i < domid_count; i++)
+        load_domid_policy(conn, dbus_policy, domids[i]);
+
+    close_private_dbus_connection(conn);
+    dbus_policy->symbol_version = symbol_table_version();
+
+    return dbus_policy;
+}
+
+/*
+ * Free's a policy structure object.  Iterating over all domain-specific
+ * database policies and also free'ing the policy structure created from the
+ * etc file, both only go with the last policy sharing them.
+ */
+static void destroy_policy(struct policy *dbus_policy)
+{
+    int i;
+
+    free_domid_map(dbus_policy);
+
+    for (i=0; i < dbus_policy->domain_count; i++)
+        release_domain_policy(dbus_policy->domains[i]);
+
+    if (dbus_policy->domains)
+        free(dbus_policy->domains);
+
+    release_etc_policy(dbus_policy->domain_etc_policy);
+
+    for (i=0; i < dbus_policy->attribute_count; i++)
+        free(dbus_policy->attributes[i]);
+
+    if (dbus_policy->attributes)
+        free(dbus_policy->attributes);
+
+    free(dbus_policy);
+}
+
+/**
+ * Free's the policy in place, the policy builder must not be running.
+ */
+void free_policy(void)
+{
+    struct policy_reader *reader;
+
+    if (dbus_broker_policy)
+        destroy_policy(dbus_broker_policy);
+
+    dbus_broker_policy = NULL;
+
+    while ((reader = policy_readers) != NULL) {
+        policy_readers = reader->next;
+        free(reader);
+    }
+}
+
+/* gives the calling thread a slot in the list of readers */
+static struct policy_reader *register_policy_reader(void)
+{
+    struct policy_reader *reader;
+
+    reader = calloc(1, sizeof *reader);
+    if (!reader)
+        DBUS_BROKER_ERROR("Calloc failed");
+
+    pthread_mutex_lock(&readers_lock);
+    reader->next = policy_readers;
+    policy_readers = reader;
+    pthread_mutex_unlock(&readers_lock);
+
+    return reader;
+}
+
+/**
+ * Takes a snapshot of the policy in place for reading, it won't be free'd
+ * until released even if a newer policy is published meanwhile.  Holds
+ * nest, a nested hold gets the same snapshot as the outermost one.  Raw-dbus
+ * workers hold it while filtering a batch of requests.
+ *
+ * @return the policy snapshot, may be NULL before the first policy is built.
+ */
+struct policy *acquire_policy(void)
+{
+    struct policy_reader *reader;
+    uint64_t epoch;
+
+    reader = current_reader;
+    if (!reader)
+        reader = current_reader = register_policy_reader();
+
+    if (reader->depth++ > 0)
+        return reader->policy;
+
+    /* the epoch has to be visible before the policy pointer is read */
+    epoch = __atomic_load_n(&policy_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&reader->epoch, epoch, __ATOMIC_SEQ_CST);
+    reader->policy = __atomic_load_n(&dbus_broker_policy, __ATOMIC_SEQ_CST);
+
+    return reader->policy;
+}
+
+/**
+ * Releases the hold taken by `acquire_policy`.
+ */
+void release_policy(void)
+{
+    struct policy_reader *reader;
+
+    reader = current_reader;
+    if (--reader->depth > 0)
+        return;
+
+    reader->policy = NULL;
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Waits for every reader that may still hold a policy retired before
+ * `epoch`, readers that took their snapshot afterwards only ever see the
+ * newer policy.  Readers are only ever pushed onto the head of the list, so
+ * the list as of now is walked without holding the lock, a thread registering
+ * meanwhile isn't kept waiting and starts on the newer policy anyway.
+ */
+static void wait_for_policy_readers(uint64_t epoch)
+{
+    struct timespec pause = { .tv_sec=0, .tv_nsec=POLICY_READER_POLL };
+    struct policy_reader *reader, *readers;
+    uint64_t held;
+
+    pthread_mutex_lock(&readers_lock);
+    readers = policy_readers;
+    pthread_mutex_unlock(&readers_lock);
+
+    for (reader = readers; reader; reader = reader->next) {
+        while ((held = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST)) &&
+               held < epoch)
+            nanosleep(&pause, NULL);
+    }
+}
+
+/**
+ * Puts a newly built policy in place with a single atomic swap, requests
+ * being filtered keep the snapshot they started with.  The old policy is
+ * free'd once no reader holds it, the caller waits for that so it should not
+ * be an event-loop.
+ *
+ * @param dbus_policy the policy to enforce from now on.
+ */
+void publish_policy(struct policy *dbus_policy)
+{
+    struct policy *old;
+    uint64_t epoch;
+
+    old = __atomic_exchange_n(&dbus_broker_policy, dbus_policy,
+                              __ATOMIC_SEQ_CST);
+    epoch = __atomic_add_fetch(&policy_epoch, 1, __ATOMIC_SEQ_CST);
+
+    if (!old)
+        return;
+
+    wait_for_policy_readers(epoch);
+    destroy_policy(old);
+}
+
+/* asks the database for its vms, to find out whether it can be reached */
+static bool probe_database(void)
+{
+    DBusConnection *conn;
+    DBusMessage *vms;
+
+    conn = create_private_dbus_connection();
+    if (!conn)
+        return false;
+
+    vms = db_list(conn);
+    close_private_dbus_connection(conn);
+
+    if (!vms)
+        return false;
+
+    dbus_message_unref(vms);
+
+    return true;
+}
+
+/*
+ * Body of the policy builder thread, rebuilds the policy whenever asked to.
+ * Requests made while a rebuild is running are coalesced into the next one,
+ * a full rebuild takes in every vm reload pending.  Vm loads are served
+ * ahead of a pending full rebuild, requests waiting on them are only
+ * filtered by the /etc policy meanwhile.
+ */
+static void *run_policy_builder(void *data)
+{
+    char (*uuids)[MAX_UUID];
+    uint16_t *domids;
+    struct policy *current, *dbus_policy;
+    size_t count, domid_count, mapped, i;
+    bool full, probe;
+
+    /*
+     * The startup policy takes the database to be there, the first pass
+     * settles it unless a full rebuild is already queued.  Without one the
+     * policy is built as `build_policy` would have at startup, the snapshot
+     * left as it was.
+     */
+    pthread_mutex_lock(&builder.lock);
+    probe = !builder.requested;
+    pthread_mutex_unlock(&builder.lock);
+
+    current = __atomic_load_n(&dbus_broker_policy, __ATOMIC_ACQUIRE);
+    if (probe && current && current->database && !probe_database()) {
+        DBUS_BROKER_EVENT("Database unreachable, re-building policy %s", "");
+        publish_policy(build_policy(builder.rule_file));
+    }
+
+    pthread_mutex_lock(&builder.lock);
+
+    while (builder.running) {
+        if (!builder.requested && builder.uuid_count == 0 &&
+            builder.domid_count == 0) {
+            pthread_cond_wait(&builder.wakeup, &builder.lock);
+            continue;
+        }
+
+        /* only this thread publishes, the policy in place can't go away */
+        current = __atomic_load_n(&dbus_broker_policy, __ATOMIC_ACQUIRE);
+
+        full = !current || !current->database ||
+               (builder.requested && builder.uuid_count == 0 &&
+                builder.domid_count == 0);
+
+        if (full)
+            builder.requested = false;
+
+        count = builder.uuid_count;
+        uuids = builder.uuids;
+        domid_count = builder.domid_count;
+        domids = builder.domids;
+        builder.uuids = NULL;
+        builder.uuid_count = 0;
+        builder.uuid_size = 0;
+        builder.domids = NULL;
+        builder.domid_count = 0;
+        builder.domid_size = 0;
+        pthread_mutex_unlock(&builder.lock);
+
+        /* domids queued again while they were being loaded are mapped now */
+        for (i=0, mapped=0; !full && i < domid_count; i++) {
+            if (lookup_domid_policy(current, domids[i], NULL))
+                mapped++;
+            else
+                domids[i - mapped] = domids[i];
+        }
+        domid_count -= mapped;
+
+        if (full) {
+            DBUS_BROKER_EVENT("Re-building policy %s", "");
+            dbus_policy = build_policy(builder.rule_file);
+        } else if (count == 0 && domid_count == 0) {
+            dbus_policy = NULL;
+        } else {
+            DBUS_BROKER_EVENT("Re-loading policy of %zu vm(s), %zu domid(s)",
+                              count, domid_count);
+            dbus_policy = update_policy(current, uuids, count,
+                                        domids, domid_count);
+        }
+
+        if (uuids)
+            free(uuids);
+
+        if (domids)
+            free(domids);
+
+        if (dbus_policy) {
+            publish_policy(dbus_policy);
+            DBUS_BROKER_EVENT("Policy generation %u in place",
+                              dbus_policy->generation);
+
+            /* a domid load only adds a vm, the next reload saves it */
+            if (builder.snapshot_file && (full || count > 0))
+                save_policy_snapshot(dbus_policy, builder.snapshot_file);
+        }
+
+        pthread_mutex_lock(&builder.lock);
+    }
+
+    pthread_mutex_unlock(&builder.lock);
+
+    return NULL;
+}
+
+/**
+ * Starts the thread policy reloads are built on, so the event-loops keep
+ * forwarding messages while the database is being read.  The thread blocks
+ * every signal, they are left to the main loop.  A policy in place that was
+ * restored from a snapshot may be stale, a full rebuild is queued for it.
+ * Otherwise the thread first checks that the database can be reached.
+ *
+ * @param rule_filepath the location of the /etc policy.
+ * @param snapshot_filepath where the policy is saved after a full rebuild or
+ * vm reload, may be NULL.
+ */
+void start_policy_builder(const char *rule_filepath,
+                          const char *snapshot_filepath)
+{
+    struct policy *current;
+    sigset_t mask, old_mask;
+
+    current = __atomic_load_n(&dbus_broker_policy, __ATOMIC_ACQUIRE);
+
+    builder.rule_file = rule_filepath;
+    builder.snapshot_file = snapshot_filepath;
+    builder.requested = current && current->restored;
+    builder.running = true;
+
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    if (pthread_create(&builder.thread, NULL, run_policy_builder, NULL) != 0)
+        DBUS_BROKER_ERROR("pthread_create");
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+/**
+ * Asks the policy builder for a rebuild, it returns straight away.
+ */
+void request_policy_rebuild(void)
+{
+    pthread_mutex_lock(&builder.lock);
+    builder.requested = true;
+    pthread_cond_signal(&builder.wakeup);
+    pthread_mutex_unlock(&builder.lock);
+}
+
+/**
+ * Asks the policy builder to re-read the policy of a single vm, leaving the
+ * rest of the policy as it is.  It returns straight away.
+ *
+ * @param uuid the uuid of the vm whose state changed.
+ */
+void request_vm_reload(const char *uuid)
+{
+    size_t i;
+
+    pthread_mutex_lock(&builder.lock);
+
+    for (i=0; i < builder.uuid_count; i++) {
+        if (!strcmp(builder.uuids[i], uuid))
+            break;
+    }
+
+    if (i == builder.uuid_count) {
+        if (builder.uuid_count == builder.uuid_size) {
+            builder.uuid_size = builder.uuid_size ? builder.uuid_size * 2 : 8;
+            builder.uuids = realloc(builder.uuids,
+                                    builder.uuid_size * MAX_UUID);
+            if (!builder.uuids)
+                DBUS_BROKER_ERROR("Realloc failed");
+        }
+
+        snprintf(builder.uuids[builder.uuid_count++], MAX_UUID, "%s", uuid);
+    }
+
+    pthread_cond_signal(&builder.wakeup);
+    pthread_mutex_unlock(&builder.lock);
+}
+
+/**
+ * Asks the policy builder to load the policy of the vm running as a domid a
+ * request came from, the policy in place doesn't map it yet.  It returns
+ * straight away.
+ *
+ * @param domid the domain id the request came from.
+ */
+void request_domid_load(uint16_t domid)
+{
+    size_t i;
+
+    pthread_mutex_lock(&builder.lock);
+
+    for (i=0; i < builder.domid_count; i++) {
+        if (builder.domids[i] == domid)
+            break;
+    }
+
+    if (i == builder.domid_count) {
+        if (builder.domid_count == builder.domid_size) {
+            builder.domid_size = builder.domid_size ?
+                                 builder.domid_size * 2 : 8;
+            builder.domids = realloc(builder.domids,
+                                     builder.domid_size * sizeof(uint16_t));
+            if (!builder.domids)
+                DBUS_BROKER_ERROR("Realloc failed");
+        }
+
+        builder.domids[builder.domid_count++] = domid;
+        pthread_cond_signal(&builder.wakeup);
+    }
+
+    pthread_mutex_unlock(&builder.lock);
+}
+
+/**
+ * Stops the policy builder, waiting on a rebuild that's already running.
+ */
+void stop_policy_builder(void)
+{
+    if (!builder.running)
+        return;
+
+    pthread_mutex_lock(&builder.lock);
+    builder.running = false;
+    pthread_cond_signal(&builder.wakeup);
+    pthread_mutex_unlock(&builder.lock);
+
+    pthread_join(builder.thread, NULL);
+
+    if (builder.uuids)
+        free(builder.uuids);
+
+    if (builder.domids)
+        free(builder.domids);
+
+    builder.uuids = NULL;
+    builder.uuid_count = 0;
+    builder.uuid_size = 0;
+    builder.domids = NULL;
+    builder.domid_count = 0;
+    builder.domid_size = 0;
+}
@@ -29,32 +29,85 @@
 #define RULES_MAX_LENGTH 256
 #define RULE_MAX_LENGTH  512
 
+/* flag bits of a rule, the upper half holds the id of its `if-boolean` */
+#define RULE_ALLOW           0x0001
+#define RULE_ALL             0x0002
+#define RULE_OUT             0x0004
+#define RULE_STUBDOM         0x0008
+#define RULE_IF_BOOL_TRUE    0x0010
+#define RULE_ATTRIBUTE_SHIFT 16
+
+#define RULE_ATTRIBUTE(r) ((uint16_t) ((r)->flags >> RULE_ATTRIBUTE_SHIFT))
+
 /**
  * @brief Rule structure
  *
  * Used to tokenize an single policy rule.  Separating into policy fields,
  * that later are checked against a request that is similarly broken down
- * into tokens to compare.
+ * into tokens to compare.  The fields are symbol ids, SYMBOL_NONE where the
+ * rule leaves a field unset.
  */
 struct rule {
-    bool all;
-    bool out;
-    bool policy;
-    bool stubdom;
-    bool if_bool_flag;
-    const char *destination;
-    const char *path;
-    const char *interface;
-    const char *member;
-    const char *if_bool;
-    const char *domtype;
-    const char *rule_string;
+    uint32_t flags;
+    uint32_t destination;
+    uint32_t path;
+    uint32_t interface;
+    uint32_t member;
+    uint32_t if_bool;
+    uint32_t domtype;
+};
+
+/**
+ * @brief Rule index bucket
+ *
+ * Holds the positions (in ascending order) of every rule that shares the same
+ * destination, interface and member symbols.  An unset field is the wildcard
+ * bucket for rules that leave that field unset.
+ */
+struct rule_bucket {
+    uint32_t destination;
+    uint32_t interface;
+    uint32_t member;
+    size_t count;
+    size_t size;
+    uint32_t *positions;
+    struct rule_bucket *next;
+};
+
+#define RULE_INDEX_BUCKETS 64  /* must be a power of two */
+#define RULE_INDEX_PROBES   8  /* destination/interface/member x wildcard */
+
+/**
+ * @brief Rule index structure
+ *
+ * Hash table of `rule_bucket` objects compiled from a list of rules, a lookup
+ * only ever touches the buckets whose rules are able to match a request.
+ */
+struct rule_index {
+    struct rule_bucket *buckets[RULE_INDEX_BUCKETS];
 };
 
+/**
+ * @brief Rule set structure
+ *
+ * A growable list of rules along with their compiled index.
+ */
+struct rule_set {
+    size_t count;
+    size_t size;
+    struct rule *rules;
+    struct rule_index index;
+};
+
+#define RULE_SET_SIZE 16  /* initial rules of a set */
+
+/* cached states of a vm's `if-boolean` attribute */
+#define VM_ATTR_MISSING 0
+#define VM_ATTR_TRUE    1
+#define VM_ATTR_FALSE   2
+#define VM_ATTR_OTHER   3
+
 #define MAX_UUID       128
-#define MAX_RULES      512
-#define MAX_DOMAINS    128
-#define MAX_SIGNALS     16
 #define ETC_MAX_FILE 0xffff
 
 #define TRANSFORM_UUID(uuid, uuid_buf)            \
@@ -72,12 +125,12 @@ struct rule {
 /**
  * @brief Etc policy structure
  *
- * Contains an array of `rule` objects created from a given policy file
- * found under /etc  (usually rpc-broker.rules)
+ * Contains the `rule` objects created from a given policy file found under
+ * /etc  (usually rpc-broker.rules)
  */
 struct etc_policy {
-    size_t count;
-    struct rule rules[MAX_RULES];
+    size_t refs;
+    struct rule_set rules;
 };
 
 /**
@@ -85,14 +138,36 @@ struct etc_policy {
  *
  * Contains the policy information based of a domain specific policy.  The
  * domain id is listed along with the uuid in order to identify and associate
- * the policy with any requests coming from the matching domain.
+ * the policy with any requests coming from the matching domain, it's the
+ * domain id xenmgr reported when the vm's policy was loaded (DOMID_NONE if it
+ * wasn't running).  Domain policies that didn't change are shared between
+ * policies, `refs` is only touched by the policy builder.
  */
 struct domain_policy {
-    uint16_t domid;
-    size_t count;
+    int32_t domid;
+    size_t refs;
     char uuid[MAX_UUID];
     char uuid_db_fmt[MAX_UUID];
-    struct rule rules[MAX_RULES];
+    struct rule_set rules;
+    size_t attribute_count;
+    uint8_t *attributes;
+};
+
+#define DOMID_MAP_BUCKETS 64  /* must be a power of two */
+
+/**
+ * @brief an entry of a policy's domid map.
+ *
+ * Maps the domain id of a running vm to its domain policy.  Every policy
+ * generation builds a map of its own, so an entry is only ever found under
+ * the (domid, generation) it was made for and a domid reused by another vm
+ * can't resolve to the old vm's policy.  A NULL `domain` records a domid
+ * that was looked up and has no vm policy.
+ */
+struct domid_entry {
+    uint16_t domid;
+    struct domain_policy *domain;
+    struct domid_entry *next;
 };
 
 /**
@@ -100,26 +175,108 @@ struct domain_policy {
  *
  * The main policy object that holds the etc-policy and all other domain-policy
  * objects.  This object also has fields to track meta data that arises from
- * any requests made on rpc-broker.
+ * any requests made on rpc-broker.  The names of every `if-boolean` attribute
+ * used by a rule are kept here, each domain caches the state of those
+ * attributes for its vm in `attributes` (indexed by the rule's attribute id).
+ * `symbol_version` is the version of the symbol table once every field of
+ * the policy was interned.  `restored` marks a policy whose vms came from a
+ * snapshot, their rules may be out of date.
  */ 
 struct policy {
     bool database;
+    bool restored;
+    uint32_t generation;
+    uint32_t symbol_version;
+    size_t attribute_count;
+    char **attributes;
     size_t domain_count;
+    size_t domain_size;
     time_t policy_load_time;
     size_t allowed_requests;
     size_t denied_requests;
     size_t total_requests;
-    struct etc_policy domain_etc_policy;
-    struct domain_policy domains[MAX_DOMAINS];
+    struct etc_policy *domain_etc_policy;
+    struct domain_policy **domains;
+    struct domid_entry *domids[DOMID_MAP_BUCKETS];
 };
 
+#define POLICY_READER_POLL 1000000  /* nanosecs between checks on a reader */
+                                    /* still holding a retired policy */
+
+/**
+ * @brief a thread reading the policy.
+ *
+ * `epoch` is the policy epoch the thread's snapshot was taken in, 0 while it
+ * holds none.  A retired policy is only free'd once every reader has let go
+ * of the epochs it was in place for.
+ */
+struct policy_reader {
+    uint64_t epoch;
+    size_t depth;
+    struct policy *policy;
+    struct policy_reader *next;
+};
 
+/**
+ * @brief the thread policy reloads are built on.
+ *
+ * `requested` asks for a full rebuild, `uuids` lists the vms whose policy
+ * alone needs re-reading and `domids` the domains requests came from that
+ * the policy in place doesn't map yet.
+ */
+struct policy_builder {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    bool running;
+    bool requested;
+    size_t uuid_count;
+    size_t uuid_size;
+    char (*uuids)[MAX_UUID];
+    size_t domid_count;
+    size_t domid_size;
+    uint16_t *domids;
+    const char *rule_file;
+    const char *snapshot_file;
+};
+
+/* only ever swapped atomically, read it through `acquire_policy` */
 struct policy *dbus_broker_policy;
 
 /* src/policy.c */
 struct policy *build_policy(const char *rule_filepath);
 
-void free_rule(struct rule r);
+struct policy *build_startup_policy(const char *rule_filepath,
+                                    const char *snapshot_filepath);
+
+struct policy *update_policy(struct policy *current, char uuids[][MAX_UUID],
+                             size_t count, uint16_t *domids,
+                             size_t domid_count);
+
+size_t lookup_rule_index(struct rule_index *index, struct dbus_message *dmsg,
+                         struct rule_bucket **matches);
 
 void free_policy(void);
 
+int lint_policy_file(const char *rule_filepath);
+
+struct policy *acquire_policy(void);
+
+void release_policy(void);
+
+void publish_policy(struct policy *dbus_policy);
+
+void start_policy_builder(const char *rule_filepath,
+                          const char *snapshot_filepath);
+
+void request_policy_rebuild(void);
+
+void request_vm_reload(const char *uuid);
+
+void request_domid_load(uint16_t domid);
+
+void stop_policy_builder(void);
+
+bool lookup_domid_policy(struct policy *dbus_policy, uint16_t domid,
+                         struct domain_policy **domain);
+
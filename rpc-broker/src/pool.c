@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2019 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file pool.c
+ * @author Tim Konick <konickt@ainfosec.com>
+ * @date March 4, 2019
+ * @brief Bus socket pool.
+ *
+ * Connecting to the bus for every accepted raw-dbus client serializes the
+ * connects on the event-loop, a few connected sockets are kept ready instead
+ * and the pool is refilled on the libuv thread-pool.
+ */
+
+#include "rpc-broker.h"
+
+
+/*
+ * A pooled socket is stale once it's older than BUS_POOL_MAX_AGE or the bus
+ * has hung up on it.  The bus never sends anything before the client starts
+ * authenticating, so any readable data means the socket was closed.
+ */
+static bool bus_socket_stale(struct bus_socket *sock, uint64_t now)
+{
+    char byte;
+
+    if (now - sock->created >= BUS_POOL_MAX_AGE)
+        return true;
+
+    return recv(sock->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) >= 0 ||
+           (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+static void prune_bus_pool(struct bus_pool *pool)
+{
+    uint64_t now;
+    int i, kept;
+
+    now = uv_hrtime() / 1000000;
+    kept = 0;
+
+    for (i=0; i < pool->count; i++) {
+        if (bus_socket_stale(&(pool->sockets[i]), now))
+            close(pool->sockets[i].fd);
+        else
+            pool->sockets[kept++] = pool->sockets[i];
+    }
+
+    pool->count = kept;
+}
+
+/* runs on the libuv thread-pool */
+static void connect_bus_sockets(uv_work_t *work)
+{
+    struct bus_pool *pool;
+    int fd;
+
+    pool = (struct bus_pool *) work->data;
+    pool->fresh_count = 0;
+
+    while (pool->fresh_count < pool->wanted) {
+        fd = connect_to_system_bus(pool->bus_path);
+        if (fd < 0)
+            break;
+
+        pool->fresh[pool->fresh_count].fd = fd;
+        pool->fresh[pool->fresh_count].created = uv_hrtime() / 1000000;
+        pool->fresh_count++;
+    }
+}
+
+static void add_bus_sockets(uv_work_t *work, int status)
+{
+    struct bus_pool *pool;
+    int i;
+
+    pool = (struct bus_pool *) work->data;
+    pool->refilling = false;
+
+    for (i=0; i < pool->fresh_count; i++) {
+        if (status == 0 && !pool->closed && pool->count < pool->size)
+            pool->sockets[pool->count++] = pool->fresh[i];
+        else
+            close(pool->fresh[i].fd);
+    }
+
+    pool->fresh_count = 0;
+}
+
+static void refill_bus_pool(struct bus_pool *pool)
+{
+    if (pool->closed || pool->refilling || pool->count >= pool->size)
+        return;
+
+    pool->wanted = pool->size - pool->count;
+    pool->work.data = pool;
+
+    if (uv_queue_work(pool->timer.loop, &pool->work, connect_bus_sockets,
+                      add_bus_sockets) == 0)
+        pool->refilling = true;
+}
+
+/* keeps the pool warm while no clients are connecting */
+static void service_bus_pool(uv_timer_t *timer)
+{
+    struct bus_pool *pool;
+
+    pool = (struct bus_pool *) timer->data;
+
+    prune_bus_pool(pool);
+    refill_bus_pool(pool);
+}
+
+/**
+ * Splits BUS_POOL_TOTAL between the raw-dbus event-loops, so the pooled
+ * sockets of every worker together stay well under the bus's limit on
+ * unauthenticated connections.
+ *
+ * @param workers the number of raw-dbus event-loops.
+ * @param worker the event-loop's index, 0 for the main loop.
+ *
+ * @return the number of sockets that event-loop may keep pooled.
+ */
+int bus_pool_share(int workers, int worker)
+{
+    int share;
+
+    share = BUS_POOL_TOTAL / workers;
+    if (worker < BUS_POOL_TOTAL % workers)
+        share++;
+
+    return share < BUS_POOL_SIZE ? share : BUS_POOL_SIZE;
+}
+
+/**
+ * Starts filling a bus socket pool on the given event-loop.
+ *
+ * @param loop the raw-dbus event-loop the pool serves.
+ * @param pool the pool being initialized.
+ * @param bus_path the path of the bus socket, DBUS_BUS_ADDR if NULL.
+ * @param size the sockets kept, at most BUS_POOL_SIZE.  With none every
+ * client connects to the bus as it's accepted.
+ */
+void init_bus_pool(uv_loop_t *loop, struct bus_pool *pool,
+                   const char *bus_path, int size)
+{
+    memset(pool, 0, sizeof *pool);
+    pool->bus_path = bus_path;
+    pool->size = size < BUS_POOL_SIZE ? size : BUS_POOL_SIZE;
+
+    uv_timer_init(loop, &pool->timer);
+    pool->timer.data = pool;
+    uv_timer_start(&pool->timer, service_bus_pool, 0,
+                   BUS_POOL_MAX_AGE / 2);
+}
+
+/**
+ * Takes a connected bus socket out of the pool, the pool is topped back up
+ * in the background.  Only if the pool is empty is the connect made right
+ * away.
+ *
+ * @param pool the pool to take from.
+ *
+ * @return the connected socket, -1 on failure.
+ */
+int take_bus_socket(struct bus_pool *pool)
+{
+    struct bus_socket *sock;
+    uint64_t now;
+    int fd;
+
+    fd = -1;
+    now = uv_hrtime() / 1000000;
+
+    /* the newest socket is at the end */
+    while (pool->count > 0) {
+        sock = &(pool->sockets[--pool->count]);
+        if (!bus_socket_stale(sock, now)) {
+            fd = sock->fd;
+            break;
+        }
+
+        close(sock->fd);
+    }
+
+    if (fd < 0)
+        fd = connect_to_system_bus(pool->bus_path);
+
+    refill_bus_pool(pool);
+
+    return fd;
+}
+
+/**
+ * Closes every socket held by a pool and its timer.  A refill still running
+ * on the thread-pool closes its sockets once it completes.  Freeing a pool
+ * twice is harmless.
+ *
+ * @param pool the pool to free.
+ */
+void free_bus_pool(struct bus_pool *pool)
+{
+    int i;
+
+    if (pool->closed)
+        return;
+
+    pool->closed = true;
+    uv_close((uv_handle_t *) &pool->timer, NULL);
+
+    for (i=0; i < pool->count; i++)
+        close(pool->sockets[i].fd);
+
+    pool->count = 0;
+
+    if (pool->refilling)
+        uv_cancel((uv_req_t *) &pool->work);
+}
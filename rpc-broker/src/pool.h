@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2019 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file pool.h
+ * @author Tim Konick <konickt@ainfosec.com>
+ * @date March 4, 2019
+ * @brief Bus socket pool declarations.
+ *
+ * A pool of sockets already connected to the bus, handed to raw-dbus clients
+ * as they are accepted.
+ */
+
+#define BUS_POOL_SIZE    8     /* the most sockets a single event-loop keeps */
+#define BUS_POOL_TOTAL   16    /* shared by every event-loop, the bus only */
+                               /* allows 64 unauthenticated connections */
+#define BUS_POOL_MAX_AGE 2000  /* milliseconds, the bus drops connections */
+                               /* that haven't authenticated after 5s */
+
+/**
+ * @brief a pooled socket connected to the bus and the time (ms) it was
+ * connected.
+ */
+struct bus_socket {
+    int fd;
+    uint64_t created;
+};
+
+/**
+ * @brief the warm pool of bus sockets kept by each raw-dbus event-loop.
+ *
+ * Sockets are connected on the libuv thread-pool into `fresh` and moved into
+ * `sockets` back on the event-loop, the loop itself never waits on a
+ * connect unless the pool has run dry.
+ */
+struct bus_pool {
+    const char *bus_path;
+    bool refilling;
+    bool closed;
+    int size;
+    int count;
+    int wanted;
+    int fresh_count;
+    struct bus_socket sockets[BUS_POOL_SIZE];
+    struct bus_socket fresh[BUS_POOL_SIZE];
+    uv_work_t work;
+    uv_timer_t timer;
+};
+
+/* src/pool.c */
+int bus_pool_share(int workers, int worker);
+
+void init_bus_pool(uv_loop_t *loop, struct bus_pool *pool,
+                   const char *bus_path, int size);
+
+int take_bus_socket(struct bus_pool *pool);
+
+void free_bus_pool(struct bus_pool *pool);
@@ -37,11 +37,16 @@
 
 
 uv_loop_t *rawdbus_loop;
+uv_poll_t xenstore_handle;
+uv_async_t *main_wakeup;
 bool reload_policy;
+bool report_stats;
+bool interrupted;
 
 
 /**
- * Queries xenstore about whether a domain is a stubdom or not.
+ * Queries xenstore about whether a domain is a stubdom or not.  The answer is
+ * kept in the domain cache until a domain is introduced or released.
  *
  * @param domid the domain id to make query on.
  * 
@@ -49,37 +54,7 @@ bool reload_policy;
  */
 bool is_stubdom(uint16_t domid)
 {
-    size_t len;
-    bool domain_is_stubdom;
-
-    len = 0;
-    domain_is_stubdom = false;
-     
-#ifdef HAVE_XENSTORE
-    struct xs_handle *xsh;
-    char *path;
-    void *ret;
-
-    xsh = xs_open(XS_OPEN_READONLY);
-
-    if (!xsh)
-        return -1;
-
-    path = xs_get_domain_path(xsh, domid);
-    path = realloc(path, strlen(path) + XENSTORE_TARGET_LEN);
-    strcat(path, XENSTORE_TARGET);
-
-    ret = xs_read(xsh, XBT_NULL, path, &len);
-
-    if (ret)
-       free(ret);
-
-    free(path);
-    xs_close(xsh);
-#endif
-    if (len > 0)
-        domain_is_stubdom = true;
-    return domain_is_stubdom;
+    return domain_cache_lookup(domid)->stubdom;
 }
 
 /**
@@ -120,44 +95,108 @@ int get_domid(int client)
 static void print_usage(void)
 {
     printf("rpc-broker <flag> <argument>\n");
+    printf("\t-a  [--backlog=N]                       ");
+    printf("Length of the raw-dbus queue of pending connections.\n");
     printf("\t-b  [--bus-name=BUS]                    ");
-    printf("A dbus bus name to make the connection to.\n");
+    printf("The dbus socket raw-dbus clients are connected to.\n");
+    printf("\t-c  [--lint]                            ");
+    printf("Reports invalid and shadowed rules of the policy file.\n");
     printf("\t-h  [--help]                            ");
     printf("Prints this usage description.\n");
     printf("\t-l  [--logging[=optional FILENAME]      ");
     printf("Enables logging to a default path, optionally set.\n");
+    printf("\t-n  [--workers=N]                       ");
+    printf("Runs raw-dbus on N event-loop threads (default 1).\n");
     printf("\t-p  [--policy-file=FILENAME]            ");
     printf("Provide a policy file to run against.\n");
     printf("\t-r  [--raw-dbus=PORT]                   ");
     printf("Sets rpc-broker to run on given port as raw DBus.\n");
+    printf("\t-s  [--policy-snapshot=FILENAME]        ");
+    printf("Saves the compiled policy for a warm start.\n");
     printf("\t-v  [--verbose]                         ");
     printf("Adds extra information (run with logging).\n");
     printf("\t-w  [--websockets=PORT]                 ");
     printf("Sets rpc-broker to run on given address/port as websockets.\n");
 }
 
+/*
+ * Breaks the main loop out of uv_run to look at the flags the signal
+ * handlers set, uv_async_send is safe to call from one.
+ */
+static void wake_main_loop(void)
+{
+    if (main_wakeup)
+        uv_async_send(main_wakeup);
+}
+
+/*
+ * Only stops the main loop, the workers and the policy builder are still
+ * using the policy.  They are stopped and joined once the main loop returns,
+ * then everything is free'd.
+ */
 static void sigint_handler(int signal)
 {
-    DBUS_BROKER_WARNING("<received signal interrupt> %s", "");
-    free_dlinks();
-    free_policy();
+    interrupted = true;
+    dbus_broker_running = 0;
+    wake_main_loop();
+}
 
-    if (ring)
-        lws_ring_destroy(ring);
+static void sighup_handler(int signal)
+{
+    reload_policy = true;
+    wake_main_loop();
+}
 
-    if (rawdbus_loop) {
-        uv_stop(rawdbus_loop);
-        uv_loop_close(rawdbus_loop);
-        free(rawdbus_loop);
-    }
+static void sigusr1_handler(int signal)
+{
+    report_stats = true;
+    wake_main_loop();
+}
 
-    exit(0);
+static void main_loop_wakeup(uv_async_t *handle)
+{
+    /* only breaks the main loop out of uv_run, the loop checks the flags */
 }
 
-static void sighup_handler(int signal)
+static void init_main_wakeup(uv_loop_t *loop, uv_async_t *handle)
 {
-    DBUS_BROKER_EVENT("Re-loading policy %s", "");
-    reload_policy = true;
+    uv_async_init(loop, handle, main_loop_wakeup);
+    main_wakeup = handle;
+}
+
+static void close_main_wakeup(uv_async_t *handle)
+{
+    main_wakeup = NULL;
+    uv_close((uv_handle_t *) handle, NULL);
+}
+
+/*
+ * Logs the request counters of the policy in place along with the verdict
+ * cache counters, used to size the cache.
+ */
+static void log_broker_stats(void)
+{
+    struct verdict_cache_stats stats;
+    struct policy *dbus_policy;
+
+    stats = verdict_cache_get_stats();
+
+    dbus_policy = acquire_policy();
+    if (dbus_policy)
+        DBUS_BROKER_EVENT("Policy generation %u: <%zu requests> "
+                          "<%zu allowed> <%zu denied>",
+                          dbus_policy->generation,
+                          dbus_policy->total_requests,
+                          dbus_policy->allowed_requests,
+                          dbus_policy->denied_requests);
+    release_policy();
+
+    DBUS_BROKER_EVENT("Verdict cache: <%zu hits> <%zu misses> "
+                      "<%zu uncacheable> <%zu evictions> [Size: %d]",
+                      stats.hits, stats.misses, stats.uncacheable,
+                      stats.evictions, VERDICT_CACHE_SIZE);
+
+    report_stats = false;
 }
 
 static void parse_server_signal(DBusMessage *msg)
@@ -165,30 +204,45 @@ static void parse_server_signal(DBusMessage *msg)
     char *str;
     int msgtype;
     int current_type;
+    const char *member;
     DBusMessageIter iter;
 
     msgtype = dbus_message_get_type(msg);
     if (msgtype == DBUS_MESSAGE_TYPE_ERROR)
         return;
 
+    member = dbus_message_get_member(msg);
+
     dbus_message_iter_init(msg, &iter);
     while ((current_type = dbus_message_iter_get_arg_type (&iter)) != DBUS_TYPE_INVALID) {
         if (current_type == DBUS_TYPE_STRING) {
             dbus_message_iter_get_basic(&iter, &str);
             if (verbose_logging)
                 DBUS_BROKER_EVENT("Xenmgr msg: (%s)", str); 
+            /*
+             * a state or config change only needs the vm's own rules and
+             * attributes re-read, the builder publishes a fresh domain
+             */
+            if (member && (!strcmp(member, XENMGR_STATE_MEMBER) ||
+                           !strcmp(member, XENMGR_CONFIG_MEMBER))) {
+                request_vm_reload(str);
+                return;
+            }
             reload_policy = true;
         } 
         dbus_message_iter_next (&iter);
     }
 }
 
-static void parse_client_signal(DBusMessage *msg, struct lws *wsi)
+/* converts a signal into the message sent to websocket subscribers */
+static struct ws_buffer *prepare_signal_reply(DBusMessage *msg)
 {
-    char *reply;
+    struct ws_buffer *buffer;
     struct json_response *jrsp;
+    struct json_arena *arena;
 
-    jrsp = init_jrsp();
+    arena = new_json_arena();
+    jrsp = init_jrsp(arena);
     jrsp->response_to[0] = '\0';
     snprintf(jrsp->type, JSON_REQ_ID_MAX - 1, "%s", JSON_SIG);
 
@@ -198,164 +252,217 @@ static void parse_client_signal(DBusMessage *msg, struct lws *wsi)
     jrsp->member = dbus_message_get_member(msg);
     jrsp->path = dbus_message_get_path(msg);
 
-    reply = prepare_json_reply(jrsp);
-
-    if (!reply)
-        goto free_jrsp;
-
-    lws_callback_on_writable(wsi);
-    lws_ring_insert(ring, reply, 1);
-    free(reply);
+    buffer = prepare_json_reply(jrsp);
+    free_json_arena(arena);
 
-free_jrsp:
-        free(jrsp);
+    return buffer;
 }
 
 /*
- * Cycle through linked-list of current dbus-signals being subscribed to.
- * If there are any signals queued up, start the exchange of communication.
+ * Fans a signal out to the sessions subscribed to any match rule it
+ * satisfies.  The signal is serialized once and every session queue shares
+ * the same buffer.
  */
-static void service_ws_signals(void)
+static void dispatch_ws_signal(DBusConnection *conn, DBusMessage *msg)
 {
-    bool remove_link;
-    struct dbus_link *curr;
-    DBusMessage *msg;
+    static uint32_t serial;
+    struct ws_match *match;
+    struct ws_subscriber *sub;
+    struct ws_buffer *buffer;
 
-    if (dlinks == NULL)
-        return;
+    /* sessions start out at 0 */
+    if (++serial == 0)
+        serial = 1;
 
-    curr = dlinks;
-    remove_link = false;
+    buffer = NULL;
 
-    struct timespec t;
-    //clock_gettime(CLOCK_REALTIME, &t);
-    //DBUS_BROKER_EVENT("WS Service Entry <%llu %llu>", t.tv_sec, t.tv_nsec);
+    for (match = ws_matches; match; match = match->next) {
+        if (match->conn != conn || !ws_match_accepts(match, msg))
+            continue;
 
-    do {
-        msg = NULL;
+        if (!buffer && (buffer = prepare_signal_reply(msg)) == NULL)
+            return;
 
-        if (!curr->dconn || !dbus_connection_get_is_connected(curr->dconn)) {
-//            remove_link = true;
-            goto next_link;
-        } 
-        /*
-        int connfd;
-        if (!dbus_connection_get_socket(curr->dconn, &connfd)) {
-            DBUS_BROKER_WARNING("Websocket Signal Connection Failed %s", "")
-            goto next_link;
-        }
-        // set the FD to O_NONBLOCK?
-        */
-        switch (dbus_connection_get_dispatch_status(curr->dconn)) {
+        for (sub = match->subscribers; sub; sub = sub->next)
+            ws_queue_signal(sub->wsi, buffer, serial);
+    }
 
-            case (DBUS_DISPATCH_DATA_REMAINS):
-                DBUS_BROKER_EVENT("Message in Queue%s", "");
-                break;
-            case (DBUS_DISPATCH_COMPLETE):
-                break;
-            case (DBUS_DISPATCH_NEED_MEMORY):
-                DBUS_BROKER_EVENT("Need Memory%s", "");
-                break;
-            default:
-                break;
-        }
+    if (buffer)
+        release_ws_buffer(buffer);
+}
 
-        dbus_connection_read_write(curr->dconn, 1);
-        msg = dbus_connection_pop_message(curr->dconn);
-        //DBUS_BROKER_EVENT("WS Signal <%d>", curr->client_fd);
-        if (!msg)
-            goto next_link;
-        
-        if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL)
-            goto unref_msg;
-        switch (curr->signal_type) {
-
-            case (DBUS_SIGNAL_TYPE_SERVER):
-                parse_server_signal(msg);
-                break;
+/*
+ * Filter on the websockets bus connection, signals go to the broker itself
+ * and to the websocket subscribers.  Replies to pending calls are completed
+ * by libdbus before any filter sees them.
+ */
+static DBusHandlerResult filter_ws_signals(DBusConnection *conn,
+                                           DBusMessage *msg, void *data)
+{
+    struct dbus_link *curr;
+    const char *name, *old_owner, *new_owner;
 
-            case (DBUS_SIGNAL_TYPE_CLIENT): {
-                parse_client_signal(msg, curr->wsi);
-                clock_gettime(CLOCK_REALTIME, &t);
-            }
-                break;
+    if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
-            default:
-                if (verbose_logging)
-                    DBUS_BROKER_WARNING("Unknown dbus-signal type %s", "");
-                break;
-        }
+    /*
+     * A new owner may export different methods, introspect it again, and
+     * subscriptions to the name follow it to its new owner.
+     */
+    if (dbus_message_is_signal(msg, DBUS_INTERFACE_DBUS, DBUS_NAME_OWNER_MEMBER) &&
+        dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_STRING, &old_owner,
+                              DBUS_TYPE_STRING, &new_owner,
+                              DBUS_TYPE_INVALID)) {
+        invalidate_signature_cache(name);
+        update_ws_name_owner(name, new_owner);
+    }
 
-unref_msg:
-        dbus_message_unref(msg);
+    curr = dlinks;
+
+    while (curr) {
+        if (curr->dconn == conn && curr->signal_type == DBUS_SIGNAL_TYPE_SERVER &&
+            (dbus_signal_matches(msg, XENMGR_SIGNAL_SERVICE) ||
+             dbus_signal_matches(msg, XENMGR_CONFIG_SIGNAL)))
+            parse_server_signal(msg);
 
-next_link:
         curr = curr->next;
+        if (curr == dlinks)
+            break;
+    }
 
-        if (remove_link) {
-            remove_dlink(curr->prev);
-            remove_link = false;
-            signal_subscribers--;
-            DBUS_BROKER_EVENT("WS rm signal: <%zd>", signal_subscribers);
-        }
+    dispatch_ws_signal(conn, msg);
 
-    } while (curr && curr != dlinks);
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
 
-    //clock_gettime(CLOCK_REALTIME, &t);
-    //DBUS_BROKER_EVENT("WS Service Exit <%llu %llu>", t.tv_sec, t.tv_nsec);
+static void xenstore_watch(uv_poll_t *handle, int status, int events)
+{
+    if (events & UV_READABLE)
+        service_xenstore_watches();
+}
+
+static void init_xenstore_watch(uv_loop_t *loop)
+{
+    int fd;
+
+    fd = init_xenstore_cache();
+    if (fd < 0)
+        return;
+
+    uv_poll_init(loop, &xenstore_handle, fd);
+    uv_poll_start(&xenstore_handle, UV_READABLE, xenstore_watch);
+}
+
+/* wakes the loop up so the reload and stats flags get looked at */
+static void ws_loop_tick(uv_timer_t *handle)
+{
 }
 
 static void run_websockets(struct dbus_broker_args *args)
 {
     struct lws_context *ws_context;
     struct dbus_link *xenmgr_signal;
+    uv_loop_t ws_loop;
+    uv_timer_t tick;
+    uv_async_t wakeup;
+
+    uv_loop_init(&ws_loop);
 
     ws_context = NULL;
     signal_subscribers = 0;
-    if ((ws_context = create_ws_context(args->port)) == NULL)
+    if ((ws_context = create_ws_context(&ws_loop, args->port)) == NULL)
         DBUS_BROKER_ERROR("WebSockets-Server");
 
     xenmgr_signal = add_dbus_signal();
     xenmgr_signal->dconn = create_dbus_connection();
     dbus_bus_add_match(xenmgr_signal->dconn, XENMGR_SIGNAL_SERVICE, NULL); 
+    dbus_bus_add_match(xenmgr_signal->dconn, XENMGR_CONFIG_SIGNAL, NULL);
+    dbus_bus_add_match(xenmgr_signal->dconn, DBUS_NAME_OWNER_SIGNAL, NULL);
     xenmgr_signal->signal_type = DBUS_SIGNAL_TYPE_SERVER;
+
+    /*
+     * json requests share this connection (see `create_dbus_connection`),
+     * replies and signals are dispatched from the loop as they arrive.
+     */
+    if (!dbus_connection_add_filter(xenmgr_signal->dconn, filter_ws_signals,
+                                    NULL, NULL))
+        DBUS_BROKER_ERROR("Malloc Failed!");
+    watch_dbus_connection(&ws_loop, xenmgr_signal->dconn);
+    ws_requests_in_flight = 0;
+
     DBUS_BROKER_EVENT("Websockets building policy...%s", "");
 
-    dbus_broker_policy = build_policy(args->rule_file);
+    publish_policy(build_startup_policy(args->rule_file, args->snapshot_file));
+    start_policy_builder(args->rule_file, args->snapshot_file);
+    init_xenstore_watch(&ws_loop);
+
+    uv_timer_init(&ws_loop, &tick);
+    uv_timer_start(&tick, ws_loop_tick, WS_LOOP_TIMEOUT, WS_LOOP_TIMEOUT);
+    init_main_wakeup(&ws_loop, &wakeup);
+
     DBUS_BROKER_EVENT("<WebSockets-Server has started listening> [Port: %d]",
                         args->port);
 
     while (dbus_broker_running) {
 
         if (reload_policy) {
-            free_policy();
-            dbus_broker_policy = build_policy(args->rule_file);
+            DBUS_BROKER_EVENT("Re-loading policy %s", "");
+            request_policy_rebuild();
             reload_policy = false;
         }
 
-        lws_service(ws_context, WS_LOOP_TIMEOUT);
-        service_ws_signals();
+        if (report_stats)
+            log_broker_stats();
+
+#ifdef LWS_WITH_LIBUV
+        uv_run(&ws_loop, UV_RUN_ONCE);
+#else
+        lws_service(ws_context, ws_requests_in_flight ? WS_DBUS_TIMEOUT
+                                                      : WS_LOOP_TIMEOUT);
+        uv_run(&ws_loop, UV_RUN_NOWAIT);
+#endif
     }
 
-    if (ring)
-        lws_ring_destroy(ring);
+    uv_timer_stop(&tick);
+    close_main_wakeup(&wakeup);
 
     if (ws_context)
         lws_context_destroy(ws_context);
+
+    /* let lws close its handles */
+    uv_run(&ws_loop, UV_RUN_NOWAIT);
+    uv_loop_close(&ws_loop);
 }
 
-static void close_client_rawdbus(uv_handle_t *handle)
+static void close_rawdbus_conn(uv_handle_t *handle)
 {
     struct raw_dbus_conn *conn;
+    struct raw_dbus_session *session;
 
     conn = (struct raw_dbus_conn *) handle->data;
+    session = conn->session;
+
     close(conn->receiver);
-    uv_unref(handle);
+    free_framer(&conn->framer);
+    free_output(&conn->output);
 
-    if (conn)
-        free(conn);
+    if (conn->pending)
+        free(conn->pending);
 
-    conn = NULL;
+    /* both endpoints live in the session, free it once they're closed */
+    if (++session->closed == 2)
+        free(session);
+}
+
+static void close_rawdbus_session(struct raw_dbus_session *session)
+{
+    if (session->closing)
+        return;
+
+    session->closing = true;
+    uv_close((uv_handle_t *) &session->client.handle, close_rawdbus_conn);
+    uv_close((uv_handle_t *) &session->server.handle, close_rawdbus_conn);
 }
 
 static void close_server_rawdbus(uv_handle_t *handle)
@@ -363,44 +470,125 @@ static void close_server_rawdbus(uv_handle_t *handle)
     struct dbus_broker_server *server;
     server = (struct dbus_broker_server *) handle->data;
     close(server->dbus_socket);
+    free_bus_pool(&server->pool);
     uv_unref(handle);
 }
 
+static void service_rdconn_cb(uv_poll_t *handle, int status, int events);
+
+/*
+ * Polls a connection's socket for what it's currently able to do.  Reading is
+ * paused while the peer's output is above the high watermark and resumes
+ * once it drains below the low watermark.  Writing is only polled while
+ * output is queued.
+ */
+static void update_rawdbus_events(struct raw_dbus_conn *conn)
+{
+    size_t pending;
+    int events;
+
+    pending = OUTPUT_PENDING(&conn->peer->output);
+
+    if (pending >= RAW_DBUS_HIGH_WATERMARK)
+        conn->paused = true;
+    else if (pending <= RAW_DBUS_LOW_WATERMARK)
+        conn->paused = false;
+
+    events = 0;
+    if (!conn->eof && !conn->paused)
+        events |= UV_READABLE | UV_DISCONNECT;
+    if (OUTPUT_PENDING(&conn->output) > 0)
+        events |= UV_WRITABLE;
+
+    if (events == conn->events)
+        return;
+
+    conn->events = events;
+    if (events)
+        uv_poll_start(&conn->handle, events, service_rdconn_cb);
+    else
+        uv_poll_stop(&conn->handle);
+}
+
+/*
+ * Once either end has closed, the session is finished as soon as everything
+ * it sent has been written to the other end.
+ */
+static bool rawdbus_session_done(struct raw_dbus_session *session)
+{
+    if (session->client.eof && !OUTPUT_PENDING(&session->server.output))
+        return true;
+
+    if (session->server.eof && !OUTPUT_PENDING(&session->client.output))
+        return true;
+
+    return false;
+}
+
 static void service_rdconn_cb(uv_poll_t *handle, int status, int events)
 {
-    int ret, total;
     struct raw_dbus_conn *conn;
+    struct raw_dbus_session *session;
 
     conn = (struct raw_dbus_conn *) handle->data;
-    ret = 0;
-    total = 0;
+    session = conn->session;
 
-    if (events & UV_READABLE) {
-        while ((ret = exchange(conn->receiver, conn->sender, 
-                               conn->client_domain, conn->is_client)) != 0) 
-            total += ret;
-        if (total <= 0)
-            uv_close((uv_handle_t *) handle, close_client_rawdbus);
-    }
+    if (status < 0)
+        goto close_session;
+
+    if (events & UV_WRITABLE && flush_output(conn) < 0)
+        goto close_session;
+
+    if (events & (UV_READABLE | UV_DISCONNECT) && exchange(conn) < 0)
+        goto close_session;
+
+    if (rawdbus_session_done(session))
+        goto close_session;
+
+    update_rawdbus_events(&session->client);
+    update_rawdbus_events(&session->server);
+    return;
+
+close_session:
+    close_rawdbus_session(session);
 }
 
-static void init_rawdbus_conn(uv_loop_t *rawdbus_loop, int sender,
+static void init_rawdbus_conn(uv_loop_t *rawdbus_loop,
+                              struct raw_dbus_session *session,
+                              struct raw_dbus_conn *conn,
+                              struct raw_dbus_conn *peer, int sender,
                               int receiver, int domain, bool is_client)
 {
-    struct raw_dbus_conn *conn;
-
-    conn = malloc(sizeof *conn);
-    if (!conn)
-        DBUS_BROKER_ERROR("Malloc Failed!");
-
     conn->sender = sender;
     conn->receiver = receiver;
     conn->client_domain = domain;
     conn->is_client = is_client;
+    conn->framer.state = DBUS_FRAMER_AUTH;
+    conn->peer = peer;
+    conn->session = session;
+    conn->events = UV_READABLE | UV_DISCONNECT;
     conn->handle.data = conn;
+
+    /* a slow peer must never stall the event-loop */
+    fcntl(receiver, F_SETFL, fcntl(receiver, F_GETFL) | O_NONBLOCK);
+
     uv_poll_init(rawdbus_loop, &conn->handle, conn->receiver);
-    uv_poll_start(&conn->handle, UV_READABLE | UV_DISCONNECT,
-                   service_rdconn_cb);
+    uv_poll_start(&conn->handle, conn->events, service_rdconn_cb);
+}
+
+static void init_rawdbus_session(uv_loop_t *rawdbus_loop, int client,
+                                 int server, int domain)
+{
+    struct raw_dbus_session *session;
+
+    session = calloc(1, sizeof *session);
+    if (!session)
+        DBUS_BROKER_ERROR("Calloc Failed!");
+
+    init_rawdbus_conn(rawdbus_loop, session, &session->client,
+                      &session->server, server, client, domain, true);
+    init_rawdbus_conn(rawdbus_loop, session, &session->server,
+                      &session->client, client, server, domain, false);
 }
 
 static void close_xenmgr_signal(uv_handle_t *handle)
@@ -413,22 +601,27 @@ static void close_xenmgr_signal(uv_handle_t *handle)
 static void xenmgr_signal(uv_poll_t *handle, int status, int events)
 {
     struct xenmgr_signal *xensig = (struct xenmgr_signal *) handle->data;
-    DBusMessage *msg = dbus_connection_pop_message(xensig->conn);
+    DBusMessage *msg;
 
-    if (!msg) {
+    if (events & UV_DISCONNECT ||
+        !dbus_connection_read_write(xensig->conn, 0)) {
         uv_close((uv_handle_t *) handle, close_xenmgr_signal);
         return;
     }
 
-    parse_server_signal(msg);
+    while ((msg = dbus_connection_pop_message(xensig->conn)) != NULL) {
+        if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_SIGNAL)
+            parse_server_signal(msg);
+        dbus_message_unref(msg);
+    }
 }
 
 static void init_xenmgr_signal(uv_loop_t *loop)
 {
     struct xenmgr_signal *xensig = calloc(1, sizeof *xensig);
-    char *crt = "type='signal',interface='com.citrix.xenclient.xenmgr',member='vm_state_changed'";
     xensig->conn = create_dbus_connection(); 
-    dbus_bus_add_match(xensig->conn, crt, NULL); 
+    dbus_bus_add_match(xensig->conn, XENMGR_SIGNAL_SERVICE, NULL); 
+    dbus_bus_add_match(xensig->conn, XENMGR_CONFIG_SIGNAL, NULL);
 
     if (!dbus_connection_get_socket(xensig->conn, &xensig->signal_fd))
         DBUS_BROKER_WARNING("Xenmgr Signal Subscription Failed! %s", "");
@@ -444,33 +637,149 @@ static void service_rawdbus_server(uv_poll_t *handle, int status, int events)
 {
     struct dbus_broker_server *dbus_server;
     uv_loop_t *loop;
-    int client, server, domain;
+    int client, server, domain, i;
 
     dbus_server = (struct dbus_broker_server *) handle->data;
     loop = dbus_server->mainloop;
     if (events & UV_READABLE) {
-	        socklen_t clilen = sizeof(dbus_server->peer);
-	        client = accept(dbus_server->dbus_socket,
-                           (struct sockaddr *) &dbus_server->peer, &clilen);
-            server = connect_to_system_bus();
+        /* take what's pending, bounded so running sessions get serviced */
+        for (i=0; i < RAW_DBUS_ACCEPT_BATCH; i++) {
+            socklen_t clilen = sizeof(dbus_server->peer);
+            client = accept(dbus_server->dbus_socket,
+                            (struct sockaddr *) &dbus_server->peer, &clilen);
+            if (client < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    DBUS_BROKER_WARNING("accept failed <%s>",
+                                        strerror(errno));
+                break;
+            }
+
+            server = take_bus_socket(&dbus_server->pool);
+            if (server < 0) {
+                close(client);
+                continue;
+            }
+
             domain = get_domid(client);
-            init_rawdbus_conn(loop, server, client, domain, true);
-            init_rawdbus_conn(loop, client, server, domain, false);
+            init_rawdbus_session(loop, client, server, domain);
+        }
     } else if (events & UV_DISCONNECT) {
         dbus_broker_running = 0;
         uv_close((uv_handle_t *) handle, close_server_rawdbus);
     }
 }
 
-static void run_rawdbus(struct dbus_broker_args *args)
+/*
+ * Opens the listening socket of a raw-dbus event-loop.  Every worker binds its
+ * own socket to the port (SO_REUSEPORT) and the kernel spreads incoming
+ * connections across them.
+ */
+static void init_rawdbus_server(uv_loop_t *loop,
+                                struct dbus_broker_server *server,
+                                struct dbus_broker_args *args, int worker)
 {
-    struct dbus_broker_server server;
-    if (start_server(&server, args->port) < 0)
+    if (start_server(server, args->port, args->backlog) < 0)
         DBUS_BROKER_ERROR("DBus server failed to start!");
 
-    DBUS_BROKER_EVENT("<Server has started listening> [Port: %d]", args->port);
+    server->mainloop = loop;
+    server->port = args->port;
+    server->handle.data = server;
+
+    init_bus_pool(loop, &server->pool, args->bus_name,
+                  bus_pool_share(args->workers, worker));
+
+    uv_poll_init(loop, &server->handle, server->dbus_socket);
+    uv_poll_start(&server->handle, UV_READABLE | UV_DISCONNECT,
+                   service_rawdbus_server);
+}
+
+static void wakeup_rawdbus_worker(uv_async_t *handle)
+{
+    /* only breaks the worker out of uv_run to check if it's still running */
+}
+
+static void *run_rawdbus_worker(void *data)
+{
+    struct rawdbus_worker *worker;
 
-    dbus_broker_policy = build_policy(args->rule_file);
+    worker = (struct rawdbus_worker *) data;
+
+    uv_loop_init(&worker->loop);
+    uv_async_init(&worker->loop, &worker->wakeup, wakeup_rawdbus_worker);
+    init_rawdbus_server(&worker->loop, &worker->server, worker->args,
+                        worker->index);
+
+    while (dbus_broker_running)
+        uv_run(&worker->loop, UV_RUN_ONCE);
+
+    free_bus_pool(&worker->server.pool);
+    uv_run(&worker->loop, UV_RUN_NOWAIT);
+    free_verdict_cache();
+    free_domain_cache();
+
+    uv_stop(&worker->loop);
+    uv_loop_close(&worker->loop);
+
+    return NULL;
+}
+
+/*
+ * Starts the worker threads running alongside the main raw-dbus loop.  The
+ * workers block every signal, signals are left to the main loop which owns
+ * policy reloads and the xenmgr/xenstore watches.
+ */
+static struct rawdbus_worker *start_rawdbus_workers(struct dbus_broker_args *args,
+                                                    int count)
+{
+    struct rawdbus_worker *workers;
+    sigset_t mask, old_mask;
+    int i;
+
+    if (count == 0)
+        return NULL;
+
+    workers = calloc(count, sizeof *workers);
+    if (!workers)
+        DBUS_BROKER_ERROR("Calloc Failed!");
+
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    for (i=0; i < count; i++) {
+        workers[i].args = args;
+        workers[i].index = i + 1;
+        if (pthread_create(&workers[i].thread, NULL, run_rawdbus_worker,
+                           &workers[i]) != 0)
+            DBUS_BROKER_ERROR("pthread_create");
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    return workers;
+}
+
+static void stop_rawdbus_workers(struct rawdbus_worker *workers, int count)
+{
+    int i;
+
+    for (i=0; i < count; i++)
+        uv_async_send(&workers[i].wakeup);
+
+    for (i=0; i < count; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    if (workers)
+        free(workers);
+}
+
+static void run_rawdbus(struct dbus_broker_args *args)
+{
+    struct dbus_broker_server server;
+    struct rawdbus_worker *workers;
+    uv_async_t wakeup;
+
+    publish_policy(build_startup_policy(args->rule_file, args->snapshot_file));
+    start_policy_builder(args->rule_file, args->snapshot_file);
 
     rawdbus_loop = malloc(sizeof *rawdbus_loop);
     if (!rawdbus_loop)
@@ -478,24 +787,35 @@ static void run_rawdbus(struct dbus_broker_args *args)
 
     uv_loop_init(rawdbus_loop);
 
-    uv_poll_init(rawdbus_loop, &server.handle, server.dbus_socket);
-    uv_poll_start(&server.handle, UV_READABLE | UV_DISCONNECT,
-                   service_rawdbus_server);
-
-    server.mainloop = rawdbus_loop;
-    server.port = args->port;
-    server.handle.data = &server;
+    init_rawdbus_server(rawdbus_loop, &server, args, 0);
     init_xenmgr_signal(rawdbus_loop);
+    init_xenstore_watch(rawdbus_loop);
+    init_main_wakeup(rawdbus_loop, &wakeup);
+
+    /* the main loop counts as the first worker */
+    workers = start_rawdbus_workers(args, args->workers - 1);
+
+    DBUS_BROKER_EVENT("<Server has started listening> [Port: %d] "
+                      "[Workers: %d] [Backlog: %d]", args->port,
+                      args->workers, args->backlog);
 
     while (dbus_broker_running) {
         uv_run(rawdbus_loop, UV_RUN_ONCE);
         if (reload_policy) {
-            free_policy();
-            dbus_broker_policy = build_policy(args->rule_file);
+            DBUS_BROKER_EVENT("Re-loading policy %s", "");
+            request_policy_rebuild();
             reload_policy = false;
         }
+
+        if (report_stats)
+            log_broker_stats();
     }
 
+    close_main_wakeup(&wakeup);
+    stop_rawdbus_workers(workers, args->workers - 1);
+    free_bus_pool(&server.pool);
+    uv_run(rawdbus_loop, UV_RUN_NOWAIT);
+
     uv_stop(rawdbus_loop);
     uv_loop_close(rawdbus_loop);
     free(rawdbus_loop);
@@ -503,55 +823,80 @@ static void run_rawdbus(struct dbus_broker_args *args)
 
 int main(int argc, char *argv[])
 {
-    const char *dbus_broker_opt_str = "b:hl::p:r:vw:";
+    const char *dbus_broker_opt_str = "a:b:chl::n:p:r:s:vw:";
 
     struct option dbus_broker_opts[] = {
-        { "bus-name",    required_argument,   0, 'b' },
-        { "help",        no_argument,         0, 'h' },
-        { "logging",     optional_argument,   0, 'l' },
-        { "policy-file", required_argument,   0, 'p' },
-        { "raw-dbus",    required_argument,   0, 'r' },
-        { "verbose",     no_argument,         0, 'v' },
-        { "websockets",  required_argument,   0, 'w' },
-        {  0,            0,        0,         0      }
+        { "backlog",         required_argument, 0, 'a' },
+        { "bus-name",        required_argument, 0, 'b' },
+        { "lint",            no_argument,       0, 'c' },
+        { "help",            no_argument,       0, 'h' },
+        { "logging",         optional_argument, 0, 'l' },
+        { "workers",         required_argument, 0, 'n' },
+        { "policy-file",     required_argument, 0, 'p' },
+        { "raw-dbus",        required_argument, 0, 'r' },
+        { "policy-snapshot", required_argument, 0, 's' },
+        { "verbose",         no_argument,       0, 'v' },
+        { "websockets",      required_argument, 0, 'w' },
+        {  0,                0,                 0,  0  }
     };
 
     int opt, option_index;
     void (*mainloop)(struct dbus_broker_args *args);
 
     char *websockets, *raw_dbus;
-    char *logging_file, *bus_file, *policy_file;
+    char *logging_file, *bus_file, *policy_file, *snapshot_file;
     uint32_t port;
-    bool proto, logging;
+    int workers, backlog, findings;
+    bool proto, logging, lint;
 
     logging = false;
+    lint = false;
     verbose_logging = false;
 
-    bus_file = NULL;
+    bus_file = DBUS_BUS_ADDR;
     raw_dbus = NULL;
     websockets = NULL;
     logging_file = "";
     policy_file  = RULES_FILENAME;
+    snapshot_file = NULL;
 
     proto = false;
+    workers = 1;
+    backlog = RAW_DBUS_DEFAULT_BACKLOG;
 
-    dbus_broker_opt_str = "b:hl::p:r:vw:";
+    dbus_broker_opt_str = "a:b:chl::n:p:r:s:vw:";
 
     while ((opt = getopt_long(argc, argv, dbus_broker_opt_str,
                               dbus_broker_opts, &option_index)) != -1) {
 
         switch (opt) {
 
+            case ('a'):
+                backlog = strtol(optarg, NULL, 0);
+                if (backlog < 1)
+                    goto usage_error;
+                break;
+
             case ('b'):
                 bus_file = optarg;
                 break;
 
+            case ('c'):
+                lint = true;
+                break;
+
             case ('l'):
                 logging = true;
                 if (optarg)
                     logging_file = optarg;
                 break;
 
+            case ('n'):
+                workers = strtol(optarg, NULL, 0);
+                if (workers < 1 || workers > RAW_DBUS_MAX_WORKERS)
+                    goto usage_error;
+                break;
+
             case ('p'):
                 policy_file = optarg;
                 break;
@@ -563,6 +908,10 @@ int main(int argc, char *argv[])
                 proto = true;
                 break;
 
+            case ('s'):
+                snapshot_file = optarg;
+                break;
+
             case ('v'):
                 verbose_logging = true;
                 break;
@@ -582,6 +931,13 @@ int main(int argc, char *argv[])
         }
     }
 
+    /* checks the policy file and exits, nothing is started */
+    if (lint) {
+        findings = lint_policy_file(policy_file);
+        free_symbol_table();
+        exit(findings < 0 ? 2 : findings > 0);
+    }
+
     errno = 0;
     if (raw_dbus) {
         port = strtol(raw_dbus, NULL, 0);
@@ -602,7 +958,10 @@ int main(int argc, char *argv[])
         .bus_name=bus_file,
         .logging_file=logging_file,
         .rule_file=policy_file,
+        .snapshot_file=snapshot_file,
         .port=port,
+        .workers=workers,
+        .backlog=backlog,
     };
 
     struct sigaction sa_sigint = { .sa_handler=sigint_handler };
@@ -615,17 +974,36 @@ int main(int argc, char *argv[])
     if (sigaction(SIGHUP, &sa_sighup, NULL) < 0)
         DBUS_BROKER_ERROR("sigaction");
 
+    struct sigaction sa_sigusr1 = { .sa_handler=sigusr1_handler };
+
+    if (sigaction(SIGUSR1, &sa_sigusr1, NULL) < 0)
+        DBUS_BROKER_ERROR("sigaction");
+
     dbus_broker_running = 1;
     dlinks = NULL;
     rawdbus_loop = NULL;
-    ring = NULL;
+    main_wakeup = NULL;
+    interrupted = false;
     reload_policy = false;
-    CACHE_INIT(domain_uuids, UUID_CACHE_LIMIT);
+    report_stats = false;
+
+    /* workers and the policy builder share the system bus connection */
+    if (!dbus_threads_init_default())
+        DBUS_BROKER_ERROR("dbus_threads_init_default");
+
     mainloop(&args);
 
+    if (interrupted)
+        DBUS_BROKER_WARNING("<received signal interrupt> %s", "");
+
+    stop_policy_builder();
     free_policy();
     free_dlinks();
-    free_uuids();
+    free_ws_matches();
+    free_verdict_cache();
+    free_signature_cache();
+    free_xenstore_cache();
+    free_symbol_table();
 
     return 0;
 
@@ -634,6 +1012,14 @@ conn_type_error:
     printf("Must supply at least one (and no more than one) connection type.\n");
     print_usage();
 
+    return 0;
+
+usage_error:
+
+    printf("Workers must be between 1 and %d, the backlog at least 1.\n",
+           RAW_DBUS_MAX_WORKERS);
+    print_usage();
+
     return 0;
 }
 
@@ -30,7 +30,10 @@
 #include <ctype.h>
 #include <dbus/dbus.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -38,10 +41,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <uv.h>
 
 #ifdef HAVE_XENSTORE
@@ -50,7 +55,10 @@
 
 #include "rpc-dbus.h"
 #include "rpc-json.h"
+#include "symbol.h"
 #include "policy.h"
+#include "cache.h"
+#include "pool.h"
 #include "signature.h"
 #include "websockets.h"
 
@@ -87,15 +95,6 @@
 #define BROKER_DEFAULT_PORT 5555
 #define BROKER_UI_PORT      8080
 
-#define UUID_CACHE_LIMIT 1024
-
-#define CACHE_INIT(cache, limit)        \
-({                                      \
-    int i;                              \
-    for (i=0; i < limit; i++)           \
-        cache[i] = NULL;                \
-})                                      \
-
 /**
  * @brief object that holds the main dbus server connection state.
  */
@@ -106,11 +105,28 @@ struct dbus_broker_server {
     struct sockaddr_in peer;
     uv_loop_t *mainloop;
     uv_poll_t handle;
+    struct bus_pool pool;
+};
+
+#define RAW_DBUS_DEFAULT_BACKLOG 128
+#define RAW_DBUS_ACCEPT_BATCH    32
+#define RAW_DBUS_MAX_WORKERS     64
+
+/**
+ * @brief a raw-dbus worker thread.  Each worker listens on its own socket
+ * bound to the same port and runs its own event-loop, the policy is shared.
+ */
+struct rawdbus_worker {
+    pthread_t thread;
+    int index;
+    uv_loop_t loop;
+    uv_async_t wakeup;
+    struct dbus_broker_server server;
+    struct dbus_broker_args *args;
 };
 
 bool verbose_logging;
 int dbus_broker_running;
-char *domain_uuids[UUID_CACHE_LIMIT];
 
 /**
  * @brief contains the command line arguments passed upon invocation.
@@ -119,23 +135,113 @@ struct dbus_broker_args {
     bool logging;
     bool verbose;
     int port;
+    int workers;
+    int backlog;
     const char *bus_name;
     const char *logging_file;
     const char *rule_file;
+    const char *snapshot_file;
 };
 
+#define DBUS_FRAMER_AUTH     0  /* SASL authentication lines */
+#define DBUS_FRAMER_MESSAGES 1  /* binary dbus messages */
+
+#define DBUS_AUTH_LINE_MAX 16384
+#define DBUS_AUTH_BEGIN    "BEGIN"
+
 /**
- * @brief object that's created upon each request made to connect to the actaul
- * dbus.   
+ * @brief incremental framing state for one direction of a raw-dbus
+ * connection.
+ *
+ * Bytes are received straight into `buf`, every complete authentication line
+ * or dbus message is handled in place and any partial frame is kept at the
+ * front of the buffer until the rest of it arrives.
+ */
+struct dbus_framer {
+    int state;
+    bool nul_seen;
+    size_t len;
+    size_t size;
+    char *buf;
+};
+
+/* raw-dbus flow control, in bytes */
+#define RAW_DBUS_READ_BUDGET    (DBUS_MSG_LEN * 8)
+#define RAW_DBUS_HIGH_WATERMARK (DBUS_MSG_LEN * 32)
+#define RAW_DBUS_LOW_WATERMARK  (DBUS_MSG_LEN * 8)
+
+/**
+ * @brief bytes waiting to be written to a non-blocking socket.  Everything
+ * before `sent` has already been written.
+ */
+struct dbus_output {
+    size_t sent;
+    size_t len;
+    size_t size;
+    char *buf;
+};
+
+#define OUTPUT_PENDING(output) ((output)->len - (output)->sent)
+
+#define RAW_DBUS_PENDING_MAX   512   /* unanswered calls tracked per client */
+#define RAW_DBUS_PENDING_SLOTS 1024  /* must be a power of two, at least */
+                                     /* twice RAW_DBUS_PENDING_MAX */
+
+/**
+ * @brief serials of the method calls a client sent that still await a reply.
+ *
+ * `slots` is an open addressed set of the serials (0 is never a valid
+ * serial), `order` is a ring of them in the order sent.  Should a client
+ * leave more than RAW_DBUS_PENDING_MAX calls unanswered the oldest is dropped,
+ * its reply is then rejected as unsolicited.
+ */
+struct dbus_serials {
+    size_t head;
+    size_t count;
+    uint32_t order[RAW_DBUS_PENDING_MAX];
+    uint32_t slots[RAW_DBUS_PENDING_SLOTS];
+};
+
+struct raw_dbus_session;
+
+/**
+ * @brief one endpoint of a raw-dbus session, either the guest's socket or the
+ * socket opened on the actual dbus.
+ *
+ * Data read from `receiver` is framed, filtered and queued on the peer's
+ * `output`, which is written to `sender` (the peer's receiving socket) as it
+ * becomes writable.  Reading stops while the peer's output is above the high
+ * watermark and resumes once it drains below the low watermark.  The client
+ * endpoint tracks the calls it let through in `pending`, allocated on the
+ * first one.
  */
 struct raw_dbus_conn {
     int receiver;
     int sender;
     bool is_client;
+    bool eof;
+    bool paused;
+    int events;
     uint32_t client_domain;
+    struct dbus_framer framer;
+    struct dbus_output output;
+    struct dbus_serials *pending;
+    struct raw_dbus_conn *peer;
+    struct raw_dbus_session *session;
     uv_poll_t handle;
 };
 
+/**
+ * @brief object that's created upon each request made to connect to the actaul
+ * dbus, pairing the guest's connection with the one made on the bus.
+ */
+struct raw_dbus_session {
+    bool closing;
+    int closed;
+    struct raw_dbus_conn client;
+    struct raw_dbus_conn server;
+};
+
 /**
  * @brief object to encapsulate data thats used to track xenmgr service signals
  */
@@ -150,9 +256,13 @@ bool is_stubdom(uint16_t domid);
 
 int get_domid(int client);
 
-void free_uuids(void);
-
 /* src/msg.c */
 bool is_request_allowed(struct dbus_message *dmsg, bool is_client, int domid);
 
-int exchange(int rsock, int ssock, uint16_t domid, bool is_client);
+int exchange(struct raw_dbus_conn *conn);
+
+int flush_output(struct raw_dbus_conn *conn);
+
+void free_framer(struct dbus_framer *framer);
+
+void free_output(struct dbus_output *output);
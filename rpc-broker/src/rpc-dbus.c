@@ -46,21 +46,59 @@ DBusConnection *create_dbus_connection(void)
 }
 
 /**
- * Initializes a dbus server connection on a given port. 
+ * Makes a dbus connection on the bus that isn't shared with anything else,
+ * for use off the event-loops.
+ *
+ * @return the connection or NULL.
+ */
+DBusConnection *create_private_dbus_connection(void)
+{
+    DBusError error;
+    DBusConnection *conn;
+
+    dbus_error_init(&error);
+    conn = dbus_bus_get_private(DBUS_BUS_SYSTEM, &error);
+
+    if (dbus_error_is_set(&error)) {
+        DBUS_BROKER_WARNING("<DBus Connection Error> [%s]", error.message);
+        dbus_error_free(&error);
+    }
+
+    if (conn)
+        dbus_connection_set_exit_on_disconnect(conn, FALSE);
+
+    return conn;
+}
+
+/**
+ * Closes a connection made by `create_private_dbus_connection`.
+ *
+ * @param conn the private connection.
+ */
+void close_private_dbus_connection(DBusConnection *conn)
+{
+    dbus_connection_close(conn);
+    dbus_connection_unref(conn);
+}
+
+/**
+ * Initializes a dbus server connection on a given port.  The listening socket
+ * is non-blocking so pending connections can be accepted in batches.
  *
  * @param server the server object being initialized.
  * @param port the port being bound to.
+ * @param backlog the length of the queue of pending connections.
  *
  * @return 0 on success error code otherwise. 
  */
-int start_server(struct dbus_broker_server *server, int port)
+int start_server(struct dbus_broker_server *server, int port, int backlog)
 {
     int ret;
     int optval;
 
     memset(&server->peer, 0, sizeof(server->peer));
 
-    ret = socket(AF_INET, SOCK_STREAM, 0);
+    ret = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (ret < 0) {
         DBUS_BROKER_WARNING("socket: %s", strerror(errno));
         goto done;
@@ -85,7 +123,7 @@ int start_server(struct dbus_broker_server *server, int port)
         goto done;
     }
 
-    ret = listen(server->dbus_socket, 1);
+    ret = listen(server->dbus_socket, backlog);
     if (ret < 0) 
         DBUS_BROKER_WARNING("listen: %s", strerror(errno));
 
@@ -112,22 +150,39 @@ void dbus_default(struct dbus_message *dmsg, char *member, void *arg)
 
 /**
  * Makes a connection directly to the main running dbus server.
+ *
+ * @param bus_path the path of the bus socket, DBUS_BUS_ADDR if NULL.
+ *
+ * @return the connected socket, -1 on failure.
  */
-int connect_to_system_bus(void)
+int connect_to_system_bus(const char *bus_path)
 {
     int srv;
     struct sockaddr_un addr;
 
+    if (!bus_path)
+        bus_path = DBUS_BUS_ADDR;
+
+    if (strlen(bus_path) >= sizeof(addr.sun_path)) {
+        DBUS_BROKER_WARNING("Bus path too long <%s>", bus_path);
+        return -1;
+    }
+
     srv = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (srv < 0)
-        DBUS_BROKER_ERROR("socket");
+    if (srv < 0) {
+        DBUS_BROKER_WARNING("socket: %s", strerror(errno));
+        return -1;
+    }
 
+    memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
-    /* could have bus-path override (LEN would need checking) */
-    memcpy(addr.sun_path, DBUS_BUS_ADDR, strlen(DBUS_BUS_ADDR) + 1);
+    memcpy(addr.sun_path, bus_path, strlen(bus_path) + 1);
 
-    if (connect(srv, (struct sockaddr *) &addr, sizeof(addr)) < 0)
-        DBUS_BROKER_ERROR("connect");
+    if (connect(srv, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        DBUS_BROKER_WARNING("connect %s: %s", bus_path, strerror(errno));
+        close(srv);
+        return -1;
+    }
 
     return srv;
 }
@@ -188,85 +243,262 @@ void debug_raw_msg(struct dbus_message *dmsg, DBusMessage *dbus_msg)
     }
 }
 
+static inline uint32_t wire_u32(const char *buf, bool big_endian)
+{
+    uint32_t value;
+
+    memcpy(&value, buf, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return big_endian ? __builtin_bswap32(value) : value;
+#else
+    return big_endian ? value : __builtin_bswap32(value);
+#endif
+}
+
+static inline size_t wire_align(size_t offset, size_t alignment)
+{
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+/*
+ * Reads a single basic value (or string) of the given type from the wire,
+ * where `offset` is relative to the start of the message for alignment.
+ * Strings are returned as pointers into the buffer.
+ *
+ * @return the offset following the value or -1 if it doesn't fit/is invalid
+ */
+static ssize_t wire_read_value(const char *msg, size_t offset, size_t end,
+                               char type, bool big_endian,
+                               const char **str, uint32_t *u32)
+{
+    uint32_t len;
+    size_t size;
+
+    switch (type) {
+
+        case (DBUS_TYPE_STRING):
+        case (DBUS_TYPE_OBJECT_PATH):
+            offset = wire_align(offset, 4);
+            if (offset + 4 > end)
+                return -1;
+            len = wire_u32(msg + offset, big_endian);
+            offset += 4;
+            if (len >= end - offset || msg[offset + len] != '\0')
+                return -1;
+            if (str)
+                *str = msg + offset;
+            return offset + len + 1;
+
+        case (DBUS_TYPE_SIGNATURE):
+            if (offset + 1 > end)
+                return -1;
+            len = (uint8_t) msg[offset++];
+            if (len >= end - offset || msg[offset + len] != '\0')
+                return -1;
+            if (str)
+                *str = msg + offset;
+            return offset + len + 1;
+
+        case (DBUS_TYPE_BYTE):
+            size = 1;
+            break;
+
+        case (DBUS_TYPE_INT16):
+        case (DBUS_TYPE_UINT16):
+            size = 2;
+            break;
+
+        case (DBUS_TYPE_BOOLEAN):
+        case (DBUS_TYPE_INT32):
+        case (DBUS_TYPE_UINT32):
+        case (DBUS_TYPE_UNIX_FD):
+            size = 4;
+            break;
+
+        case (DBUS_TYPE_INT64):
+        case (DBUS_TYPE_UINT64):
+        case (DBUS_TYPE_DOUBLE):
+            size = 8;
+            break;
+
+        default:
+            /* containers are never needed by the policy */
+            return -1;
+    }
+
+    offset = wire_align(offset, size);
+    if (offset + size > end)
+        return -1;
+
+    if (u32 && size == 4)
+        *u32 = wire_u32(msg + offset, big_endian);
+
+    return offset + size;
+}
+
 /**
  * Used by client communications over port-5555 where, the raw-bytes are being
- * read directly from the client file-descriptor.  The `char` buffer is
- * de-marshalled into a dbus-protocol object `DBusMessage`
+ * read directly from the client file-descriptor.  Only the fixed header and
+ * the header-field array are parsed, straight from the wire without any
+ * allocation.  The fields of `dmsg` point into `msg`, which has to outlive
+ * it, and the arguments are left to be decoded lazily (`get_string_arg`).
  *
  * @param dmsg the dbus message object.
  * @param msg the raw bytes of the request.
- * @param len the number of bytes contained in msg
+ * @param len the number of bytes contained in msg (a single whole message)
  *
- * @return 0 on success, error code otherwise
+ * @return the dbus message type on success, error code otherwise
  */
 signed int convert_raw_dbus(struct dbus_message *dmsg,
                             const char *msg, size_t len)
 {
-    DBusError error;
-    DBusMessageIter iter;
-    DBusMessage *dbus_msg;
-
-    int ret, type, argnum;
-    const char *destination, *path, *interface, *member;
-
-    dbus_error_init(&error);
-    dbus_msg = NULL;
-    dbus_msg = dbus_message_demarshal(msg, len, &error);
-
-    if (dbus_error_is_set(&error)) {
-        DBUS_BROKER_WARNING("<De-Marshal failed> [Length: %zu] error: %s",
-                              len, error.message);
-        return -1;
-    }
-
-    destination = dbus_message_get_destination(dbus_msg);
-    dmsg->destination = destination ? destination : "NULL";
+    bool big_endian;
+    uint32_t fields_len, value;
+    size_t offset, fields_end, body;
+    ssize_t next;
+    const char *signature, *str;
+    char code;
+
+    if (len < DBUS_MINIMUM_HEADER_SIZE)
+        goto header_error;
+
+    if (msg[0] == DBUS_LITTLE_ENDIAN)
+        big_endian = false;
+    else if (msg[0] == DBUS_BIG_ENDIAN)
+        big_endian = true;
+    else
+        goto header_error;
+
+    fields_len = wire_u32(msg + 12, big_endian);
+    fields_end = DBUS_MINIMUM_HEADER_SIZE + (size_t) fields_len;
+    body = wire_align(fields_end, 8);
+
+    if (fields_end > len || body > len)
+        goto header_error;
+
+    memset(dmsg, 0, sizeof(*dmsg));
+    dmsg->destination = "NULL";
+    dmsg->path = "/";
+    dmsg->interface = "NULL";
+    dmsg->member = "NULL";
+    dmsg->big_endian = big_endian;
+    dmsg->msg_type = (uint8_t) msg[1];
+    dmsg->flags = (uint8_t) msg[2];
+    dmsg->body_len = wire_u32(msg + 4, big_endian);
+    dmsg->serial = wire_u32(msg + 8, big_endian);
+    dmsg->signature = "";
+
+    if (dmsg->body_len != len - body)
+        goto header_error;
+
+    dmsg->body = msg + body;
+    offset = DBUS_MINIMUM_HEADER_SIZE;
+
+    /* array of struct (byte code, variant value) */
+    while (offset < fields_end) {
+        offset = wire_align(offset, 8);
+        if (offset >= fields_end)
+            break;
 
-    path = dbus_message_get_path(dbus_msg);
-    dmsg->path = path ? path : "/";
+        code = msg[offset++];
 
-    interface = dbus_message_get_interface(dbus_msg);
-    dmsg->interface = interface ? interface : "NULL";
+        next = wire_read_value(msg, offset, fields_end, DBUS_TYPE_SIGNATURE,
+                               big_endian, &signature, NULL);
+        if (next < 0 || strlen(signature) != 1)
+            goto header_error;
 
-    member = dbus_message_get_member(dbus_msg);
-    dmsg->member = member ? member : "NULL";
+        str = NULL;
+        value = 0;
+        next = wire_read_value(msg, next, fields_end, signature[0],
+                               big_endian, &str, &value);
+        if (next < 0)
+            goto header_error;
 
-    ret = dbus_message_get_type(dbus_msg);
+        offset = next;
 
-#ifdef DEBUG
-//    debug_raw_msg(dmsg, dbus_msg);
-#endif
+        switch (code) {
+            case (DBUS_HEADER_FIELD_PATH):
+                dmsg->path = str ? str : dmsg->path;
+                break;
 
-    argnum = 0;
-    dbus_message_iter_init(dbus_msg, &iter);
+            case (DBUS_HEADER_FIELD_INTERFACE):
+                dmsg->interface = str ? str : dmsg->interface;
+                break;
 
-    while ((type = dbus_message_iter_get_arg_type(&iter)) != DBUS_TYPE_INVALID) {
+            case (DBUS_HEADER_FIELD_MEMBER):
+                dmsg->member = str ? str : dmsg->member;
+                break;
 
-        void *arg;
+            case (DBUS_HEADER_FIELD_DESTINATION):
+                dmsg->destination = str ? str : dmsg->destination;
+                break;
 
-        switch (type) {
-            case (DBUS_TYPE_INT32):
-                dmsg->arg_sig[argnum] = 'i';
-                dbus_message_iter_get_basic(&iter, arg);
-                dmsg->args[argnum++] = arg;
+            case (DBUS_HEADER_FIELD_SIGNATURE):
+                dmsg->signature = str ? str : dmsg->signature;
                 break;
 
-            case (DBUS_TYPE_STRING):
-                dmsg->arg_sig[argnum] = 's';
-                dbus_message_iter_get_basic(&iter, &arg);
-                dmsg->args[argnum++] = arg;
-                break; 
+            case (DBUS_HEADER_FIELD_REPLY_SERIAL):
+                dmsg->reply_serial = value;
+                break;
 
             default:
                 break;
         }
+    }
 
-        dbus_message_iter_next(&iter);
+    if (dmsg->msg_type == DBUS_MESSAGE_TYPE_INVALID ||
+        dmsg->msg_type > DBUS_MESSAGE_TYPE_SIGNAL)
+        goto header_error;
+
+    return dmsg->msg_type;
+
+header_error:
+
+    DBUS_BROKER_WARNING("<De-Marshal failed> [Length: %zu] %s", len,
+                        "invalid header");
+    return -1;
+}
+
+/**
+ * Returns one of the string arguments of a request.  Raw-dbus requests are
+ * decoded lazily, walking the body only as far as the argument asked for.
+ *
+ * @param dmsg the dbus message object.
+ * @param idx the position of the argument.
+ *
+ * @return the argument or NULL if it isn't a string (or not there).
+ */
+const char *get_string_arg(struct dbus_message *dmsg, int idx)
+{
+    const char *sig, *str;
+    ssize_t offset;
+    int i;
+
+    if (!dmsg->body) {
+        if (idx >= dmsg->arg_number || idx >= DBUS_MAX_ARG_LEN ||
+                                        (dmsg->arg_sig[idx] != 's' &&
+                                         dmsg->arg_sig[idx] != 'o'))
+            return NULL;
+        return (const char *) dmsg->args[idx];
     }
-    
-    dmsg->arg_number = argnum;
-    dbus_message_unref(dbus_msg);
-    return ret;
+
+    sig = dmsg->signature;
+    if (idx >= strlen(sig))
+        return NULL;
+
+    /* the body is 8-aligned, so its offsets align like the message's */
+    offset = 0;
+    str = NULL;
+
+    for (i=0; i <= idx; i++) {
+        str = NULL;
+        offset = wire_read_value(dmsg->body, offset, dmsg->body_len,
+                                 sig[i], dmsg->big_endian, &str, NULL);
+        if (offset < 0)
+            return NULL;
+    }
+
+    return str;
 }
 
 static inline void append_variant(DBusMessageIter *iter, int type, void *data)
@@ -326,25 +558,81 @@ static inline void append_variant(DBusMessageIter *iter, int type, void *data)
 }
 
 /**
- * For every request being made to the dom0 dbus-server the domid needs to be
- * mapped to its corresponding UUID.  This is needed in order to find the VM
- * database policy to a given request.  The UUID's mapping to the domid can be
- * hashed but this function has to run once for each domain.
+ * Asks xenmgr for the domain id of a vm, used to map the domain ids requests
+ * come from onto the policy of their vm as the policy is built.
+ *
+ * @param conn the dbus api connection object.
+ * @param uuid the uuid of the vm as it appears in its object path.
+ *
+ * @return the domain id, or DOMID_NONE if the vm isn't running.
+ */
+int32_t get_domid_from_uuid(DBusConnection *conn, const char *uuid)
+{
+    DBusMessage *msg;
+    DBusMessageIter iter, sub;
+    char *path;
+    int32_t domid;
+
+    struct dbus_message dmsg = { .destination=XENMGR_DEST,
+                                 .interface=DBUS_PROPERTIES_IFACE,
+                                 .member="Get",
+                                 .args={XENMGR_VM_IFACE, "domid"},
+                                 .arg_number=2,
+                                 .arg_sig={'s', 's'},
+                               };
+
+    domid = DOMID_NONE;
+
+    DBUS_REQ_ARG(path, "%s/%s", DBUS_VM_PATH, uuid);
+    dmsg.path = path;
+
+    msg = make_dbus_call(conn, &dmsg);
+    free(path);
+
+    if (!msg)
+        return domid;
+
+    if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_ERROR ||
+        !dbus_message_iter_init(msg, &iter)                   ||
+        dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT)
+        goto domid_error;
+
+    dbus_message_iter_recurse(&iter, &sub);
+    if (dbus_message_iter_get_arg_type(&sub) != DBUS_TYPE_INT32)
+        goto domid_error;
+
+    dbus_message_iter_get_basic(&sub, &domid);
+
+    /* xenmgr reports -1 for a vm that isn't running */
+    if (domid < 0 || domid > UINT16_MAX)
+        domid = DOMID_NONE;
+
+domid_error:
+    dbus_message_unref(msg);
+
+    return domid;
+}
+
+/**
+ * Asks xenmgr which vm runs as a domain id, used to load the policy of a vm
+ * the first time a request comes from it.
  *
+ * @param conn the dbus api connection object.
  * @param domid the domain id to retrieve the uuid for.
  *
- * @return the uuid associated with the domain id or NULL
+ * @return the uuid of the vm as the database knows it (with dashes), NULL if
+ * no vm runs as `domid`.
  */
-char *get_uuid_from_domid(int domid)
+char *get_uuid_from_domid(DBusConnection *conn, int domid)
 {
     DBusMessage *msg;
-    DBusConnection *conn;
     DBusMessageIter iter;
     char *path, *uuid;
+    size_t i, prefix;
 
-    struct dbus_message dmsg = { .destination="com.citrix.xenclient.xenmgr",
+    struct dbus_message dmsg = { .destination=XENMGR_DEST,
                                  .path=DBUS_BASE_PATH,
-                                 .interface="com.citrix.xenclient.xenmgr",
+                                 .interface=XENMGR_DEST,
                                  .member="find_vm_by_domid",
                                  .args={&domid},
                                  .arg_number=1,
@@ -352,51 +640,50 @@ char *get_uuid_from_domid(int domid)
                                };
 
     uuid = NULL;
-    conn = create_dbus_connection();
-    if (!conn)
-        goto conn_error;
 
     msg = make_dbus_call(conn, &dmsg);
     if (!msg)
-        goto conn_error;
+        return uuid;
 
-    if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_ERROR)
+    if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_ERROR ||
+        !dbus_message_iter_init(msg, &iter)                   ||
+        dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_OBJECT_PATH)
         goto uuid_error;
 
-    dbus_message_iter_init(msg, &iter);
-    /* dbus message returns an "object-path" */
-    if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_OBJECT_PATH)
+    /* xenmgr returns the "/vm/<uuid>" object path of the vm */
+    dbus_message_iter_get_basic(&iter, &path);
+    prefix = strlen(DBUS_VM_PATH "/");
+    if (strncmp(path, DBUS_VM_PATH "/", prefix) || path[prefix] == '\0')
         goto uuid_error;
 
-    dbus_message_iter_get_basic(&iter, &path);
-    uuid = malloc(MAX_UUID);
+    uuid = strndup(path + prefix, MAX_UUID - 1);
     if (!uuid)
-        goto uuid_error;
+        DBUS_BROKER_ERROR("Malloc Failed!");
 
-    /* cut off the "/vm/" of the path */
-    strncpy(uuid, path + 4, MAX_UUID - 1);
+    /* object paths carry underscores where the database has dashes */
+    for (i=0; uuid[i]; i++) {
+        if (uuid[i] == '_')
+            uuid[i] = '-';
+    }
 
 uuid_error:
     dbus_message_unref(msg);
 
-conn_error:
-
     return uuid;
 }
 
 /**
- * Facilitates in making raw dbus requests to the main dbus server.
+ * Builds the dbus api message for a tokenized request, a method call when the
+ * request has a destination and a signal otherwise.
  *
- * @param conn the dbus api connection object.
  * @param dmsg the dbus message object for the current message.
  *
- * @return the dbus api message object containing the reply.
+ * @return the dbus api message object or NULL on an invalid signature.
  */
-DBusMessage *make_dbus_call(DBusConnection *conn, struct dbus_message *dmsg)
+DBusMessage *build_dbus_call(struct dbus_message *dmsg)
 {
     int i;
-    DBusMessage *msg, *reply;
-    DBusError error;
+    DBusMessage *msg;
     DBusMessageIter iter;
 
     if (dmsg->destination)
@@ -407,7 +694,9 @@ DBusMessage *make_dbus_call(DBusConnection *conn, struct dbus_message *dmsg)
     else
         msg = dbus_message_new_signal(dmsg->path, dmsg->interface, dmsg->member);
 
-    dbus_error_init(&error);
+    if (!msg)
+        return NULL;
+
     dbus_message_iter_init_append(msg, &iter);
 
     for (i = 0; i < dmsg->arg_number; i++) {
@@ -441,10 +730,31 @@ DBusMessage *make_dbus_call(DBusConnection *conn, struct dbus_message *dmsg)
             default:
                 DBUS_BROKER_ERROR("Failed Request <Invalid DBus Signature>");
                 dbus_message_unref(msg);
-                break;
+                return NULL;
         }
     }
 
+    return msg;
+}
+
+/**
+ * Facilitates in making raw dbus requests to the main dbus server.
+ *
+ * @param conn the dbus api connection object.
+ * @param dmsg the dbus message object for the current message.
+ *
+ * @return the dbus api message object containing the reply.
+ */
+DBusMessage *make_dbus_call(DBusConnection *conn, struct dbus_message *dmsg)
+{
+    DBusMessage *msg, *reply;
+    DBusError error;
+
+    msg = build_dbus_call(dmsg);
+    if (!msg)
+        return NULL;
+
+    dbus_error_init(&error);
     reply = dbus_connection_send_with_reply_and_block(conn, msg,
                                                       DBUS_REQ_TIMEOUT,
                                                      &error);
@@ -452,6 +762,7 @@ DBusMessage *make_dbus_call(DBusConnection *conn, struct dbus_message *dmsg)
 
     if (reply == NULL) {
         DBUS_BROKER_WARNING("Failed Request <%s>", error.message);
+        dbus_error_free(&error);
         return NULL;
     }
 
@@ -502,21 +813,55 @@ free_msg:
     return reply;
 }
 
+/**
+ * Requests a whole subtree of the xenclient database in one call.
+ *
+ * @param conn the dbus api connection object.
+ * @param arg the path of the subtree in the database.
+ *
+ * @return the subtree as JSON text (empty if there is none), or NULL if the
+ * database couldn't dump it.
+ */
+char *db_dump(DBusConnection *conn, char *arg)
+{
+    char *reply;
+    const char *buf;
+    struct dbus_message db_msg;
+    DBusMessage *msg;
+
+    reply = NULL;
+    dbus_default(&db_msg, DBUS_DUMP, arg);
+    msg = make_dbus_call(conn, &db_msg);
+    if (!msg)
+        return NULL;
+
+    if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_ERROR ||
+        !dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &buf,
+                               DBUS_TYPE_INVALID))
+        goto free_msg;
+
+    reply = strdup(buf);
+    if (!reply)
+        DBUS_BROKER_WARNING("DBus Query Failed! %s", "");
+
+free_msg:
+    dbus_message_unref(msg);
+
+    return reply;
+}
+
 /**
  * Requests all currently install virtual machines on a given host.
  *
+ * @param conn the dbus api connection object.
+ *
  * @return the dbus api message object.
  */
-DBusMessage *db_list(void)
+DBusMessage *db_list(DBusConnection *conn)
 {
-    DBusConnection *conn;
     struct dbus_message dmsg;
     DBusMessage *vms;
 
-    conn = create_dbus_connection();
-    if (!conn)
-        return NULL;
-
     dbus_default(&dmsg, DBUS_LIST, DBUS_VM_PATH);
     vms = make_dbus_call(conn, &dmsg);
     if (!vms && verbose_logging) {
@@ -528,13 +873,11 @@ DBusMessage *db_list(void)
         vms = NULL;
     }
 
-    dbus_connection_unref(conn);
-
     return vms;
 }
 
 /**
- * For any given dbus request, this function will retrieve its corresponding
+ * For any given dbus request, this function will ask for its corresponding
  * introspection information.
  *
  * By matching up the method call being made with the ones listed in the
@@ -543,15 +886,19 @@ DBusMessage *db_list(void)
  * for instance JSON doesn't have uint32_t and would return int and the
  * method would fail expecting the former.
  *
+ * The signatures are cached per object, only the first request made on an
+ * object (since its destination last changed owner) introspects it.  The
+ * call is sent without waiting on the reply, which is handed to
+ * `complete_introspect` once the connection is dispatched.
+ *
  * @param jreq the json request object.
  *
- * @return the signature string for the json request or NULL.
+ * @return the pending call for the Introspect reply or NULL on failure.
  */
-char *dbus_introspect(struct json_request *jreq)
+DBusPendingCall *send_introspect(struct json_request *jreq)
 {
-    char *signature, *xml, *reply, *xmlbuf;
-    DBusMessage *introspect;
-    DBusMessageIter iter;
+    DBusMessage *msg;
+    DBusPendingCall *call;
 
     struct dbus_message dmsg = { .destination=jreq->dmsg.destination,
                                  .interface=DBUS_INTRO_IFACE,
@@ -559,51 +906,57 @@ char *dbus_introspect(struct json_request *jreq)
                                  .path=jreq->dmsg.path,
                                  .arg_number=0 };
 
-    dbus_connection_flush(jreq->conn);
+    msg = build_dbus_call(&dmsg);
+    if (!msg)
+        return NULL;
 
-    signature = NULL;
-    xml = malloc(DBUS_INTROSPECT_MAX);
-    if (!xml)
-        DBUS_BROKER_ERROR("Malloc Failed!");
+    call = NULL;
+    if (!dbus_connection_send_with_reply(jreq->conn, msg, &call,
+                                         DBUS_REQ_TIMEOUT) || !call)
+        DBUS_BROKER_WARNING("DBus Introspection message failed %s", "");
 
-    introspect = make_dbus_call(jreq->conn, &dmsg);
+    dbus_message_unref(msg);
 
-    if (!introspect) {
-        DBUS_BROKER_WARNING("DBus Introspection message failed %s", "");
-        goto xml_error;
-    }
+    return call;
+}
+
+/**
+ * Caches the signatures of an Introspect reply sent by `send_introspect` and
+ * looks up the one of the request's method.
+ *
+ * @param jreq the json request object.
+ * @param introspect the reply, NULL if the call failed or timed out.
+ *
+ * @return the signature string for the json request or NULL.  The string is
+ * owned by the signature cache.
+ */
+const char *complete_introspect(struct json_request *jreq,
+                                DBusMessage *introspect)
+{
+    const char *signature, *xml;
+    DBusMessageIter iter;
 
-    if (dbus_message_get_type(introspect) == DBUS_MESSAGE_TYPE_ERROR) {
+    if (!introspect ||
+        dbus_message_get_type(introspect) == DBUS_MESSAGE_TYPE_ERROR) {
         DBUS_BROKER_WARNING("DBus Introspection message failed %s", "");
-        goto msg_error;
+        return NULL;
     }
 
     dbus_message_iter_init(introspect, &iter);
 
     if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING) {
         DBUS_BROKER_WARNING("DBus Introspect return invalid type %s", "");
-        goto msg_error;
+        return NULL;
     }
 
-    dbus_message_iter_get_basic(&iter, &reply);
-    strcpy(xml, reply);
-
-    signature = calloc(1, XML_SIGNATURE_MAX);
-    if (!signature)
-        DBUS_BROKER_ERROR("Calloc Failed!");
-
-    xmlbuf = strdup(xml);
-    if (retrieve_xml_signature((const xmlChar *) xmlbuf, signature,
-                                jreq->dmsg.interface, jreq->dmsg.member) < 1)
-        signature[0] = '\0';
-
-    free(xmlbuf);
+    dbus_message_iter_get_basic(&iter, &xml);
 
-msg_error:
-    dbus_message_unref(introspect);
-
-xml_error:
-    free(xml);
+    /* invalid xml isn't cached, the request goes on without a signature */
+    if (cache_xml_signatures(xml, jreq->dmsg.destination, jreq->dmsg.path) < 0 ||
+        !signature_cache_lookup(jreq->dmsg.destination, jreq->dmsg.path,
+                                jreq->dmsg.interface, jreq->dmsg.member,
+                                &signature))
+        signature = "";
 
     return signature;
 }
@@ -640,25 +993,6 @@ struct dbus_link *add_dbus_signal(void)
     return new_link;
 }
 
-/**
- * Add a websockets signal to the running list.
- *
- * @param conn the dbus api connection object.
- * @param wsi the websockets api context object.
- */
-void add_ws_signal(DBusConnection *conn, char *signal, struct lws *wsi)
-{
-    struct dbus_link *curr;
-    curr = add_dbus_signal();
-    curr->wsi = wsi;
-    curr->dconn = conn;
-    curr->signal_type = DBUS_SIGNAL_TYPE_CLIENT;
-    curr->name = strdup(signal);
-    signal_subscribers++;
-    DBUS_BROKER_EVENT("WS add signal: <%zd>", signal_subscribers);
-    curr->client_fd = signal_subscribers;
-}
-
 /**
  * Remove a websockets signal from the running list.
  *
@@ -666,26 +1000,812 @@ void add_ws_signal(DBusConnection *conn, char *signal, struct lws *wsi)
  */
 void remove_dlink(struct dbus_link *link)
 {
-    if (link == dlinks) {
-        free(link);
+    if (!link->next || link->next == link)
         dlinks = NULL;
-    } else {
+    else {
         link->next->prev = link->prev;
         link->prev->next = link->next;
-        free(link);
+        if (link == dlinks)
+            dlinks = link->next;
     }
+
+    free(link);
 }
 
-/**
- * Free's any UUID's from the uuid cache.
+/* compares a (non-terminated) match rule value against a message field */
+static bool match_field(const char *field, const char *value, size_t len)
+{
+    return field && strlen(field) == len && !strncmp(field, value, len);
+}
+
+/*
+ * Finds the string (or object path) argument `index` of a message.
+ *
+ * @return the argument, NULL if the message has no such argument.
  */
-void free_uuids(void)
+static const char *message_string_arg(DBusMessage *msg, long index,
+                                      bool paths)
 {
-    int i;
-    for (i=0; i < UUID_CACHE_LIMIT; i++) {
-        if (domain_uuids[i] != NULL)
-            free(domain_uuids[i]);
-    }
+    DBusMessageIter iter;
+    const char *arg;
+    int type;
+
+    if (!dbus_message_iter_init(msg, &iter))
+        return NULL;
+
+    while (index-- > 0) {
+        if (!dbus_message_iter_next(&iter))
+            return NULL;
+    }
+
+    type = dbus_message_iter_get_arg_type(&iter);
+    if (type != DBUS_TYPE_STRING &&
+        (!paths || type != DBUS_TYPE_OBJECT_PATH))
+        return NULL;
+
+    dbus_message_iter_get_basic(&iter, &arg);
+
+    return arg;
+}
+
+/* either side ending in '/' matches everything under it (argNpath) */
+static bool match_arg_path(const char *arg, const char *value, size_t len)
+{
+    size_t arg_len;
+
+    arg_len = strlen(arg);
+
+    if (arg_len == len && !strncmp(arg, value, len))
+        return true;
+
+    if (arg_len > 0 && arg[arg_len - 1] == '/' && arg_len < len &&
+        !strncmp(arg, value, arg_len))
+        return true;
+
+    return len > 0 && value[len - 1] == '/' && len < arg_len &&
+           !strncmp(arg, value, len);
+}
+
+/*
+ * Parses the index of an argN/argNpath key.
+ *
+ * @return the index, -1 if the key isn't an argument key.
+ */
+static long match_arg_index(const char *key, size_t key_len, bool *path)
+{
+    long index;
+    size_t i;
+
+    if (key_len < 4 || strncmp(key, "arg", 3) || !isdigit((unsigned char) key[3]))
+        return -1;
+
+    index = 0;
+    for (i=3; i < key_len && isdigit((unsigned char) key[i]) && i < 5; i++)
+        index = index * 10 + key[i] - '0';
+
+    *path = key_len - i == 4 && !strncmp(key + i, "path", 4);
+    if ((i != key_len && !*path) || index > DBUS_MAXIMUM_MATCH_RULE_ARG_NUMBER)
+        return -1;
+
+    return index;
+}
+
+/*
+ * Compares one key='value' pair of a match rule against a signal.  A
+ * well-known sender is compared through `owner`, the unique name that owns
+ * it, since only the unique name is on the message.
+ */
+static bool match_rule_key(DBusMessage *msg, const char *key, size_t key_len,
+                           const char *value, size_t len, const char *owner)
+{
+    const char *path, *arg;
+    long index;
+    bool arg_path;
+
+#define RULE_KEY(name) (key_len == strlen(name) && !strncmp(key, name, key_len))
+
+    if (RULE_KEY("type"))
+        return match_field(dbus_message_type_to_string(
+                               dbus_message_get_type(msg)), value, len);
+    if (RULE_KEY("interface"))
+        return match_field(dbus_message_get_interface(msg), value, len);
+    if (RULE_KEY("member"))
+        return match_field(dbus_message_get_member(msg), value, len);
+    if (RULE_KEY("path"))
+        return match_field(dbus_message_get_path(msg), value, len);
+    if (RULE_KEY("destination"))
+        return match_field(dbus_message_get_destination(msg), value, len);
+    if (RULE_KEY("eavesdrop"))
+        return match_field("false", value, len);
+
+    if (RULE_KEY("sender")) {
+        if (value[0] == ':' || match_field(DBUS_SERVICE_DBUS, value, len))
+            return match_field(dbus_message_get_sender(msg), value, len);
+        return owner && dbus_message_get_sender(msg) &&
+               !strcmp(owner, dbus_message_get_sender(msg));
+    }
+
+    if (RULE_KEY("path_namespace")) {
+        path = dbus_message_get_path(msg);
+        if (!path)
+            return false;
+        if (len == 1 && value[0] == '/')
+            return true;
+        return !strncmp(path, value, len) &&
+               (path[len] == '\0' || path[len] == '/');
+    }
+
+    if (RULE_KEY("arg0namespace")) {
+        arg = message_string_arg(msg, 0, false);
+        return arg && !strncmp(arg, value, len) &&
+               (arg[len] == '\0' || arg[len] == '.');
+    }
+
+#undef RULE_KEY
+
+    index = match_arg_index(key, key_len, &arg_path);
+    if (index < 0)
+        return false;
+
+    arg = message_string_arg(msg, index, arg_path);
+    if (!arg)
+        return false;
+
+    return arg_path ? match_arg_path(arg, value, len) :
+                      match_field(arg, value, len);
+}
+
+/*
+ * Walks the key='value' pairs of a match rule, calling `visit` on each
+ * until one returns false.
+ *
+ * @return false if the rule is malformed or a pair was rejected.
+ */
+static bool walk_match_rule(const char *rule,
+                            bool (*visit)(const char *key, size_t key_len,
+                                          const char *value, size_t len,
+                                          void *data),
+                            void *data)
+{
+    const char *key, *value, *end;
+    size_t key_len;
+
+    if (!rule)
+        return false;
+
+    while (*rule) {
+        while (*rule == ',' || isspace((unsigned char) *rule))
+            rule++;
+
+        if (*rule == '\0')
+            break;
+
+        key = rule;
+        while (*rule && *rule != '=')
+            rule++;
+
+        key_len = rule - key;
+        if (rule[0] != '=' || rule[1] != '\'')
+            return false;
+
+        value = rule + 2;
+        end = strchr(value, '\'');
+        if (!end)
+            return false;
+
+        if (!visit(key, key_len, value, end - value, data))
+            return false;
+
+        rule = end + 1;
+    }
+
+    return true;
+}
+
+struct rule_match {
+    DBusMessage *msg;
+    const char *owner;
+};
+
+static bool visit_match_key(const char *key, size_t key_len,
+                            const char *value, size_t len, void *data)
+{
+    struct rule_match *match = data;
+
+    return match_rule_key(match->msg, key, key_len, value, len, match->owner);
+}
+
+/**
+ * Checks whether a signal satisfies a match rule of the form
+ * "key='value',key='value'".  A sender given by its well-known name never
+ * matches here, see `ws_match_accepts`.
+ *
+ * @param msg the dbus api signal message.
+ * @param rule the null-terminated match rule.
+ *
+ * @return true if every key of the rule matches.
+ */
+bool dbus_signal_matches(DBusMessage *msg, const char *rule)
+{
+    struct rule_match match = { .msg=msg, .owner=NULL };
+
+    return walk_match_rule(rule, visit_match_key, &match);
+}
+
+/**
+ * Checks whether a signal is one a websocket subscription asked for.
+ *
+ * @param match the subscription.
+ * @param msg the dbus api signal message.
+ *
+ * @return true if every key of the subscription's rule matches.
+ */
+bool ws_match_accepts(struct ws_match *match, DBusMessage *msg)
+{
+    struct rule_match rule_match = { .msg=msg, .owner=match->sender_owner };
+
+    return walk_match_rule(match->rule, visit_match_key, &rule_match);
+}
+
+/* looks for a key the broker can't match on, and a well-known sender */
+static bool visit_supported_key(const char *key, size_t key_len,
+                                const char *value, size_t len, void *data)
+{
+    char **sender = data;
+    bool arg_path;
+
+#define RULE_KEY(name) (key_len == strlen(name) && !strncmp(key, name, key_len))
+
+    if (RULE_KEY("sender")) {
+        if (len > 0 && value[0] != ':' &&
+            !match_field(DBUS_SERVICE_DBUS, value, len)) {
+            *sender = strndup(value, len);
+            if (!*sender)
+                DBUS_BROKER_ERROR("Malloc Failed!");
+        }
+        return true;
+    }
+
+    if (RULE_KEY("eavesdrop"))
+        return match_field("false", value, len);
+
+    if (RULE_KEY("type") || RULE_KEY("interface") || RULE_KEY("member") ||
+        RULE_KEY("path") || RULE_KEY("destination") ||
+        RULE_KEY("path_namespace") || RULE_KEY("arg0namespace"))
+        return true;
+
+#undef RULE_KEY
+
+    return match_arg_index(key, key_len, &arg_path) >= 0;
+}
+
+/* stores the owner of a well-known name in every subscription sent by it */
+static void set_ws_sender_owner(const char *name, const char *owner)
+{
+    struct ws_match *match;
+
+    for (match = ws_matches; match; match = match->next) {
+        if (!match->sender || strcmp(match->sender, name))
+            continue;
+
+        free(match->sender_owner);
+        match->sender_owner = NULL;
+
+        if (owner && owner[0] != '\0') {
+            match->sender_owner = strdup(owner);
+            if (!match->sender_owner)
+                DBUS_BROKER_ERROR("Malloc Failed!");
+        }
+    }
+}
+
+static void complete_name_owner(DBusPendingCall *call, void *data)
+{
+    DBusMessage *reply;
+    const char *owner;
+
+    reply = dbus_pending_call_steal_reply(call);
+    dbus_pending_call_unref(call);
+
+    if (!reply)
+        return;
+
+    if (dbus_message_get_type(reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+        !dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &owner,
+                               DBUS_TYPE_INVALID))
+        owner = NULL;
+
+    set_ws_sender_owner(data, owner);
+    dbus_message_unref(reply);
+}
+
+/*
+ * Asks the bus which unique name owns a well-known sender, later changes
+ * come in through NameOwnerChanged (see `update_ws_name_owner`).  Until the
+ * reply is in, signals from the name aren't delivered.
+ */
+static void resolve_ws_sender(DBusConnection *conn, const char *name)
+{
+    DBusMessage *msg;
+    DBusPendingCall *call;
+    char *data;
+
+    msg = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                       DBUS_INTERFACE_DBUS, "GetNameOwner");
+    if (!msg)
+        DBUS_BROKER_ERROR("Malloc Failed!");
+
+    if (!dbus_message_append_args(msg, DBUS_TYPE_STRING, &name,
+                                  DBUS_TYPE_INVALID))
+        DBUS_BROKER_ERROR("Malloc Failed!");
+
+    call = NULL;
+    if (!dbus_connection_send_with_reply(conn, msg, &call,
+                                         DBUS_TIMEOUT_USE_DEFAULT) || !call) {
+        DBUS_BROKER_WARNING("GetNameOwner of <%s> failed", name);
+        dbus_message_unref(msg);
+        return;
+    }
+
+    dbus_message_unref(msg);
+
+    data = strdup(name);
+    if (!data)
+        DBUS_BROKER_ERROR("Malloc Failed!");
+
+    if (!dbus_pending_call_set_notify(call, complete_name_owner, data, free))
+        DBUS_BROKER_ERROR("Malloc Failed!");
+}
+
+/**
+ * Follows a NameOwnerChanged signal, subscriptions to a well-known sender
+ * move on to its new owner.
+ *
+ * @param name the name whose owner changed.
+ * @param owner its new unique owner, empty if it's gone.
+ */
+void update_ws_name_owner(const char *name, const char *owner)
+{
+    set_ws_sender_owner(name, owner);
+}
+
+static struct ws_match *find_ws_match(DBusConnection *conn, const char *rule)
+{
+    struct ws_match *match;
+
+    for (match = ws_matches; match; match = match->next) {
+        if (match->conn == conn && !strcmp(match->rule, rule))
+            return match;
+    }
+
+    return NULL;
+}
+
+/*
+ * Drops `refs` of a session's references to a match rule, the rule is taken
+ * off the bus with its last reference.
+ */
+static void release_ws_match(struct ws_match *match,
+                             struct ws_subscriber **sub, size_t refs)
+{
+    struct ws_subscriber *subscriber;
+    struct ws_match **curr;
+
+    subscriber = *sub;
+    subscriber->refs -= refs;
+    match->refs -= refs;
+    signal_subscribers -= refs;
+
+    if (subscriber->refs == 0) {
+        *sub = subscriber->next;
+        free(subscriber);
+    }
+
+    if (match->refs > 0)
+        return;
+
+    dbus_bus_remove_match(match->conn, match->rule, NULL);
+
+    for (curr = &ws_matches; *curr; curr = &((*curr)->next)) {
+        if (*curr == match) {
+            *curr = match->next;
+            break;
+        }
+    }
+
+    free(match->sender);
+    free(match->sender_owner);
+    free(match->rule);
+    free(match);
+}
+
+/**
+ * Subscribes a websocket session to a match rule.  A rule is only added to
+ * the bus connection for its first subscriber, later ones just take a
+ * reference.  Every session shares the connection, so the broker has to
+ * match each signal against the rule itself.  A rule with a key it can't
+ * match on is refused rather than widened.
+ *
+ * @param conn the dbus api connection object.
+ * @param rule the match rule of the AddMatch request.
+ * @param wsi the websockets api context object.
+ *
+ * @return 0 on success, -1 if the rule isn't supported.
+ */
+int add_ws_match(DBusConnection *conn, const char *rule, struct lws *wsi)
+{
+    struct ws_match *match;
+    struct ws_subscriber *sub;
+    char *sender;
+
+    match = find_ws_match(conn, rule);
+
+    if (!match) {
+        /* the bus delivers to the shared connection, the broker matches */
+        sender = NULL;
+        if (!walk_match_rule(rule, visit_supported_key, &sender)) {
+            free(sender);
+            return -1;
+        }
+
+        match = calloc(1, sizeof *match);
+        if (!match)
+            DBUS_BROKER_ERROR("Calloc Failed!");
+
+        match->rule = strdup(rule);
+        if (!match->rule)
+            DBUS_BROKER_ERROR("Malloc Failed!");
+
+        match->conn = conn;
+        match->sender = sender;
+        dbus_bus_add_match(conn, rule, NULL);
+        match->next = ws_matches;
+        ws_matches = match;
+
+        if (sender)
+            resolve_ws_sender(conn, sender);
+    }
+
+    for (sub = match->subscribers; sub && sub->wsi != wsi; sub = sub->next)
+        ;
+
+    if (!sub) {
+        sub = calloc(1, sizeof *sub);
+        if (!sub)
+            DBUS_BROKER_ERROR("Calloc Failed!");
+
+        sub->wsi = wsi;
+        sub->next = match->subscribers;
+        match->subscribers = sub;
+    }
+
+    sub->refs++;
+    match->refs++;
+    signal_subscribers++;
+    DBUS_BROKER_EVENT("WS add signal: <%zd>", signal_subscribers);
+
+    return 0;
+}
+
+/**
+ * Drops one of a websocket session's references to a match rule.
+ *
+ * @param conn the dbus api connection object.
+ * @param rule the match rule of the RemoveMatch request.
+ * @param wsi the websockets api context object.
+ *
+ * @return 0 on success, -1 if the session isn't subscribed to the rule.
+ */
+int remove_ws_match(DBusConnection *conn, const char *rule, struct lws *wsi)
+{
+    struct ws_match *match;
+    struct ws_subscriber **sub;
+
+    match = find_ws_match(conn, rule);
+    if (!match)
+        return -1;
+
+    for (sub = &(match->subscribers); *sub; sub = &((*sub)->next)) {
+        if ((*sub)->wsi == wsi) {
+            release_ws_match(match, sub, 1);
+            DBUS_BROKER_EVENT("WS rm signal: <%zd>", signal_subscribers);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Drops every match rule reference held by a closed websocket session.
+ *
+ * @param wsi the websockets api context object of the closed session.
+ */
+void remove_ws_matches(struct lws *wsi)
+{
+    struct ws_match *match, *next;
+    struct ws_subscriber **sub;
+
+    for (match = ws_matches; match; match = next) {
+        next = match->next;
+
+        for (sub = &(match->subscribers); *sub; sub = &((*sub)->next)) {
+            if ((*sub)->wsi == wsi) {
+                release_ws_match(match, sub, (*sub)->refs);
+                DBUS_BROKER_EVENT("WS rm signal: <%zd>", signal_subscribers);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Free's every match rule subscription.
+ */
+void free_ws_matches(void)
+{
+    struct ws_match *match;
+    struct ws_subscriber *sub;
+
+    while ((match = ws_matches) != NULL) {
+        ws_matches = match->next;
+
+        while ((sub = match->subscribers) != NULL) {
+            match->subscribers = sub->next;
+            free(sub);
+        }
+
+        free(match->sender);
+        free(match->sender_owner);
+        free(match->rule);
+        free(match);
+    }
+
+    signal_subscribers = 0;
+}
+
+static void service_dbus_poll(uv_poll_t *handle, int status, int events);
+
+/* polls for whatever the enabled watches on the descriptor are waiting on */
+static void update_dbus_poll(struct dbus_poll *poll)
+{
+    int events;
+
+    events = 0;
+    if (poll->read && dbus_watch_get_enabled(poll->read))
+        events |= UV_READABLE;
+    if (poll->write && dbus_watch_get_enabled(poll->write))
+        events |= UV_WRITABLE;
+
+    if (events)
+        uv_poll_start(&poll->handle, events, service_dbus_poll);
+    else
+        uv_poll_stop(&poll->handle);
+}
+
+static void service_dbus_poll(uv_poll_t *handle, int status, int events)
+{
+    struct dbus_poll *poll;
+    unsigned int error;
+
+    poll = (struct dbus_poll *) handle->data;
+    error = status < 0 ? DBUS_WATCH_ERROR : 0;
+
+    /* handling a watch may remove either of them */
+    if (poll->read && (events & UV_READABLE || error))
+        dbus_watch_handle(poll->read, DBUS_WATCH_READABLE | error);
+
+    if (poll->write && events & UV_WRITABLE)
+        dbus_watch_handle(poll->write, DBUS_WATCH_WRITABLE);
+}
+
+static void free_dbus_poll(uv_handle_t *handle)
+{
+    free(handle->data);
+}
+
+static dbus_bool_t add_dbus_watch(DBusWatch *watch, void *data)
+{
+    struct dbus_loop *dloop;
+    struct dbus_poll *poll;
+    int fd;
+
+    dloop = (struct dbus_loop *) data;
+    fd = dbus_watch_get_unix_fd(watch);
+
+    /* libuv only takes one poll handle per descriptor */
+    for (poll = dloop->polls; poll && poll->fd != fd; poll = poll->next)
+        ;
+
+    if (!poll) {
+        poll = calloc(1, sizeof *poll);
+        if (!poll)
+            return FALSE;
+
+        if (uv_poll_init(dloop->loop, &poll->handle, fd) < 0) {
+            free(poll);
+            return FALSE;
+        }
+
+        poll->fd = fd;
+        poll->handle.data = poll;
+        poll->next = dloop->polls;
+        dloop->polls = poll;
+    }
+
+    if (dbus_watch_get_flags(watch) & DBUS_WATCH_READABLE)
+        poll->read = watch;
+    else
+        poll->write = watch;
+
+    dbus_watch_set_data(watch, poll, NULL);
+    update_dbus_poll(poll);
+
+    return TRUE;
+}
+
+static void remove_dbus_watch(DBusWatch *watch, void *data)
+{
+    struct dbus_loop *dloop;
+    struct dbus_poll *poll, **curr;
+
+    dloop = (struct dbus_loop *) data;
+    poll = (struct dbus_poll *) dbus_watch_get_data(watch);
+    if (!poll)
+        return;
+
+    dbus_watch_set_data(watch, NULL, NULL);
+
+    if (poll->read == watch)
+        poll->read = NULL;
+    if (poll->write == watch)
+        poll->write = NULL;
+
+    if (poll->read || poll->write) {
+        update_dbus_poll(poll);
+        return;
+    }
+
+    for (curr = &(dloop->polls); *curr; curr = &((*curr)->next)) {
+        if (*curr == poll) {
+            *curr = poll->next;
+            break;
+        }
+    }
+
+    uv_close((uv_handle_t *) &poll->handle, free_dbus_poll);
+}
+
+static void toggle_dbus_watch(DBusWatch *watch, void *data)
+{
+    struct dbus_poll *poll;
+
+    poll = (struct dbus_poll *) dbus_watch_get_data(watch);
+    if (poll)
+        update_dbus_poll(poll);
+}
+
+static void service_dbus_timeout(uv_timer_t *handle)
+{
+    dbus_timeout_handle((DBusTimeout *) handle->data);
+}
+
+static void toggle_dbus_timeout(DBusTimeout *timeout, void *data)
+{
+    uv_timer_t *timer;
+    int interval;
+
+    timer = (uv_timer_t *) dbus_timeout_get_data(timeout);
+    if (!timer)
+        return;
+
+    uv_timer_stop(timer);
+
+    if (dbus_timeout_get_enabled(timeout)) {
+        interval = dbus_timeout_get_interval(timeout);
+        uv_timer_start(timer, service_dbus_timeout, interval, interval);
+    }
+}
+
+static dbus_bool_t add_dbus_timeout(DBusTimeout *timeout, void *data)
+{
+    struct dbus_loop *dloop;
+    uv_timer_t *timer;
+
+    dloop = (struct dbus_loop *) data;
+
+    timer = malloc(sizeof *timer);
+    if (!timer)
+        return FALSE;
+
+    uv_timer_init(dloop->loop, timer);
+    timer->data = timeout;
+    dbus_timeout_set_data(timeout, timer, NULL);
+    toggle_dbus_timeout(timeout, data);
+
+    return TRUE;
+}
+
+static void free_dbus_timer(uv_handle_t *handle)
+{
+    free(handle);
+}
+
+static void remove_dbus_timeout(DBusTimeout *timeout, void *data)
+{
+    uv_timer_t *timer;
+
+    timer = (uv_timer_t *) dbus_timeout_get_data(timeout);
+    if (!timer)
+        return;
+
+    dbus_timeout_set_data(timeout, NULL, NULL);
+    uv_close((uv_handle_t *) timer, free_dbus_timer);
+}
+
+static void dispatch_dbus_loop(uv_idle_t *handle)
+{
+    struct dbus_loop *dloop;
+
+    dloop = (struct dbus_loop *) handle->data;
+    uv_idle_stop(handle);
+
+    while (dbus_connection_dispatch(dloop->conn) == DBUS_DISPATCH_DATA_REMAINS)
+        ;
+}
+
+/*
+ * libdbus doesn't allow dispatching from here, the loop does it once it's
+ * done with the current callback.
+ */
+static void update_dispatch_status(DBusConnection *conn,
+                                   DBusDispatchStatus status, void *data)
+{
+    struct dbus_loop *dloop;
+
+    dloop = (struct dbus_loop *) data;
+
+    if (status == DBUS_DISPATCH_DATA_REMAINS)
+        uv_idle_start(&dloop->dispatch, dispatch_dbus_loop);
+}
+
+/**
+ * Hands a dbus connection over to a libuv loop.  The loop polls the sockets
+ * the connection watches and runs its timeouts (the timeouts of pending calls
+ * among them), any message that arrives is dispatched straight away.
+ *
+ * @param loop the libuv loop servicing the connection.
+ * @param conn the dbus api connection object.
+ */
+void watch_dbus_connection(uv_loop_t *loop, DBusConnection *conn)
+{
+    struct dbus_loop *dloop;
+
+    dloop = calloc(1, sizeof *dloop);
+    if (!dloop)
+        DBUS_BROKER_ERROR("Calloc Failed!");
+
+    dloop->loop = loop;
+    dloop->conn = conn;
+    uv_idle_init(loop, &dloop->dispatch);
+    dloop->dispatch.data = dloop;
+
+    if (!dbus_connection_set_watch_functions(conn, add_dbus_watch,
+                                             remove_dbus_watch,
+                                             toggle_dbus_watch,
+                                             dloop, NULL) ||
+        !dbus_connection_set_timeout_functions(conn, add_dbus_timeout,
+                                               remove_dbus_timeout,
+                                               toggle_dbus_timeout,
+                                               dloop, NULL))
+        DBUS_BROKER_ERROR("Malloc Failed!");
+
+    dbus_connection_set_dispatch_status_function(conn, update_dispatch_status,
+                                                 dloop, NULL);
+
+    /* whatever was queued before the loop took over */
+    update_dispatch_status(conn, dbus_connection_get_dispatch_status(conn),
+                           dloop);
 }
 
 /**
@@ -701,7 +1821,7 @@ void free_dlinks(void)
     head = dlinks;
     curr = head->next;
 
-    while (curr != head) {
+    while (curr && curr != head) {
         struct dbus_link *tmp;
         tmp = curr->next;
         free(curr);
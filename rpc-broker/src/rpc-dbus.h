@@ -34,12 +34,14 @@
 #define DBUS_MSG_LEN        8192
 #define DBUS_ARG_LEN        1024
 
-#define DBUS_INTROSPECT_MAX 0xFFFF
-
 #define DBUS_MAX_ARG_LEN    16
 
 /**
  * @brief A structure containing the tokenized fields of a dbus reqest.
+ *
+ * For raw-dbus requests the fields point straight into the received bytes,
+ * the arguments aren't decoded (`arg_number` is 0) but can be read lazily
+ * from `body` with `get_string_arg`.
  */
 struct dbus_message {
     const char *destination;
@@ -47,14 +49,30 @@ struct dbus_message {
     const char *path;
     const char *member;
     const char *type;
+    /* symbol ids of the fields above, see `resolve_message_symbols` */
+    uint32_t symbol_version;
+    uint32_t destination_id;
+    uint32_t interface_id;
+    uint32_t path_id;
+    uint32_t member_id;
     uint8_t arg_number;
     char arg_sig[DBUS_MAX_ARG_LEN];
     char json_sig[DBUS_MAX_ARG_LEN];
     void *args[DBUS_MAX_ARG_LEN];
+    /* raw-dbus wire fields */
+    bool big_endian;
+    uint8_t msg_type;
+    uint8_t flags;
+    uint32_t serial;
+    uint32_t reply_serial;
+    const char *signature;
+    const char *body;
+    uint32_t body_len;
 };
 
 #define DBUS_READ "read"
 #define DBUS_LIST "list"
+#define DBUS_DUMP "dump"
 
 #define CLIENT_REQ_LEN       16
 #define CLIENT_DBUS_REQ_LEN 256
@@ -62,11 +80,23 @@ struct dbus_message {
 #define VM_UUID_LEN   33
 #define DOMID_UUID_LEN 8
 #define DOMID_SECTION 24
+#define DOMID_NONE    -1  /* a vm that isn't running */
 
 #define XENSTORE_TARGET_LEN 8
 #define XENSTORE_TARGET "/target"
 
+#define XENMGR_DEST     "com.citrix.xenclient.xenmgr"
+#define XENMGR_VM_IFACE "com.citrix.xenclient.xenmgr.vm"
+
+#define DBUS_PROPERTIES_IFACE "org.freedesktop.DBus.Properties"
+
 #define XENMGR_SIGNAL_SERVICE "type='signal',interface='com.citrix.xenclient.xenmgr',member='vm_state_changed'"
+#define XENMGR_CONFIG_SIGNAL  "type='signal',interface='com.citrix.xenclient.xenmgr',member='vm_config_changed'"
+#define XENMGR_CONFIG_MEMBER  "vm_config_changed"
+#define XENMGR_STATE_MEMBER   "vm_state_changed"
+
+#define DBUS_NAME_OWNER_SIGNAL "type='signal',sender='org.freedesktop.DBus',interface='org.freedesktop.DBus',member='NameOwnerChanged'"
+#define DBUS_NAME_OWNER_MEMBER "NameOwnerChanged"
 
 
 /**
@@ -79,54 +109,130 @@ struct dbus_link {
     int server_fd;
     struct dbus_link *next;
     struct dbus_link *prev;
-    struct lws *wsi;
-    char *name;
     DBusConnection *dconn;
 };
 
 struct dbus_link *dlinks;
+
+/**
+ * @brief a websocket session subscribed to a match rule, `refs` counts its
+ * AddMatch requests for the rule.
+ */
+struct ws_subscriber {
+    struct lws *wsi;
+    size_t refs;
+    struct ws_subscriber *next;
+};
+
+/**
+ * @brief a match rule added to the bus connection once, however many
+ * websocket sessions subscribe to it.  Signals matching the rule are fanned
+ * out to every subscriber.
+ */
+struct ws_match {
+    char *rule;
+    char *sender;
+    char *sender_owner;
+    size_t refs;
+    DBusConnection *conn;
+    struct ws_subscriber *subscribers;
+    struct ws_match *next;
+};
+
+struct ws_match *ws_matches;
 size_t signal_subscribers;
 
+/**
+ * @brief the libuv poll handle of a descriptor watched by a dbus connection,
+ * libdbus keeps separate watches for reading and writing.
+ */
+struct dbus_poll {
+    int fd;
+    uv_poll_t handle;
+    DBusWatch *read;
+    DBusWatch *write;
+    struct dbus_poll *next;
+};
+
+/**
+ * @brief a dbus connection serviced by a libuv loop, `dispatch` runs once
+ * the connection has messages queued.
+ */
+struct dbus_loop {
+    uv_loop_t *loop;
+    DBusConnection *conn;
+    uv_idle_t dispatch;
+    struct dbus_poll *polls;
+};
+
 /* forward declarations */
 struct dbus_broker_server;
 struct json_request;
 
 #define DBUS_SIGNAL_TYPE_SERVER 0x1
-#define DBUS_SIGNAL_TYPE_CLIENT 0x2
 
 
 /* src/rpc-dbus.c */
 DBusConnection *create_dbus_connection(void);
 
-int start_server(struct dbus_broker_server *server, int port);
+DBusConnection *create_private_dbus_connection(void);
+
+void close_private_dbus_connection(DBusConnection *conn);
+
+int start_server(struct dbus_broker_server *server, int port, int backlog);
 
 void dbus_default(struct dbus_message *dmsg, char *member, void *arg);
 
-int connect_to_system_bus(void);
+int connect_to_system_bus(const char *bus_path);
 
 void *dbus_signal(void *subscriber);
 
 signed int convert_raw_dbus(struct dbus_message *dmsg,
                             const char *msg, size_t len);
 
+const char *get_string_arg(struct dbus_message *dmsg, int idx);
+
+DBusMessage *build_dbus_call(struct dbus_message *dmsg);
+
 DBusMessage *make_dbus_call(DBusConnection *conn, struct dbus_message *dmsg);
 
 char *db_query(DBusConnection *conn, char *arg);
 
-DBusMessage *db_list(void);
+DBusMessage *db_list(DBusConnection *conn);
+
+char *db_dump(DBusConnection *conn, char *arg);
 
-char *dbus_introspect(struct json_request *jreq);
+DBusPendingCall *send_introspect(struct json_request *jreq);
 
-void add_ws_signal(DBusConnection *conn, char *signal, struct lws *wsi);
+const char *complete_introspect(struct json_request *jreq,
+                                DBusMessage *introspect);
+
+int add_ws_match(DBusConnection *conn, const char *rule, struct lws *wsi);
+
+int remove_ws_match(DBusConnection *conn, const char *rule, struct lws *wsi);
+
+void remove_ws_matches(struct lws *wsi);
+
+void free_ws_matches(void);
 
 void remove_dlink(struct dbus_link *link);
 
 void free_dlinks(void);
 
-char *get_uuid_from_domid(int domid);
+int32_t get_domid_from_uuid(DBusConnection *conn, const char *uuid);
+
+char *get_uuid_from_domid(DBusConnection *conn, int domid);
 
 struct dbus_link *add_dbus_signal(void);
 
+bool dbus_signal_matches(DBusMessage *msg, const char *rule);
+
+bool ws_match_accepts(struct ws_match *match, DBusMessage *msg);
+
+void update_ws_name_owner(const char *name, const char *owner);
+
+void watch_dbus_connection(uv_loop_t *loop, DBusConnection *conn);
+
 
 #define DBUS_DB_DEST     "com.citrix.xenclient.db"
 #define DBUS_DB_IFACE    DBUS_DB_DEST
@@ -31,15 +31,128 @@
 #include "rpc-broker.h"
 
 
+/* makes a block able to hold `size` bytes */
+static struct json_arena *new_json_arena_block(size_t size)
+{
+    struct json_arena *block;
+
+    block = malloc(sizeof *block + size);
+    if (!block)
+        DBUS_BROKER_ERROR("Malloc Failed!");
+
+    block->next = NULL;
+    block->used = 0;
+    block->size = size;
+
+    return block;
+}
+
+/* carves `size` bytes out of a block, NULL if they don't fit */
+static void *json_arena_block_alloc(struct json_arena *block, size_t size)
+{
+    uintptr_t addr;
+    size_t pad;
+    void *ptr;
+
+    addr = (uintptr_t) (block->data + block->used);
+    pad = -addr & (JSON_ARENA_ALIGN - 1);
+
+    if (pad + size > block->size - block->used)
+        return NULL;
+
+    ptr = block->data + block->used + pad;
+    block->used += pad + size;
+
+    return ptr;
+}
+
+/**
+ * Creates an empty request arena.
+ *
+ * @return the arena.
+ */
+struct json_arena *new_json_arena(void)
+{
+    return new_json_arena_block(JSON_ARENA_SIZE);
+}
+
+/**
+ * Allocates memory that lives until the arena is freed.  Allocations that
+ * don't fit the current block get a new one, large enough to hold them.
+ *
+ * @param arena the request arena.
+ * @param size the number of bytes needed.
+ *
+ * @return the zeroed memory.
+ */
+void *json_arena_alloc(struct json_arena *arena, size_t size)
+{
+    struct json_arena *block;
+    void *ptr;
+
+    ptr = json_arena_block_alloc(arena, size);
+    if (!ptr && arena->next)
+        ptr = json_arena_block_alloc(arena->next, size);
+
+    if (!ptr) {
+        block = new_json_arena_block(size + JSON_ARENA_ALIGN > JSON_ARENA_SIZE ?
+                                     size + JSON_ARENA_ALIGN : JSON_ARENA_SIZE);
+        block->next = arena->next;
+        arena->next = block;
+        ptr = json_arena_block_alloc(block, size);
+    }
+
+    memset(ptr, 0, size);
+
+    return ptr;
+}
+
+/**
+ * Copies a string into an arena.
+ *
+ * @param arena the request arena.
+ * @param str the string to copy.
+ *
+ * @return the copy.
+ */
+char *json_arena_strdup(struct json_arena *arena, const char *str)
+{
+    size_t len;
+    char *copy;
+
+    len = strlen(str) + 1;
+    copy = json_arena_alloc(arena, len);
+    memcpy(copy, str, len);
+
+    return copy;
+}
+
+/**
+ * Frees an arena along with everything allocated from it.
+ *
+ * @param arena the request arena.
+ */
+void free_json_arena(struct json_arena *arena)
+{
+    struct json_arena *block;
+
+    while (arena) {
+        block = arena->next;
+        free(arena);
+        arena = block;
+    }
+}
+
 /**
  * Initializes a JSON response object.
+ *
+ * @param arena the arena of the request being answered.
  */
-struct json_response *init_jrsp(void)
+struct json_response *init_jrsp(struct json_arena *arena)
 {
     struct json_response *jrsp;
-    jrsp = calloc(1, sizeof *jrsp);
-    if (!jrsp)
-        DBUS_BROKER_ERROR("Calloc Failed!");
+
+    jrsp = json_arena_alloc(arena, sizeof *jrsp);
 
     jrsp->args = json_object_new_array();
     memcpy(jrsp->type, JSON_RESP, strlen(JSON_RESP) + 1);
@@ -47,6 +160,54 @@ struct json_response *init_jrsp(void)
     return jrsp;
 }
 
+/**
+ * Converts the dbus reply to a JSON request into a JSON response object.
+ *
+ * @param arena the arena of the request being answered.
+ * @param id the id of the JSON request being answered.
+ * @param msg the dbus reply, NULL if there wasn't one.
+ *
+ * @return a JSON response object or NULL if the request failed.
+ */
+struct json_response *make_json_response(struct json_arena *arena, uint32_t id,
+                                         DBusMessage *msg)
+{
+    struct json_response *jrsp;
+
+    if (!msg || dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_ERROR) {
+        DBUS_BROKER_WARNING("response to <%d> request failed <%s>", id,
+                            msg ? dbus_message_get_error_name(msg) : "");
+        return NULL;
+    }
+
+    jrsp = init_jrsp(arena);
+    jrsp->id = id;
+    snprintf(jrsp->response_to, JSON_REQ_ID_MAX - 1, "%d", id);
+    load_json_response(msg, jrsp);
+
+    return jrsp;
+}
+
+/**
+ * Creates the JSON response to a request the broker answers itself, the
+ * response carries no arguments.
+ *
+ * @param arena the arena of the request being answered.
+ * @param id the id of the JSON request being answered.
+ *
+ * @return a JSON response object.
+ */
+struct json_response *make_json_ack(struct json_arena *arena, uint32_t id)
+{
+    struct json_response *jrsp;
+
+    jrsp = init_jrsp(arena);
+    jrsp->id = id;
+    snprintf(jrsp->response_to, JSON_REQ_ID_MAX - 1, "%d", id);
+
+    return jrsp;
+}
+
 /**
  * Takes a JSON request object, makes a dbus request and converts into a 
  * JSON response object.  
@@ -63,10 +224,8 @@ struct json_response *make_json_request(struct json_request *jreq)
     const char *busname;
     char *err;
 
-    jrsp = init_jrsp();
     conn = jreq->conn;
     dbus_connection_flush(conn);
-    jrsp->id = jreq->id;
 
     if (jreq->dmsg.member && !strcmp(jreq->dmsg.member, "Hello")) {
 
@@ -75,13 +234,14 @@ struct json_response *make_json_request(struct json_request *jreq)
         if (!busname)
             DBUS_BROKER_ERROR("DBus refused busname");
 
+        jrsp = init_jrsp(jreq->arena);
+        jrsp->id = jreq->id;
         snprintf(jrsp->response_to, JSON_REQ_ID_MAX - 1, "%d", jreq->id);
         memcpy(jrsp->arg_sig, "s", 2);
         json_object_array_add(jrsp->args, json_object_new_string(busname));
         return jrsp;
     }
 
-    snprintf(jrsp->response_to, JSON_REQ_ID_MAX - 1, "%d", jreq->id);
     msg = make_dbus_call(conn, &(jreq->dmsg));
 
     if (!msg || dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_ERROR) {
@@ -96,18 +256,44 @@ struct json_response *make_json_request(struct json_request *jreq)
         }
 
         free(err);
-        json_object_put(jrsp->args);
-        free(jrsp);
         return NULL;
     }
 
-    load_json_response(msg, jrsp);
+    jrsp = make_json_response(jreq->arena, jreq->id, msg);
     dbus_message_unref(msg);
 
     return jrsp;
 }
 
-static void append_dbus_message_arg(int type, int idx, void **args,
+/**
+ * Sends the dbus call of a JSON request without waiting on the reply, which
+ * arrives on the returned pending call once the connection is dispatched.
+ *
+ * @param jreq a tokenized object for the request being made.
+ *
+ * @return the pending call for the reply or NULL on failure.
+ */
+DBusPendingCall *send_json_request(struct json_request *jreq)
+{
+    DBusMessage *msg;
+    DBusPendingCall *call;
+
+    msg = build_dbus_call(&(jreq->dmsg));
+    if (!msg)
+        return NULL;
+
+    call = NULL;
+    if (!dbus_connection_send_with_reply(jreq->conn, msg, &call,
+                                         DBUS_REQ_TIMEOUT) || !call)
+        DBUS_BROKER_WARNING("Failed Request <%d>", jreq->id);
+
+    dbus_message_unref(msg);
+
+    return call;
+}
+
+static void append_dbus_message_arg(struct json_arena *arena, int type,
+                                    int idx, void **args,
                                     struct json_object *jarg)
 {
     /* 
@@ -121,7 +307,7 @@ static void append_dbus_message_arg(int type, int idx, void **args,
 
         case ('b'): {
             int json_bool = json_object_get_boolean(jarg);
-            args[idx] = malloc(sizeof(int));
+            args[idx] = json_arena_alloc(arena, sizeof(int));
             memcpy(args[idx], (void *) &json_bool, sizeof(int));
             break;
         }
@@ -129,14 +315,14 @@ static void append_dbus_message_arg(int type, int idx, void **args,
         case ('u'):
         case ('i'): {
             int json_int = json_object_get_int(jarg);
-            args[idx] = malloc(sizeof(int));
+            args[idx] = json_arena_alloc(arena, sizeof(int));
             memcpy(args[idx], (void *) &json_int, sizeof(int));
             break;
         }
 
         case ('d'): {
             double json_double = json_object_get_double(jarg);
-            args[idx] = malloc(sizeof(double));
+            args[idx] = json_arena_alloc(arena, sizeof(double));
             memcpy(args[idx], (void *) &json_double, sizeof(double));
             break;
         }
@@ -145,14 +331,14 @@ static void append_dbus_message_arg(int type, int idx, void **args,
             const char *json_str = json_object_get_string(jarg);
             if (!json_str)
                 json_str = "";
-            args[idx] = strdup(json_str);
+            args[idx] = json_arena_strdup(arena, json_str);
             break;
         }
 
         case ('v'): {
             int jtype = json_object_get_type(jarg);
             type = json_dbus_types[jtype];
-            append_dbus_message_arg(type, idx, args, jarg);
+            append_dbus_message_arg(arena, type, idx, args, jarg);
             break;
         }
 
@@ -161,14 +347,15 @@ static void append_dbus_message_arg(int type, int idx, void **args,
     }
 }
 
-static const char *get_json_str_obj(struct json_object *jobj, char *field)
+static const char *get_json_str_obj(struct json_arena *arena,
+                                    struct json_object *jobj, char *field)
 {
     struct json_object *jfield;
 
     if (!json_object_object_get_ex(jobj, field, &jfield))
         return NULL;
 
-    return strdup(json_object_get_string(jfield));
+    return json_arena_strdup(arena, json_object_get_string(jfield));
 }
 
 /**
@@ -221,22 +408,14 @@ void load_json_response(DBusMessage *msg, struct json_response *jrsp)
 }
 
 static signed int parse_json_args(struct json_object *jarray,
-                                  struct json_request *jreq)
+                                  struct json_request *jreq,
+                                  const char *signature)
 {
-    char *signature, *sigptr;
+    const char *sigptr;
     size_t array_length;
     int i, jtype;
     struct json_object *jarg;
 
-    /* supports the removal of network-daemon/slave */
-    if (!jreq->dmsg.destination && jreq->dmsg.type) {
-        signature = malloc(3);
-        if (!signature)
-            DBUS_BROKER_ERROR("Malloc Failed!");
-        snprintf(signature, 3, "uu");
-    } else
-        signature = dbus_introspect(jreq);
-
     if (!signature) {
         DBUS_BROKER_WARNING("dbus-introspect %s", "");
         jreq->dmsg.arg_number = 0;
@@ -254,23 +433,48 @@ static signed int parse_json_args(struct json_object *jarray,
         jtype = json_object_get_type(jarg);
 
         if (jtype == json_type_null) {
-            jreq->dmsg.args[i] = strdup("");
+            jreq->dmsg.args[i] = json_arena_strdup(jreq->arena, "");
             continue;
         }
 
         jreq->dmsg.json_sig[i] = json_dbus_types[jtype];
-        append_dbus_message_arg(*sigptr, i, jreq->dmsg.args, jarg);
-        sigptr++;
+        append_dbus_message_arg(jreq->arena, *sigptr, i, jreq->dmsg.args,
+                                jarg);
+        if (*sigptr)
+            sigptr++;
     }
 
-    free(signature);
-
     return 0;
 }
 
+/**
+ * Converts the arguments of a request left unparsed by `convert_json_request`
+ * now that the signature of its method is known.
+ *
+ * @param jreq the request, `jargs` set.
+ * @param signature the signature of the method from `complete_introspect`,
+ * NULL if it couldn't be had.
+ *
+ * @return 0 on success, -1 if the request can't be made.
+ */
+int set_json_args(struct json_request *jreq, const char *signature)
+{
+    int ret;
+
+    ret = parse_json_args(jreq->jargs, jreq, signature);
+
+    json_object_put(jreq->jargs);
+    jreq->jargs = NULL;
+
+    return ret;
+}
+
 /**
  * Takes raw bytes provided by a websockets request and load them into a JSON
- * request object.
+ * request object.  The request and everything made for it live in its own
+ * arena.  Arguments are converted to the signature of the method, when the
+ * signature cache doesn't hold it yet they are kept in `jargs` for the caller
+ * to introspect the object (see `send_introspect`) and `set_json_args`.
  *
  * @param raw_json_req raw bytes from a websockets request.
  * 
@@ -279,7 +483,9 @@ static signed int parse_json_args(struct json_object *jarray,
 struct json_request *convert_json_request(char *raw_json_req)
 {
     struct json_request *jreq;
+    struct json_arena *arena;
     struct json_object *jobj, *jarray, *jint;
+    const char *signature;
 
     jobj = json_tokener_parse(raw_json_req);
 
@@ -288,23 +494,20 @@ struct json_request *convert_json_request(char *raw_json_req)
         return NULL;
     }
 
-    jreq = malloc(sizeof *jreq);
-    if (!jreq) {
-        DBUS_BROKER_WARNING("<Malloc Failed! %s", "");
-        return NULL;
-    }
+    arena = new_json_arena();
+    jreq = json_arena_alloc(arena, sizeof *jreq);
+    jreq->arena = arena;
 
-    memset(&jreq->dmsg, 0, sizeof(jreq->dmsg));
-    jreq->dmsg.destination = get_json_str_obj(jobj, "destination");
+    jreq->dmsg.destination = get_json_str_obj(arena, jobj, "destination");
     /* supports the removal of network-daemon/slave */
     if (!jreq->dmsg.destination) {
-        jreq->dmsg.type = get_json_str_obj(jobj, "type");
+        jreq->dmsg.type = get_json_str_obj(arena, jobj, "type");
     } else
         jreq->dmsg.type = NULL;
 
-    if (!(jreq->dmsg.interface = get_json_str_obj(jobj, "interface")) ||
-        !(jreq->dmsg.path = get_json_str_obj(jobj, "path"))           ||
-        !(jreq->dmsg.member = get_json_str_obj(jobj, "method")))
+    if (!(jreq->dmsg.interface = get_json_str_obj(arena, jobj, "interface")) ||
+        !(jreq->dmsg.path = get_json_str_obj(arena, jobj, "path"))           ||
+        !(jreq->dmsg.member = get_json_str_obj(arena, jobj, "method")))
         goto request_error;
 
     jreq->conn = create_dbus_connection();
@@ -312,15 +515,25 @@ struct json_request *convert_json_request(char *raw_json_req)
     if (!json_object_object_get_ex(jobj, "args", &jarray))
         goto request_error;
 
-    if (parse_json_args(jarray, jreq) < 0)
-        goto request_error;
-
     jint = NULL;
     if (!json_object_object_get_ex(jobj, "id", &jint))
         goto request_error;
 
     jreq->id = json_object_get_int(jint);
 
+    /* supports the removal of network-daemon/slave */
+    if (!jreq->dmsg.destination && jreq->dmsg.type)
+        signature = "uu";
+    else if (!signature_cache_lookup(jreq->dmsg.destination, jreq->dmsg.path,
+                                     jreq->dmsg.interface, jreq->dmsg.member,
+                                     &signature))
+        signature = NULL;
+
+    if (!signature)
+        jreq->jargs = json_object_get(jarray);
+    else if (parse_json_args(jarray, jreq, signature) < 0)
+        goto request_error;
+
     /* json free's recursively on objects */
     json_object_put(jobj);
 
@@ -336,63 +549,230 @@ request_error:
 }
 
 /**
- * Frees JSON request objects.
+ * Frees JSON request objects, along with the arguments and response made for
+ * them.
  *
  * @param jreq the request to be freed.
  */
 void free_json_request(struct json_request *jreq)
 {
-    int i;
+    if (jreq->jargs)
+        json_object_put(jreq->jargs);
+
+    free_json_arena(jreq->arena);
+}
+
+/* makes room for `len` more bytes of text in the writer's buffer */
+static void json_writer_reserve(struct json_writer *writer, size_t len)
+{
+    struct ws_buffer *buffer;
+    size_t size;
+
+    if (writer->buffer->len + len <= writer->size)
+        return;
+
+    size = writer->size * 2;
+    while (size < writer->buffer->len + len)
+        size *= 2;
+
+    buffer = realloc(writer->buffer, sizeof *buffer + LWS_PRE + size);
+    if (!buffer)
+        DBUS_BROKER_ERROR("Malloc Failed!");
+
+    writer->buffer = buffer;
+    writer->size = size;
+}
+
+static void json_write(struct json_writer *writer, const char *text, size_t len)
+{
+    struct ws_buffer *buffer;
+
+    json_writer_reserve(writer, len);
+    buffer = writer->buffer;
+    memcpy(buffer->data + LWS_PRE + buffer->len, text, len);
+    buffer->len += len;
+}
+
+#define json_write_literal(writer, text) \
+    json_write(writer, text, sizeof(text) - 1)
+
+/* writes a quoted string, escaped the same way json-c escapes it */
+static void json_write_string(struct json_writer *writer, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *run;
+    char escape[6];
+    unsigned char c;
+
+    json_write_literal(writer, "\"");
 
-    for (i = 0; i < jreq->dmsg.arg_number; i++) {
-        if (jreq->dmsg.args[i]) {
-            free(jreq->dmsg.args[i]);
-            jreq->dmsg.args[i] = NULL;
+    for (run = str; (c = *str) != '\0'; str++) {
+        if (c >= 0x20 && c != '"' && c != '\\' && c != '/')
+            continue;
+
+        json_write(writer, run, str - run);
+        run = str + 1;
+
+        switch (c) {
+            case '"':  json_write_literal(writer, "\\\""); break;
+            case '\\': json_write_literal(writer, "\\\\"); break;
+            case '/':  json_write_literal(writer, "\\/"); break;
+            case '\b': json_write_literal(writer, "\\b"); break;
+            case '\f': json_write_literal(writer, "\\f"); break;
+            case '\n': json_write_literal(writer, "\\n"); break;
+            case '\r': json_write_literal(writer, "\\r"); break;
+            case '\t': json_write_literal(writer, "\\t"); break;
+            default:
+                memcpy(escape, "\\u00", 4);
+                escape[4] = hex[c >> 4];
+                escape[5] = hex[c & 0xf];
+                json_write(writer, escape, sizeof(escape));
+                break;
+        }
+    }
+
+    json_write(writer, run, str - run);
+    json_write_literal(writer, "\"");
+}
+
+static void json_write_key(struct json_writer *writer, const char *key,
+                           bool first)
+{
+    if (first)
+        json_write_literal(writer, " ");
+    else
+        json_write_literal(writer, ", ");
+
+    json_write_string(writer, key);
+    json_write_literal(writer, ": ");
+}
+
+/* writes a value from a json-c tree in json-c's default (spaced) format */
+static void json_write_value(struct json_writer *writer,
+                             struct json_object *jobj)
+{
+    char number[24];
+    const char *text;
+    size_t i, len;
+    bool first;
+
+    switch (json_object_get_type(jobj)) {
+        case json_type_null:
+            json_write_literal(writer, "null");
+            break;
+
+        case json_type_boolean:
+            if (json_object_get_boolean(jobj))
+                json_write_literal(writer, "true");
+            else
+                json_write_literal(writer, "false");
+            break;
+
+        case json_type_int:
+            len = snprintf(number, sizeof(number), "%" PRId64,
+                           json_object_get_int64(jobj));
+            json_write(writer, number, len);
+            break;
+
+        case json_type_double:
+            /* json-c's double formatting has too many corner cases to copy */
+            text = json_object_to_json_string(jobj);
+            json_write(writer, text, strlen(text));
+            break;
+
+        case json_type_string:
+            json_write_string(writer, json_object_get_string(jobj));
+            break;
+
+        case json_type_object: {
+            first = true;
+            json_write_literal(writer, "{");
+
+            json_object_object_foreach(jobj, key, value) {
+                json_write_key(writer, key, first);
+                json_write_value(writer, value);
+                first = false;
+            }
+
+            json_write_literal(writer, " }");
+            break;
         }
+
+        case json_type_array:
+            json_write_literal(writer, "[");
+
+            len = json_object_array_length(jobj);
+            for (i=0; i < len; i++) {
+                if (i == 0)
+                    json_write_literal(writer, " ");
+                else
+                    json_write_literal(writer, ", ");
+
+                json_write_value(writer,
+                                 json_object_array_get_idx(jobj, i));
+            }
+
+            json_write_literal(writer, " ]");
+            break;
     }
+}
 
-    if (jreq->dmsg.destination)
-        free((char *) (jreq->dmsg.destination));
-    if (jreq->dmsg.interface)
-        free((char *) (jreq->dmsg.interface));
-    if (jreq->dmsg.path)
-        free((char *) (jreq->dmsg.path));
-    if (jreq->dmsg.member)
-        free((char *) (jreq->dmsg.member));
+static void json_write_field(struct json_writer *writer, const char *key,
+                             const char *value)
+{
+    json_write_key(writer, key, false);
 
-    free(jreq);
+    if (value)
+        json_write_string(writer, value);
+    else
+        json_write_literal(writer, "null");
 }
 
 /**
- * Takes a JSON response object and converts it into a JSON api response
- * object.
+ * Writes a JSON response object as JSON api text straight into a websockets
+ * message buffer, which grows to fit the response.  The arguments of the
+ * response are released.
  *
  * @param jrsp the JSON response object 
  *
- * @return JSON api `json_object`
+ * @return the message buffer, the caller holds the first reference.
  */ 
-struct json_object *convert_dbus_response(struct json_response *jrsp)
+struct ws_buffer *write_json_response(struct json_response *jrsp)
 {
-    struct json_object *jobj;
+    struct json_writer writer;
+    char number[16];
+    size_t len;
+
+    writer.size = JSON_WRITER_SIZE;
+    writer.buffer = malloc(sizeof *writer.buffer + LWS_PRE + writer.size);
+    if (!writer.buffer)
+        DBUS_BROKER_ERROR("Malloc Failed!");
+
+    writer.buffer->refs = 1;
+    writer.buffer->len = 0;
 
-    jobj = json_object_new_object();
-    json_object_object_add(jobj, "id", json_object_new_int(jrsp->id));
-    json_object_object_add(jobj, "type", json_object_new_string(jrsp->type));
+    json_write_literal(&writer, "{");
+    json_write_key(&writer, "id", true);
+    len = snprintf(number, sizeof(number), "%d", (int) jrsp->id);
+    json_write(&writer, number, len);
+    json_write_field(&writer, "type", jrsp->type);
 
     if (jrsp->response_to[0] != '\0') {
-        json_object_object_add(jobj, "response-to",
-                               json_object_new_string(jrsp->response_to));
+        json_write_field(&writer, "response-to", jrsp->response_to);
     } else {
-        json_object_object_add(jobj, "interface",
-                               json_object_new_string(jrsp->interface));
-        json_object_object_add(jobj, "path",
-                               json_object_new_string(jrsp->path));
-        json_object_object_add(jobj, "member",
-                               json_object_new_string(jrsp->member));
+        json_write_field(&writer, "interface", jrsp->interface);
+        json_write_field(&writer, "path", jrsp->path);
+        json_write_field(&writer, "member", jrsp->member);
     }
 
-    json_object_object_add(jobj, "args", jrsp->args);
-    return jobj;
+    json_write_key(&writer, "args", false);
+    json_write_value(&writer, jrsp->args);
+    json_write_literal(&writer, " }");
+
+    json_object_put(jrsp->args);
+    jrsp->args = NULL;
+
+    return writer.buffer;
 }
 
 /**
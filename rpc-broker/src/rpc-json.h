@@ -28,6 +28,22 @@
 #include <json.h>
 
 
+#define JSON_ARENA_SIZE  2048  /* first block, enough for most requests */
+#define JSON_ARENA_ALIGN   16
+
+/**
+ * @brief a bump allocator owning everything made for one websocket request,
+ * the request, its arguments and its response all go in a single free.  The
+ * first block is the arena itself, blocks added when it fills up hang off
+ * `next`.
+ */
+struct json_arena {
+    struct json_arena *next;
+    size_t used;
+    size_t size;
+    unsigned char data[];
+};
+
 /**
  * @brief contains JSON request connection data.
  */
@@ -35,6 +51,8 @@ struct json_request {
     uint32_t id;
     DBusConnection *conn;
     struct lws *wsi;
+    struct json_arena *arena;
+    struct json_object *jargs;
     struct dbus_message dmsg;
 };
 
@@ -56,6 +74,19 @@ struct json_response {
     struct json_object *args;
 };
 
+#define JSON_WRITER_SIZE 1024  /* initial payload size of a response buffer */
+
+struct ws_buffer;
+
+/**
+ * @brief JSON text being written into a websockets message buffer, `size` is
+ * the payload capacity of the buffer.
+ */
+struct json_writer {
+    size_t size;
+    struct ws_buffer *buffer;
+};
+
 static const char json_dbus_types[] = {
     [json_type_boolean] = 'b',
     [json_type_double]  = 'd',
@@ -65,15 +96,32 @@ static const char json_dbus_types[] = {
 
 
 // src/rpc-json.c
-struct json_response *init_jrsp(void);
+struct json_arena *new_json_arena(void);
+
+void *json_arena_alloc(struct json_arena *arena, size_t size);
+
+char *json_arena_strdup(struct json_arena *arena, const char *str);
+
+void free_json_arena(struct json_arena *arena);
+
+struct json_response *init_jrsp(struct json_arena *arena);
+
+struct json_response *make_json_response(struct json_arena *arena, uint32_t id,
+                                         DBusMessage *msg);
+
+struct json_response *make_json_ack(struct json_arena *arena, uint32_t id);
 
 struct json_response *make_json_request(struct json_request *jreq);
 
+DBusPendingCall *send_json_request(struct json_request *jreq);
+
 void load_json_response(DBusMessage *msg, struct json_response *jrsp);
 
 struct json_request *convert_json_request(char *raw_json_req);
 
-struct json_object *convert_dbus_response(struct json_response *jrsp);
+int set_json_args(struct json_request *jreq, const char *signature);
+
+struct ws_buffer *write_json_response(struct json_response *jrsp);
 
 void add_jobj(struct json_object *args, char *key, struct json_object *jobj);
 
@@ -29,132 +29,159 @@
 #include "rpc-broker.h"
 
 
-/**
- * Recursively traverse the XML DocTree of a given dbus destination to find the
- * target property.  This function is arranged in a generic/opaque manner where
- * you can use it for any xml-property you want.
- *
- * @param target the name of the xml key being searching for.
- * @param property the xml api nest of nodes.
- * @param node the xml api top level node.
+/* attribute of the element the reader is on, compared against `value` */
+static bool xml_attribute_is(xmlTextReaderPtr reader, const xmlChar *attribute,
+                             const char *value)
+{
+    xmlChar *prop;
+    bool match;
+
+    prop = xmlTextReaderGetAttribute(reader, attribute);
+    match = prop && !strcmp((const char *) prop, value);
+
+    if (prop)
+        xmlFree(prop);
+
+    return match;
+}
+
+/*
+ * Reads the type of an "in" argument into the member's signature.  A member's
+ * signature is made up of its leading "in" arguments, anything else ends it.
  *
- * @return xml api node of the property being searched
+ * @return false once the signature is complete.
  */
-xmlNodePtr find_xml_property(const char *target, const xmlChar *property,
-                             xmlNodePtr node)
+static bool read_xml_argument(xmlTextReaderPtr reader, char *signature,
+                              int *idx)
 {
-    const xmlChar *name;
+    xmlChar *type;
 
-    if (node == NULL)
-        return NULL;
+    if (!xml_attribute_is(reader, XML_DIRECTION_PROPERTY, XML_IN_FIELD))
+        return false;
 
-    name = NULL;
-    name = xmlGetProp(node, property);
+    type = xmlTextReaderGetAttribute(reader, (const xmlChar *) XML_TYPE_FIELD);
 
-    if (name && !strcmp((const char *) name, target)) {
-        xmlFree((xmlChar *) name);
-        return xmlFirstElementChild(node);
+    if (type) {
+        if (*idx < DBUS_MAX_ARG_LEN - 1)
+            signature[(*idx)++] = type[0];
+        xmlFree(type);
     }
 
-    if (name)
-        xmlFree((xmlChar *) name);
+    signature[*idx] = '\0';
 
-    node = find_xml_property(target, property, xmlNextElementSibling(node));
-
-    return node;
+    return true;
 }
 
 /**
  * The main function for handling the dbus XML signature parsing.  Parsing XML
- * schema for each dbus request is necessary because there is no way to rely
- * on the JSON object returning the correct argument type required for each
- * request.  The libjson-c doesn't handle signedness, thus dbus will fail if
- * adding a request argument based solely on `json_object_get_type`
+ * schema is necessary because there is no way to rely on the JSON object
+ * returning the correct argument type required for each request.  The
+ * libjson-c doesn't handle signedness, thus dbus will fail if adding a
+ * request argument based solely on `json_object_get_type`
+ *
+ * The introspection data is read in a single streaming pass and the signature
+ * of every member of every interface is cached, the object is then marked as
+ * introspected.
  *
- * @param xml_dump the xml api main object.
- * @param args an array to store the return types. 
- * @param interface the name of the dbus interface being queried.
- * @param member the name of the dbus method being queried.
+ * @param xml_dump the introspection data of the object.
+ * @param destination the destination the object belongs to.
+ * @param path the object path that was introspected.
  *
- * @return the number of types in a signature.
+ * @return the number of members cached, -1 if the xml is invalid.
  */
-int retrieve_xml_signature(const xmlChar *xml_dump, char *args,
-                           const char *interface, const char *member)
+int cache_xml_signatures(const char *xml_dump, const char *destination,
+                         const char *path)
 {
-    int idx;
-    char *error;
-    const xmlChar *name, *type;
-
-    idx = 0;
-    error = NULL;
-    name = NULL;
-    type = NULL;
-
-    xmlDocPtr doc;
-    xmlNodePtr root, interface_node, member_node;
-
-    doc = xmlParseDoc(xml_dump);
-    if (doc == NULL) {
-        error = "doc";
-        goto xml_error;
+    int ret, idx, count;
+    bool in_args;
+    char signature[DBUS_MAX_ARG_LEN];
+    xmlChar *interface, *member;
+    xmlTextReaderPtr reader;
+
+    trim_signature_cache();
+
+    reader = xmlReaderForMemory(xml_dump, strlen(xml_dump), NULL, NULL,
+                                XML_PARSE_NONET);
+    if (!reader) {
+        DBUS_BROKER_WARNING("Invalid xml-doc <Path:%s>", path);
+        return -1;
     }
 
-    root = xmlDocGetRootElement(doc);
+    idx = 0;
+    count = 0;
+    in_args = false;
+    interface = NULL;
+    member = NULL;
+
+    while ((ret = xmlTextReaderRead(reader)) == 1) {
+
+        if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT)
+            continue;
+
+        switch (xmlTextReaderDepth(reader)) {
+
+            case (1):
+            case (2):
+                /* the previous member is complete */
+                if (member) {
+                    signature_cache_insert(destination, path,
+                                           (const char *) interface,
+                                           (const char *) member, signature);
+                    xmlFree(member);
+                    member = NULL;
+                    count++;
+                }
+
+                if (xmlTextReaderDepth(reader) == 1) {
+                    if (interface)
+                        xmlFree(interface);
+                    interface = NULL;
+
+                    if (xmlStrEqual(xmlTextReaderConstName(reader),
+                                    (const xmlChar *) XML_INTERFACE_FIELD))
+                        interface = xmlTextReaderGetAttribute(reader,
+                                                              XML_NAME_PROPERTY);
+                } else if (interface) {
+                    member = xmlTextReaderGetAttribute(reader,
+                                                       XML_NAME_PROPERTY);
+                    idx = 0;
+                    in_args = true;
+                    signature[0] = '\0';
+                }
+                break;
 
-    if (root == NULL) {
-        error = "doc";
-        goto xml_error;
-    }
+            case (3):
+                if (member && in_args)
+                    in_args = read_xml_argument(reader, signature, &idx);
+                break;
 
-    /* Find the interface for the request */
-    interface_node = find_xml_property(interface, XML_NAME_PROPERTY,
-                                       xmlFirstElementChild(root));
-    if (interface_node == NULL) {
-        error = "interface";
-        goto xml_error;
+            default:
+                break;
+        }
     }
 
-    /* Find the method being requested */
-    member_node = find_xml_property(member, XML_NAME_PROPERTY, interface_node);
-    if (member_node == NULL) {
-        error = "member";
-        goto xml_error;
+    if (member && ret == 0) {
+        signature_cache_insert(destination, path, (const char *) interface,
+                               (const char *) member, signature);
+        count++;
     }
 
-    name = xmlGetProp(member_node, XML_DIRECTION_PROPERTY);
+    if (member)
+        xmlFree(member);
 
-    /* Loop over method properties looking for "in" (holds the signature) */
-    while (name && !strcmp((const char *) name, XML_IN_FIELD)) {
-        xmlFree((xmlChar *) name);
-        name = NULL;
-        type = xmlGetProp(member_node, (const xmlChar *) XML_TYPE_FIELD);
+    if (interface)
+        xmlFree(interface);
 
-        if (type) {
-            args[idx++] = type[0];
-            xmlFree((xmlChar *) type);
-            type = NULL;
-        }
+    xmlFreeTextReader(reader);
 
-        member_node = xmlNextElementSibling(member_node);
-        name = xmlGetProp(member_node, XML_DIRECTION_PROPERTY);
+    if (ret < 0) {
+        DBUS_BROKER_WARNING("Invalid xml-doc <Path:%s>", path);
+        return -1;
     }
 
-xml_error:
-
-    if (error)
-        DBUS_BROKER_WARNING("Invalid xml-%s <Inteface:%s and Member:%s>",
-                             error, interface, member);
-
-    if (name)
-        xmlFree((xmlChar *) name);
-
-    if (type)
-        xmlFree((xmlChar *) type);
-
-    args[idx] = '\0';
-    xmlFreeDoc(doc);
+    signature_cache_insert(destination, path, NULL, NULL, "");
 
-    return idx;
+    return count;
 }
 
 static inline void add_json_array(struct json_object *args, char *key,
@@ -29,23 +29,20 @@
 #include <dbus/dbus.h>
 #include <json.h>
 #include <libxml/parser.h>
+#include <libxml/xmlreader.h>
 
 
-#define XML_SIGNATURE_MAX 16
-
 static const xmlChar XML_NAME_PROPERTY[]      = "name";
 static const xmlChar XML_DIRECTION_PROPERTY[] = "direction";
 
 static const char XML_IN_FIELD[]           = "in";
 static const char XML_TYPE_FIELD[]         = "type";
+static const char XML_INTERFACE_FIELD[]    = "interface";
 
 
 /* src/signature.c */
-xmlNodePtr find_xml_property(const char *target, const xmlChar *property,
-                             xmlNodePtr node);
-
-int retrieve_xml_signature(const xmlChar *xml_dump, char *args,
-                           const char *interface, const char *member);
+int cache_xml_signatures(const char *xml_dump, const char *destination,
+                         const char *path);
 
 void parse_dbus_dict(struct json_object *args, char *key, DBusMessageIter *iter);
 
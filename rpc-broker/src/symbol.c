@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2019 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file symbol.c
+ * @author Tim Konick <konickt@ainfosec.com>
+ * @date March 4, 2019
+ * @brief Symbol table.
+ *
+ * Every destination, interface, member, path and uuid a policy names is
+ * interned here once, request headers are resolved against the same table so
+ * a rule only ever compares integers.  The policy builder interns while the
+ * event-loops and raw-dbus workers look symbols up, hence the rwlock.
+ */
+
+#include "rpc-broker.h"
+
+
+static pthread_rwlock_t symbol_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct symbol_table symbols;
+
+static inline uint32_t hash_symbol(const char *name)
+{
+    uint32_t hash;
+
+    hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/* finds the slot of a name, or the empty slot it belongs in */
+static size_t find_symbol_slot(const char *name, uint32_t hash)
+{
+    size_t i;
+
+    i = hash & (symbols.slot_count - 1);
+    while (symbols.slots[i] != SYMBOL_NONE) {
+        if (!strcmp(symbols.names[symbols.slots[i]], name))
+            break;
+
+        i = (i + 1) & (symbols.slot_count - 1);
+    }
+
+    return i;
+}
+
+static void grow_symbol_slots(void)
+{
+    uint32_t *slots;
+    size_t count, i, j;
+
+    slots = symbols.slots;
+    count = symbols.slot_count;
+
+    symbols.slot_count = count ? count * 2 : SYMBOL_TABLE_SLOTS;
+    symbols.slots = calloc(symbols.slot_count, sizeof(uint32_t));
+    if (!symbols.slots)
+        DBUS_BROKER_ERROR("Calloc failed");
+
+    for (i=0; i < count; i++) {
+        if (slots[i] == SYMBOL_NONE)
+            continue;
+
+        j = hash_symbol(symbols.names[slots[i]]) & (symbols.slot_count - 1);
+        while (symbols.slots[j] != SYMBOL_NONE)
+            j = (j + 1) & (symbols.slot_count - 1);
+
+        symbols.slots[j] = slots[i];
+    }
+
+    free(slots);
+}
+
+/**
+ * Interns a string, only the policy is meant to add symbols.  Requests look
+ * their fields up instead, so clients can't grow the table.
+ *
+ * @param name the string to intern.
+ *
+ * @return the id of the symbol, SYMBOL_NONE for NULL or an empty string.
+ */
+uint32_t intern_symbol(const char *name)
+{
+    uint32_t id, hash;
+    size_t slot;
+
+    if (!name || name[0] == '\0')
+        return SYMBOL_NONE;
+
+    id = lookup_symbol(name);
+    if (id != SYMBOL_NONE)
+        return id;
+
+    hash = hash_symbol(name);
+
+    pthread_rwlock_wrlock(&symbol_lock);
+
+    /* id 0 is reserved for SYMBOL_NONE */
+    if (symbols.count == 0)
+        symbols.count = 1;
+
+    if ((symbols.count + 1) * 2 > symbols.slot_count)
+        grow_symbol_slots();
+
+    slot = find_symbol_slot(name, hash);
+
+    /* another thread may have interned it meanwhile */
+    if (symbols.slots[slot] != SYMBOL_NONE) {
+        id = symbols.slots[slot];
+        goto interned;
+    }
+
+    if (symbols.count >= symbols.size) {
+        symbols.size = symbols.size ? symbols.size * 2 : SYMBOL_TABLE_SLOTS;
+        symbols.names = realloc(symbols.names, symbols.size * sizeof(char *));
+        if (!symbols.names)
+            DBUS_BROKER_ERROR("Realloc failed");
+    }
+
+    id = symbols.count;
+    symbols.names[id] = strdup(name);
+    if (!symbols.names[id])
+        DBUS_BROKER_ERROR("Malloc Failed!");
+
+    symbols.slots[slot] = id;
+    __atomic_store_n(&symbols.count, id + 1, __ATOMIC_RELEASE);
+
+interned:
+
+    pthread_rwlock_unlock(&symbol_lock);
+
+    return id;
+}
+
+/**
+ * Looks up the id of a string without interning it.
+ *
+ * @param name the string to look up.
+ *
+ * @return the id of the symbol, SYMBOL_NONE if it was never interned.
+ */
+uint32_t lookup_symbol(const char *name)
+{
+    uint32_t id, hash;
+
+    if (!name || name[0] == '\0')
+        return SYMBOL_NONE;
+
+    hash = hash_symbol(name);
+
+    pthread_rwlock_rdlock(&symbol_lock);
+    id = symbols.slot_count ? symbols.slots[find_symbol_slot(name, hash)] :
+                              SYMBOL_NONE;
+    pthread_rwlock_unlock(&symbol_lock);
+
+    return id;
+}
+
+/**
+ * Returns the string of a symbol, it lives until the table is free'd.
+ *
+ * @param id the id of the symbol.
+ *
+ * @return the string or NULL for SYMBOL_NONE.
+ */
+const char *symbol_name(uint32_t id)
+{
+    const char *name;
+
+    name = NULL;
+
+    pthread_rwlock_rdlock(&symbol_lock);
+    if (id != SYMBOL_NONE && id < symbols.count)
+        name = symbols.names[id];
+    pthread_rwlock_unlock(&symbol_lock);
+
+    return name;
+}
+
+/**
+ * Returns the version of the symbol table, it only ever grows.  A lookup made
+ * at an older version may have missed symbols interned since.
+ */
+uint32_t symbol_table_version(void)
+{
+    uint32_t count;
+
+    count = __atomic_load_n(&symbols.count, __ATOMIC_ACQUIRE);
+
+    return count ? count : 1;
+}
+
+/**
+ * Resolves the destination, interface, member and path of a request to
+ * symbol ids.  `is_request_allowed` does so on a verdict cache miss, for a
+ * message that was never resolved (`symbol_version` 0) or was resolved
+ * before a newer policy interned symbols.
+ *
+ * @param dmsg the dbus request message fields.
+ */
+void resolve_message_symbols(struct dbus_message *dmsg)
+{
+    /* the version is read first, so it never claims too much */
+    dmsg->symbol_version = symbol_table_version();
+    dmsg->destination_id = lookup_symbol(dmsg->destination);
+    dmsg->interface_id = lookup_symbol(dmsg->interface);
+    dmsg->member_id = lookup_symbol(dmsg->member);
+    dmsg->path_id = lookup_symbol(dmsg->path);
+}
+
+/**
+ * Free's every symbol, nothing may look one up afterwards.
+ */
+void free_symbol_table(void)
+{
+    uint32_t i;
+
+    pthread_rwlock_wrlock(&symbol_lock);
+
+    for (i=1; i < symbols.count; i++)
+        free(symbols.names[i]);
+
+    free(symbols.names);
+    free(symbols.slots);
+    memset(&symbols, 0, sizeof(symbols));
+
+    pthread_rwlock_unlock(&symbol_lock);
+}
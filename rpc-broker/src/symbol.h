@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2019 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file symbol.h
+ * @author Tim Konick <konickt@ainfosec.com>
+ * @date March 4, 2019
+ * @brief Symbol table declarations.
+ *
+ * The broker-wide table of interned strings that policy rules and request
+ * headers are matched through.
+ */
+
+#define SYMBOL_NONE        0   /* the id of NULL, the empty string and any */
+                               /* string that was never interned */
+#define SYMBOL_TABLE_SLOTS 256 /* initial slots, must be a power of two */
+
+/**
+ * @brief the symbol table.
+ *
+ * `names` is indexed by symbol id, `slots` is an open addressed hash of those
+ * ids.  Symbols are never removed, an id stays valid for as long as the
+ * broker runs.  `count` doubles as the version of the table.
+ */
+struct symbol_table {
+    uint32_t count;
+    size_t size;
+    char **names;
+    size_t slot_count;
+    uint32_t *slots;
+};
+
+/* src/symbol.c */
+uint32_t intern_symbol(const char *name);
+
+uint32_t lookup_symbol(const char *name);
+
+const char *symbol_name(uint32_t id);
+
+uint32_t symbol_table_version(void);
+
+void resolve_message_symbols(struct dbus_message *dmsg);
+
+void free_symbol_table(void);
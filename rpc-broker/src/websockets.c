@@ -29,59 +29,273 @@
 
 
 /**
- * Converts a JSON response object into raw bytes to send back over a
- * websockets connection.
+ * Creates a shared message buffer holding a copy of the payload, the caller
+ * holds the first reference.
+ *
+ * @param payload the bytes of the message.
+ * @param len the length of the payload.
+ *
+ * @return the message buffer.
+ */
+struct ws_buffer *new_ws_buffer(const char *payload, size_t len)
+{
+    struct ws_buffer *buffer;
+
+    buffer = malloc(sizeof *buffer + LWS_PRE + len);
+    if (!buffer)
+        DBUS_BROKER_ERROR("Malloc Failed!");
+
+    buffer->refs = 1;
+    buffer->len = len;
+    memcpy(buffer->data + LWS_PRE, payload, len);
+
+    return buffer;
+}
+
+/**
+ * Drops a reference to a message buffer, freeing it with the last one.
+ *
+ * @param buffer the message buffer.
+ */
+void release_ws_buffer(struct ws_buffer *buffer)
+{
+    if (--buffer->refs == 0)
+        free(buffer);
+}
+
+/**
+ * Converts a JSON response object into a message buffer to send back over a
+ * websockets connection.  The text is written straight into the buffer, so
+ * responses of any size take a single copy.
  *
  * @param jrsp the JSON response to convert.
  * 
- * @return the raw bytes to send back or NULL.
+ * @return the message buffer (holding one reference) or NULL.
  */
-char *prepare_json_reply(struct json_response *jrsp)
+struct ws_buffer *prepare_json_reply(struct json_response *jrsp)
 {
-    char *reply;
-    struct json_object *jobj;
+    if (!jrsp->args)
+        return NULL;
 
-    jobj = convert_dbus_response(jrsp);
+    return write_json_response(jrsp);
+}
 
-    if (!jobj)
-        return NULL;
+/*
+ * Pauses reading requests off a session while its queue is above the high
+ * water mark (until it drains to the low water mark) or while it has too many
+ * calls in flight, and resumes it otherwise.
+ */
+static void update_ws_flow(struct lws *wsi, struct ws_session *session)
+{
+    bool pause;
 
-    reply = malloc(WS_RING_BUFFER_MEMBER_SIZE);
-    if (!reply)
-        DBUS_BROKER_ERROR("Malloc Failed!");
+    if (session->count >= WS_QUEUE_HIGH_WATER)
+        session->throttled = true;
+    else if (session->count <= WS_QUEUE_LOW_WATER)
+        session->throttled = false;
+
+    pause = session->throttled || session->in_flight >= WS_MAX_IN_FLIGHT;
+    if (pause != session->paused) {
+        session->paused = pause;
+        lws_rx_flow_control(wsi, !pause);
+    }
+}
+
+/**
+ * Queues a reply or signal on the session of a websocket client and asks for
+ * a writeable callback.  The session takes its own reference to the buffer.
+ * Once the queue is above the high water mark the session stops being read
+ * from until the client catches up.
+ *
+ * @param wsi the websocket the message is going to.
+ * @param buffer the serialized message.
+ *
+ * @return 0 on success, -1 if the queue is full and the message was dropped.
+ */
+int ws_queue_buffer(struct lws *wsi, struct ws_buffer *buffer)
+{
+    struct ws_session *session;
+
+    session = (struct ws_session *) lws_wsi_user(wsi);
+    if (!session)
+        return -1;
+
+    if (session->count == WS_QUEUE_LEN) {
+        session->dropped++;
+        DBUS_BROKER_WARNING("WS session queue full <%zu dropped>",
+                            session->dropped);
+        return -1;
+    }
+
+    buffer->refs++;
+    session->queue[(session->head + session->count) % WS_QUEUE_LEN] = buffer;
+    session->count++;
+
+    update_ws_flow(wsi, session);
+    lws_callback_on_writable(wsi);
+
+    return 0;
+}
+
+/**
+ * Queues a signal on a websocket session, a session whose match rules match
+ * the same signal more than once still only gets it once.
+ *
+ * @param wsi the websocket the signal is going to.
+ * @param buffer the serialized signal, shared by every subscriber.
+ * @param serial identifies the signal being fanned out.
+ *
+ * @return 0 on success, -1 if the signal was dropped.
+ */
+int ws_queue_signal(struct lws *wsi, struct ws_buffer *buffer, uint32_t serial)
+{
+    struct ws_session *session;
+
+    session = (struct ws_session *) lws_wsi_user(wsi);
+    if (!session)
+        return -1;
 
-    snprintf(reply, WS_RING_BUFFER_MEMBER_SIZE - 1, "%s",
-             json_object_to_json_string(jobj));
+    if (session->signal_serial == serial)
+        return 0;
 
-    json_object_put(jobj);
+    session->signal_serial = serial;
 
-    return reply;
+    return ws_queue_buffer(wsi, buffer);
+}
+
+/*
+ * Writes the next fragment of a message buffer, starting `offset` bytes into
+ * its payload.  Returns the length written or -1.
+ */
+static int write_ws_fragment(struct lws *wsi, struct ws_buffer *buffer,
+                             size_t offset)
+{
+    unsigned char saved[LWS_PRE];
+    unsigned char *start;
+    size_t len;
+    int flags;
+    int ret;
+
+    start = buffer->data + LWS_PRE + offset;
+    len = buffer->len - offset;
+    if (len > WS_FRAGMENT_SIZE)
+        len = WS_FRAGMENT_SIZE;
+
+    flags = offset ? LWS_WRITE_CONTINUATION : LWS_WRITE_TEXT;
+    if (offset + len < buffer->len)
+        flags |= LWS_WRITE_NO_FIN;
+
+    /*
+     * lws builds the frame header in the LWS_PRE bytes ahead of a fragment,
+     * past the first one that's payload other sessions may still have to send
+     */
+    if (offset)
+        memcpy(saved, start - LWS_PRE, LWS_PRE);
+
+    ret = lws_write(wsi, start, len, flags);
+
+    if (offset)
+        memcpy(start - LWS_PRE, saved, LWS_PRE);
+
+    return ret < 0 ? -1 : (int) len;
+}
+
+/*
+ * Writes up to WS_WRITE_BATCH queued messages, as long as the socket takes
+ * them, and resumes reading a throttled session once it has drained.
+ *
+ * @return 0 on success, -1 if the write failed and the session should close.
+ */
+static int write_ws_session(struct lws *wsi, struct ws_session *session)
+{
+    struct ws_buffer *buffer;
+    int i, len;
+
+    for (i=0; i < WS_WRITE_BATCH && session->count > 0; i++) {
+        if (i > 0 && lws_send_pipe_choked(wsi))
+            break;
+
+        buffer = session->queue[session->head];
+        len = write_ws_fragment(wsi, buffer, session->sent);
+        if (len < 0)
+            return -1;
+
+        session->sent += len;
+        if (session->sent < buffer->len)
+            continue;
+
+        release_ws_buffer(buffer);
+        session->sent = 0;
+        session->queue[session->head] = NULL;
+        session->head = (session->head + 1) % WS_QUEUE_LEN;
+        session->count--;
+    }
+
+    update_ws_flow(wsi, session);
+
+    if (session->count > 0)
+        lws_callback_on_writable(wsi);
+
+    return 0;
+}
+
+/*
+ * Cancels the calls a session still has in flight, releasing the pending
+ * call also frees its `ws_pending`.
+ */
+static void cancel_ws_requests(struct ws_session *session)
+{
+    struct ws_pending *pending;
+    DBusPendingCall *call;
+
+    while ((pending = session->pending) != NULL) {
+        session->pending = pending->next;
+        call = pending->call;
+        dbus_pending_call_cancel(call);
+        dbus_pending_call_unref(call);
+        ws_requests_in_flight--;
+    }
+
+    session->in_flight = 0;
+}
+
+static void free_ws_session(struct ws_session *session)
+{
+    cancel_ws_requests(session);
+
+    session->sent = 0;
+    while (session->count > 0) {
+        release_ws_buffer(session->queue[session->head]);
+        session->queue[session->head] = NULL;
+        session->head = (session->head + 1) % WS_QUEUE_LEN;
+        session->count--;
+    }
 }
 
 static int ws_server_callback(struct lws *wsi, enum lws_callback_reasons reason,
                               void *user, void *in, size_t len)
 {
-    char *rsp;
+    struct ws_session *session;
+
+    session = (struct ws_session *) user;
 
     switch (reason) {
 
         case LWS_CALLBACK_RECEIVE: {
-            memset(user, '\0', WS_USER_MEM_SIZE);
-            memcpy(user, in, len);
-            if (ws_request_handler(wsi, user) == 0)
-                lws_callback_on_writable(wsi);
+            if (len >= sizeof(session->request)) {
+                DBUS_BROKER_WARNING("WS request too large <%zu>", len);
+                break;
+            }
+
+            memcpy(session->request, in, len);
+            session->request[len] = '\0';
+            ws_request_handler(wsi, session->request);
             break;
         }
 
         case LWS_CALLBACK_SERVER_WRITEABLE: {
-            if (lws_ring_get_count_waiting_elements(ring, NULL) > 0) {
-                rsp = (char *) lws_ring_get_element(ring, NULL);
-                lws_ring_consume(ring, NULL, NULL, 1);
-                memcpy(user + LWS_SEND_BUFFER_PRE_PADDING, rsp, strlen(rsp));
-                lws_write(wsi, user + LWS_SEND_BUFFER_PRE_PADDING,
-                          strlen(rsp), LWS_WRITE_TEXT);
-                lws_callback_on_writable(wsi);
-            }
+            if (write_ws_session(wsi, session) < 0)
+                return -1;
             break;
         }
 
@@ -92,8 +306,13 @@ static int ws_server_callback(struct lws *wsi, enum lws_callback_reasons reason,
 
         case LWS_CALLBACK_CLOSED:
         case LWS_CALLBACK_WSI_DESTROY: {
+            /* only this session's messages and signals go away */
+            if (!session)
+                break;
+
             DBUS_BROKER_WARNING("WS client session closed %s", "");
-            free_dlinks();
+            free_ws_session(session);
+            remove_ws_matches(wsi);
             break;
         }
 
@@ -112,32 +331,307 @@ static struct lws_protocols server_protos[] = {
 };
 
 /**
- * Initialize a Websockets connection object.
+ * Initialize a Websockets connection object.  When libwebsockets is built
+ * with libuv the context runs on the given loop, otherwise it has to be
+ * serviced with `lws_service`.
  *
+ * @param loop the libuv loop of the websockets server.
  * @param port the port to bind to.
  *
  * @return the Websockets api context object
  */
-struct lws_context *create_ws_context(int port)
+struct lws_context *create_ws_context(uv_loop_t *loop, int port)
 {
     struct lws_context_creation_info info;
     struct lws_context *context;
+#ifdef LWS_WITH_LIBUV
+    void *foreign_loops[1];
+#endif
 
-    ring = lws_ring_create(WS_RING_BUFFER_MEMBER_SIZE,
-                           WS_RING_BUFFER_MEMBER_NUM, NULL);
-    server_protos[0].per_session_data_size = WS_USER_MEM_SIZE;
+    server_protos[0].per_session_data_size = sizeof(struct ws_session);
     memset(&info, 0, sizeof(info));
     info.port = port;
     info.protocols = server_protos;
 
+#ifdef LWS_WITH_LIBUV
+    foreign_loops[0] = loop;
+    info.options |= LWS_SERVER_OPTION_LIBUV;
+    info.foreign_loops = foreign_loops;
+#endif
+
     context = NULL;
     context = lws_create_context(&info);
 
     return context;
 }
 
+/*
+ * Converts a JSON response into a reply and queues it on the session, the
+ * response itself goes with its request's arena.
+ */
+static int queue_json_response(struct lws *wsi, struct json_response *jrsp)
+{
+    struct ws_buffer *buffer;
+    int ret;
+
+    if (!jrsp)
+        return -1;
+
+    buffer = prepare_json_reply(jrsp);
+
+    if (!buffer)
+        return -1;
+
+    ret = ws_queue_buffer(wsi, buffer);
+    release_ws_buffer(buffer);
+
+    return ret;
+}
+
+/* puts a call in flight on the session that made it */
+static void track_ws_pending(struct lws *wsi, struct ws_session *session,
+                             struct ws_pending *pending)
+{
+    pending->prev = NULL;
+    pending->next = session->pending;
+    if (session->pending)
+        session->pending->prev = pending;
+    session->pending = pending;
+
+    session->in_flight++;
+    ws_requests_in_flight++;
+    update_ws_flow(wsi, session);
+}
+
+/* takes a call whose reply arrived off its session */
+static void untrack_ws_pending(struct ws_pending *pending)
+{
+    struct ws_session *session;
+
+    session = pending->session;
+
+    if (pending->prev)
+        pending->prev->next = pending->next;
+    else
+        session->pending = pending->next;
+    if (pending->next)
+        pending->next->prev = pending->prev;
+
+    session->in_flight--;
+    ws_requests_in_flight--;
+}
+
+/*
+ * Notify function of a pending call, queues the reply (or nothing, if the
+ * call failed or timed out) on the session that made the request.
+ */
+static void complete_ws_request(DBusPendingCall *call, void *data)
+{
+    struct ws_pending *pending;
+    struct ws_session *session;
+    DBusMessage *msg;
+
+    pending = (struct ws_pending *) data;
+    session = pending->session;
+
+    untrack_ws_pending(pending);
+
+    msg = dbus_pending_call_steal_reply(call);
+    queue_json_response(pending->wsi,
+                        make_json_response(pending->arena, pending->id, msg));
+    if (msg)
+        dbus_message_unref(msg);
+
+    update_ws_flow(pending->wsi, session);
+
+    /* the last reference, `pending` and the request arena go with it */
+    dbus_pending_call_unref(call);
+}
+
+/* free function of a pending call's data */
+static void free_ws_pending(void *data)
+{
+    free_json_arena(((struct ws_pending *) data)->arena);
+}
+
+/*
+ * Sends the dbus call of a request and tracks it on the session until the
+ * reply comes back.  On success the pending call owns the request's arena.
+ *
+ * @return 0 on success, -1 if the call couldn't be sent.
+ */
+static int start_ws_request(struct lws *wsi, struct json_request *jreq)
+{
+    struct ws_session *session;
+    struct ws_pending *pending;
+    DBusPendingCall *call;
+
+    session = (struct ws_session *) lws_wsi_user(wsi);
+    if (!session)
+        return -1;
+
+    call = send_json_request(jreq);
+    if (!call)
+        return -1;
+
+    pending = json_arena_alloc(jreq->arena, sizeof *pending);
+    pending->arena = jreq->arena;
+    pending->id = jreq->id;
+    pending->wsi = wsi;
+    pending->session = session;
+    pending->call = call;
+    track_ws_pending(wsi, session, pending);
+
+    if (!dbus_pending_call_set_notify(call, complete_ws_request, pending,
+                                      free_ws_pending))
+        DBUS_BROKER_ERROR("Malloc Failed!");
+
+    return 0;
+}
+
+static bool is_match_request(struct json_request *jreq, const char *member)
+{
+    return jreq->dmsg.member && !strcmp(jreq->dmsg.member, member) &&
+           jreq->dmsg.arg_number > 0 && jreq->dmsg.arg_sig[0] == 's' &&
+           jreq->dmsg.args[0];
+}
+
+/*
+ * Filters a request whose arguments are converted and sends it on, the
+ * request is freed unless its dbus call is in flight.
+ *
+ * @return 0 on success -1 otherwise
+ */
+static int dispatch_ws_request(struct lws *wsi, struct json_request *jreq,
+                               int domain)
+{
+    if (is_request_allowed(&jreq->dmsg, true, domain) == false) {
+        free_json_request(jreq);
+        return -1;
+    }
+
+    jreq->wsi = wsi;
+
+    /*
+     * Subscriptions are kept by the broker and shared between sessions, the
+     * bus only sees a rule's first AddMatch and last RemoveMatch.
+     */
+    if (is_match_request(jreq, "AddMatch")) {
+        if (add_ws_match(jreq->conn, jreq->dmsg.args[0], wsi) < 0)
+            DBUS_BROKER_WARNING("response to <%d> request failed <%s>",
+                                jreq->id, DBUS_ERROR_MATCH_RULE_INVALID);
+        else
+            queue_json_response(wsi, make_json_ack(jreq->arena, jreq->id));
+    } else if (is_match_request(jreq, "RemoveMatch")) {
+        if (remove_ws_match(jreq->conn, jreq->dmsg.args[0], wsi) < 0)
+            DBUS_BROKER_WARNING("response to <%d> request failed <%s>",
+                                jreq->id, DBUS_ERROR_MATCH_RULE_NOT_FOUND);
+        else
+            queue_json_response(wsi, make_json_ack(jreq->arena, jreq->id));
+    } else if (jreq->dmsg.member && !strcmp(jreq->dmsg.member, "Hello")) {
+        /* answered from the connection itself, there's nothing to wait on */
+        queue_json_response(wsi, make_json_request(jreq));
+    } else if (start_ws_request(wsi, jreq) == 0)
+        return 0;
+
+    free_json_request(jreq);
+
+    return 0;
+}
+
+/*
+ * Notify function of the Introspect call of a request, the signatures are
+ * cached and the request carries on as if they had been there all along.
+ */
+static void complete_ws_introspect(DBusPendingCall *call, void *data)
+{
+    struct ws_pending *pending;
+    struct json_request *jreq;
+    DBusMessage *msg;
+
+    pending = (struct ws_pending *) data;
+
+    untrack_ws_pending(pending);
+
+    /* the request outlives the call from here on */
+    jreq = pending->jreq;
+    pending->jreq = NULL;
+
+    msg = dbus_pending_call_steal_reply(call);
+
+    if (set_json_args(jreq, complete_introspect(jreq, msg)) < 0) {
+        DBUS_BROKER_WARNING("<Error json-request> %d", jreq->id);
+        free_json_request(jreq);
+    } else
+        dispatch_ws_request(pending->wsi, jreq, pending->domain);
+
+    if (msg)
+        dbus_message_unref(msg);
+
+    update_ws_flow(pending->wsi, pending->session);
+
+    dbus_pending_call_unref(call);
+}
+
+/* free function of an Introspect call's data */
+static void free_ws_introspect(void *data)
+{
+    struct ws_pending *pending;
+
+    pending = (struct ws_pending *) data;
+
+    if (pending->jreq)
+        free_json_request(pending->jreq);
+
+    free(pending);
+}
+
+/*
+ * Introspects the object of a request the signature cache knows nothing of,
+ * without blocking the loop.  The request is held by the call until
+ * `complete_ws_introspect` sends it on.
+ *
+ * @return 0 on success, -1 if the call couldn't be sent.
+ */
+static int start_ws_introspect(struct lws *wsi, struct json_request *jreq,
+                               int domain)
+{
+    struct ws_session *session;
+    struct ws_pending *pending;
+    DBusPendingCall *call;
+
+    session = (struct ws_session *) lws_wsi_user(wsi);
+    if (!session)
+        return -1;
+
+    call = send_introspect(jreq);
+    if (!call)
+        return -1;
+
+    pending = calloc(1, sizeof *pending);
+    if (!pending)
+        DBUS_BROKER_ERROR("Calloc Failed!");
+
+    pending->jreq = jreq;
+    pending->domain = domain;
+    pending->id = jreq->id;
+    pending->wsi = wsi;
+    pending->session = session;
+    pending->call = call;
+    track_ws_pending(wsi, session, pending);
+
+    if (!dbus_pending_call_set_notify(call, complete_ws_introspect, pending,
+                                      free_ws_introspect))
+        DBUS_BROKER_ERROR("Malloc Failed!");
+
+    return 0;
+}
+
 /**
- * Callback function made for any pending Websocket requests.
+ * Callback function made for any pending Websocket requests.  The dbus call
+ * is only sent here, its reply is queued on the session once it arrives.  A
+ * request on an object that hasn't been introspected yet waits on its
+ * Introspect reply first, the loop goes on meanwhile.
  *
  * @param wsi the main Websockets api context object.
  * @param raw_req the raw bytes read from the pending request.
@@ -148,8 +642,6 @@ int ws_request_handler(struct lws *wsi, char *raw_req)
 {
     int client, domain;
     struct json_request *jreq;
-    struct json_response *jrsp;
-    char *reply;
 
     client = lws_get_socket_fd(wsi);
     if (client < 0)
@@ -158,33 +650,16 @@ int ws_request_handler(struct lws *wsi, char *raw_req)
     domain = get_domid(client);
 
     jreq = convert_json_request(raw_req);
-    if (!jreq || is_request_allowed(&jreq->dmsg, true, domain) == false)
+    if (!jreq)
         return -1;
 
-    jreq->wsi = wsi;
-    jrsp = make_json_request(jreq);
-
-    if (!jrsp)
-        goto free_req;
-
-    reply = prepare_json_reply(jrsp);
-    if (!reply)
-        goto free_resp;
+    if (!jreq->jargs)
+        return dispatch_ws_request(wsi, jreq, domain);
 
-    lws_ring_insert(ring, reply, 1);
-    free(reply);
-
-    if (signal_subscribers < MAX_SIGNALS &&
-        strcmp("AddMatch", jreq->dmsg.member) == 0) {
-        add_ws_signal(jreq->conn, jreq->dmsg.args[0], wsi);
+    if (start_ws_introspect(wsi, jreq, domain) < 0) {
+        free_json_request(jreq);
+        return -1;
     }
 
-free_req:
-    free_json_request(jreq);
-
-free_resp:
-    free(jrsp);
-
     return 0;
 }
-
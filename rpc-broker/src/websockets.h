@@ -30,22 +30,94 @@
 
 #define WS_LOOP_TIMEOUT             100  /* length of time each service of the websocket */
                                          /* event-loop (millisecs) */
-#define WS_RING_BUFFER_MEMBER_SIZE 8192
-#define WS_RING_BUFFER_MEMBER_NUM    64
-
-struct lws_ring *ring;
-
 
 #define WS_USER_MEM_SIZE 8192  /* the amount memory that is allocated for user */
                                /* for each ws-callback */
 
+#define WS_QUEUE_LEN        64  /* replies and signals queued per session */
+#define WS_QUEUE_HIGH_WATER 48  /* stop reading requests from the session */
+#define WS_QUEUE_LOW_WATER  16  /* resume reading requests */
+#define WS_WRITE_BATCH       8  /* frames written per writeable callback */
+#define WS_FRAGMENT_SIZE  8192  /* larger messages go out as continuation */
+                                /* frames */
+#define WS_MAX_IN_FLIGHT    32  /* dbus calls awaiting a reply per session */
+#define WS_DBUS_TIMEOUT     10  /* websocket service time while calls are in */
+                                /* flight, when lws can't run on libuv */
+
+/**
+ * @brief an immutable serialized message, shared by every session queue it
+ * has been put on and freed with its last reference.  The payload starts
+ * LWS_PRE bytes into `data`, lws only ever writes to that headroom.  Only the
+ * websockets loop touches these so the count isn't atomic.
+ */
+struct ws_buffer {
+    size_t refs;
+    size_t len;
+    unsigned char data[];
+};
+
+struct ws_session;
+
+/**
+ * @brief a JSON request whose dbus reply hasn't arrived yet, kept on the
+ * session that made it so a closing session can cancel the call.  It lives in
+ * the arena of the request, which is freed along with the pending call.  The
+ * Introspect call of a request waiting on its signature is tracked the same
+ * way, that one is allocated on its own and holds the request in `jreq`
+ * along with the `domain` it came from.
+ */
+struct ws_pending {
+    uint32_t id;
+    int domain;
+    struct json_arena *arena;
+    struct json_request *jreq;
+    struct lws *wsi;
+    struct ws_session *session;
+    DBusPendingCall *call;
+    struct ws_pending *next;
+    struct ws_pending *prev;
+};
+
+/**
+ * @brief per-session data of a websocket client.
+ *
+ * Every session has its own bounded queue of outbound messages, so replies
+ * and signals only ever go to the session they belong to.  Reading requests
+ * off a session is paused while its queue is above the high water mark, or
+ * while it has WS_MAX_IN_FLIGHT dbus calls waiting on a reply.  Replies are
+ * queued in the order they complete, the request `id` ties them together.
+ * `sent` is how much of the message at the head has gone out so far.
+ */
+struct ws_session {
+    bool throttled;
+    bool paused;
+    uint32_t signal_serial;
+    size_t in_flight;
+    struct ws_pending *pending;
+    size_t head;
+    size_t count;
+    size_t sent;
+    size_t dropped;
+    struct ws_buffer *queue[WS_QUEUE_LEN];
+    char request[WS_USER_MEM_SIZE];
+};
+
+/* dbus calls in flight over every session */
+size_t ws_requests_in_flight;
 
 struct json_response;
 
 /* src/websockets.c */
-char *prepare_json_reply(struct json_response *jrsp);
+struct ws_buffer *new_ws_buffer(const char *payload, size_t len);
+
+void release_ws_buffer(struct ws_buffer *buffer);
 
-struct lws_context *create_ws_context(int port);
+struct ws_buffer *prepare_json_reply(struct json_response *jrsp);
+
+struct lws_context *create_ws_context(uv_loop_t *loop, int port);
 
 int ws_request_handler(struct lws *wsi, char *raw_req);
 
+int ws_queue_buffer(struct lws *wsi, struct ws_buffer *buffer);
+
+int ws_queue_signal(struct lws *wsi, struct ws_buffer *buffer, uint32_t serial);